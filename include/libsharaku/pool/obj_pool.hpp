@@ -38,87 +38,635 @@
 #endif
 
 // ゲームオブジェクトpoolを管理するコンテナ
+//
+// initializeで指定した数のオブジェクトを持つ。set_growthでチャンクの
+// オブジェクト数を指定すると、空の場合にチャンク単位でオブジェクトを
+// 追加する。(max_cntを指定した場合はその数まで)
+// 追加したチャンクはpoolの破棄まで開放しない。
+//
+// MTにtrueを指定するとスレッドセーフとなる。
+// 各スレッドは空きオブジェクトのスタックを持ち、獲得、開放はスタックで
+// 行う。スタックが空、もしくはOBJ_POOL_LOCAL_MAXを超えた場合のみ、
+// ロックを取得して共有のスタック(__pool)と半分を受け渡す。
+// スレッドの終了時、スレッドのスタックは共有のスタックへ返却する。
+// MTがfalse(デフォルト)の場合は同期を行わない。
+//
+// emplaceはTのコンストラクタを実行し、destroyはTのデストラクタを実行して
+// 返却する。alloc/freeはTのコンストラクタ、デストラクタを実行せず、
+// constructor_t/destructor_tのみを実行する。
+// poolが獲得する領域はalignof(T)の境界に配置する。
+// pool_ptrは破棄時にオブジェクトをdestroyで返却するハンドルであり、
+// makeで作成する。
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <new>
+#include <utility>
 #include <libsharaku/container/list.h>
 
-template<typename T>
+#define OBJ_POOL_LOCAL_MAX	32	// スレッドごとのスタックの最大数
+#define OBJ_POOL_LOCK_SPIN	128	// ロック待ちでCPUを譲るまでのスピン回数
+
+// スレッドごとの空きオブジェクトのスタック
+// 空きオブジェクトは先頭でつなぐ。
+struct obj_pool_local {
+	uint64_t	l_id;		// 所有するpoolのid
+	void		*l_head;
+	uint32_t	l_cnt;
+	void		(*l_flush)(void *pool, void *head, uint32_t cnt);
+};
+
+// スレッドセーフなpoolの登録情報
+// スレッドの終了時に、スタックの返却先が破棄されていないかを確認する。
+struct obj_pool_reg {
+	list_head_t	r_list;
+	uint64_t	r_id;
+	void		*r_pool;
+};
+
+// スレッドごとのスタックのテーブル。poolのidで参照する。
+struct obj_pool_tls {
+	uint64_t		t_cnt;
+	struct obj_pool_local	*t_local;
+
+	~obj_pool_tls();
+};
+
+inline pthread_mutex_t *
+__obj_pool_reg_lock(void)
+{
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	return &lock;
+}
+
+inline list_head_t *
+__obj_pool_reg_list(void)
+{
+	static list_head_t list = LIST_HEAD_INIT(list);
+	return &list;
+}
+
+// poolのidの払い出し元
+// 下位32ビットはスレッドごとのテーブルの索引であり、破棄したpoolの索引を
+// 再利用する。上位32ビットは払い出しごとに変え、破棄したpoolのスタックを
+// 区別する。__obj_pool_reg_lockで保護する。
+struct obj_pool_ids {
+	uint32_t	i_next;
+	uint32_t	i_gen;
+	uint32_t	i_cnt;
+	uint32_t	i_size;
+	uint32_t	*i_free;
+};
+
+inline struct obj_pool_ids *
+__obj_pool_ids(void)
+{
+	static struct obj_pool_ids ids;
+	return &ids;
+}
+
+// __obj_pool_reg_lockを保持して呼び出すこと。
+inline uint64_t
+__obj_pool_id_alloc(void)
+{
+	struct obj_pool_ids *ids = __obj_pool_ids();
+	uint32_t idx;
+
+	if (ids->i_cnt) {
+		idx = ids->i_free[--ids->i_cnt];
+	} else {
+		idx = ids->i_next++;
+	}
+	return ((uint64_t)++ids->i_gen << 32) | idx;
+}
+
+// 破棄したpoolの索引を返却する。
+// 記録できない場合は再利用しない。(テーブルが大きくなるのみ)
+// __obj_pool_reg_lockを保持して呼び出すこと。
+inline void
+__obj_pool_id_free(uint64_t id)
+{
+	struct obj_pool_ids *ids = __obj_pool_ids();
+	uint32_t *idx;
+	uint32_t size;
+
+	if (ids->i_cnt == ids->i_size) {
+		size = ids->i_size ? ids->i_size * 2 : 16;
+		idx = (uint32_t *)realloc(ids->i_free, sizeof(*idx) * size);
+		if (!idx) {
+			return;
+		}
+		ids->i_free = idx;
+		ids->i_size = size;
+	}
+	ids->i_free[ids->i_cnt++] = (uint32_t)id;
+}
+
+// ロックの解放を待つ間、同じコアの他のハードウェアスレッドへ譲る。
+inline void
+__obj_pool_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield" ::: "memory");
+#endif
+}
+
+inline struct obj_pool_tls *
+__obj_pool_tls(void)
+{
+	static thread_local struct obj_pool_tls tls;
+	return &tls;
+}
+
+inline
+obj_pool_tls::~obj_pool_tls()
+{
+	struct obj_pool_local *local;
+	struct obj_pool_reg *reg;
+	list_head_t *pos;
+	uint64_t id;
+
+	// 破棄されていないpoolへスタックを返却する。
+	// 破棄したpoolの索引を再利用したpoolとはidの上位が異なる。
+	pthread_mutex_lock(__obj_pool_reg_lock());
+	for (id = 0; id < t_cnt; id++) {
+		local = &t_local[id];
+		if (!local->l_cnt) {
+			continue;
+		}
+		list_for_each(pos, __obj_pool_reg_list()) {
+			reg = (struct obj_pool_reg *)pos;
+			if (reg->r_id == local->l_id) {
+				local->l_flush(reg->r_pool, local->l_head,
+					       local->l_cnt);
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(__obj_pool_reg_lock());
+	::free(t_local);
+	t_local = NULL;
+	t_cnt = 0;
+}
+
+template<typename T, bool MT = false>
+struct pool_ptr;
+
+template<typename T, bool MT = false>
 struct obj_pool {
 	typedef void (*constructor_t)(T *object);
 	typedef void (*destructor_t)(T *object);
 
 	obj_pool() {
-		__constructor = NULL;
-		__destructor = NULL;
-		init_list_head(&__pool);
-		__objp = NULL;
+		__init();
 	}
 
-	obj_pool(int32_t cnt, T *addr = NULL) {
-		__constructor = NULL;
-		__destructor = NULL;
-		init_list_head(&__pool);
-		__objp = NULL;
+	obj_pool(int32_t cnt) {
+		__init();
+		initialize(cnt);
+	}
 
+	obj_pool(int32_t cnt, T *addr) {
+		__init();
 		initialize(cnt, addr);
 	}
 
 	~obj_pool() {
-		if (__objp) {
-			free(__objp);
+		list_head_t *chunk;
+
+		if (MT) {
+			pthread_mutex_lock(__obj_pool_reg_lock());
+			list_del(&__reg.r_list);
+			__obj_pool_id_free(__reg.r_id);
+			pthread_mutex_unlock(__obj_pool_reg_lock());
+		}
+		if (__objp && __objp_own) {
+			::free(__objp);
+		}
+		while (!list_empty(&__chunks)) {
+			chunk = __chunks.next;
+			list_del(chunk);
+			::free(chunk);
 		}
 		init_list_head(&__pool);
 	}
 
-	int initialize(int32_t cnt, T *addr = NULL) {
+	int initialize(int32_t cnt) {
+		__slot_t *slots;
 		int idx;
 		init_list_head(&__pool);
 
-		if (!addr) {
-			__objp = (T*)malloc(sizeof(T) * cnt);
-		} else {
-			__objp = addr;
-		}
-		if (!__objp) {
+		slots = (__slot_t *)__mem_alloc(sizeof(__slot_t) * cnt);
+		if (!slots) {
 			return -errno;
 		}
+		__objp = (T *)slots;
+		__objp_own = true;
+		for (idx = 0; idx < cnt; idx++) {
+			__free(&slots[idx]);
+		}
+		__cnt += cnt;
+		return 0;
+	}
+
+	// 利用者が用意した領域をpoolとする。
+	// 空きオブジェクトは領域をlist_head_tとして使用する。
+	int initialize(int32_t cnt, T *addr) {
+		static_assert(sizeof(T) >= sizeof(list_head_t),
+			      "T must be large enough to hold list_head_t");
+		static_assert(alignof(T) >= alignof(list_head_t) ||
+			      sizeof(T) % alignof(list_head_t) == 0,
+			      "T array must keep list_head_t aligned");
+		int idx;
+
+		if (!addr) {
+			return initialize(cnt);
+		}
+		init_list_head(&__pool);
+		__objp = addr;
 		for (idx = 0; idx < cnt; idx++) {
 			__free(&__objp[idx]);
 		}
+		__cnt += cnt;
 		return 0;
 	}
 
+	// 空の場合にchunk_cnt個ずつオブジェクトを追加する。
+	// max_cntが0以外の場合は、オブジェクトの総数をmax_cntまでとする。
+	void set_growth(int32_t chunk_cnt, int32_t max_cnt = 0) {
+		__lock();
+		__chunk_cnt = chunk_cnt;
+		__max_cnt = max_cnt;
+		__unlock();
+	}
+
+	// poolが持つオブジェクトの総数を返す。
+	int32_t capacity(void) const {
+		return __cnt;
+	}
+
 	// poolからメモリを獲得する
 	T *alloc(void) {
-		list_head_t *new_;
-		if (!list_empty(&__pool)) {
-			new_ = __pool.next;
-			list_del_init(new_);
-			if (__constructor) {
-				__constructor((T *)new_);
-			}
-			return (T *)new_;
-		} else {
-			return NULL;
+		T *obj = (T *)__alloc_raw();
+
+		if (obj && __constructor) {
+			__constructor(obj);
 		}
+		return obj;
 	}
 	void free(T *obj) {
 		if (__destructor) {
 			__destructor(obj);
 		}
-		__free(obj);
+		__free_raw(obj);
+	}
+
+	// poolからメモリを獲得し、argsでTを構築する。
+	// 獲得できない場合はNULLを返す。
+	template<typename... Args>
+	T *emplace(Args&&... args) {
+		void *mem = __alloc_raw();
+
+		if (!mem) {
+			return NULL;
+		}
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS)
+		try {
+			return new (mem) T(std::forward<Args>(args)...);
+		} catch (...) {
+			__free_raw(mem);
+			throw;
+		}
+#else
+		return new (mem) T(std::forward<Args>(args)...);
+#endif
+	}
+
+	// emplaceで構築したオブジェクトを破棄し、poolへ返却する。
+	void destroy(T *obj) {
+		if (!obj) {
+			return;
+		}
+		obj->~T();
+		__free_raw(obj);
+	}
+
+	// emplaceで構築したオブジェクトをpool_ptrで返す。
+	template<typename... Args>
+	pool_ptr<T, MT> make(Args&&... args) {
+		return pool_ptr<T, MT>(this, emplace(std::forward<Args>(args)...));
 	}
 
 protected:
-	void __free(T *obj) {
+	// 空きオブジェクトを格納する領域
+	// Tがlist_head_tより小さい場合でも空きリストをつなげるようにする。
+	union __slot_t {
+		list_head_t		s_list;
+		alignas(T) unsigned char s_obj[sizeof(T)];
+	};
+	static_assert(sizeof(__slot_t) % alignof(T) == 0,
+		      "slot size must keep T aligned");
+
+	// alignof(T)の境界にsizeバイトを獲得する。
+	static void *__mem_alloc(size_t size) {
+		const size_t align = alignof(__slot_t);
+
+		if (align <= alignof(max_align_t)) {
+			return malloc(size);
+		}
+		return aligned_alloc(align, (size + align - 1) & ~(align - 1));
+	}
+
+	void *__alloc_raw(void) {
+		list_head_t *new_;
+
+		if (MT) {
+			return __local_alloc();
+		}
+		if (list_empty(&__pool) && __expand()) {
+			return NULL;
+		}
+		new_ = __pool.next;
+		list_del_init(new_);
+		return new_;
+	}
+
+	void __free_raw(void *obj) {
+		if (MT) {
+			__local_free(obj);
+		} else {
+			__free(obj);
+		}
+	}
+
+	void __init(void) {
+		__constructor = NULL;
+		__destructor = NULL;
+		init_list_head(&__pool);
+		init_list_head(&__chunks);
+		__objp = NULL;
+		__objp_own = false;
+		__cnt = 0;
+		__chunk_cnt = 0;
+		__max_cnt = 0;
+		__lock_v = 0;
+		if (MT) {
+			__reg.r_pool = this;
+			pthread_mutex_lock(__obj_pool_reg_lock());
+			__reg.r_id = __obj_pool_id_alloc();
+			list_add_tail(&__reg.r_list, __obj_pool_reg_list());
+			pthread_mutex_unlock(__obj_pool_reg_lock());
+		}
+	}
+
+	void __free(void *obj) {
 		list_head_t *listp = (list_head_t *)obj;
 		init_list_head(listp);
 		list_add_tail(listp, &__pool);
 	}
 
+	// 保持しているスレッドが横取りされている場合に備え、
+	// OBJ_POOL_LOCK_SPIN回を超えて待つ場合はCPUを譲る。
+	void __lock(void) {
+		uint32_t spin = 0;
+
+		if (!MT) {
+			return;
+		}
+		while (__atomic_exchange_n(&__lock_v, 1, __ATOMIC_ACQUIRE)) {
+			while (__atomic_load_n(&__lock_v, __ATOMIC_RELAXED)) {
+				if (++spin < OBJ_POOL_LOCK_SPIN) {
+					__obj_pool_cpu_relax();
+				} else {
+					sched_yield();
+				}
+			}
+		}
+	}
+
+	void __unlock(void) {
+		if (MT) {
+			__atomic_store_n(&__lock_v, 0, __ATOMIC_RELEASE);
+		}
+	}
+
+	// チャンクを追加する。
+	// MTの場合は呼び出し元でロックしていること。
+	int __expand(void) {
+		size_t hdr;
+		int32_t cnt = __chunk_cnt;
+		char *chunk;
+		__slot_t *objs;
+		int32_t idx;
+
+		if (!cnt) {
+			return -ENOMEM;
+		}
+		if (__max_cnt && __max_cnt - __cnt < cnt) {
+			cnt = __max_cnt - __cnt;
+		}
+		if (cnt <= 0) {
+			return -ENOSPC;
+		}
+		// チャンクの先頭にチャンクのリストを置く。
+		hdr = (sizeof(list_head_t) + alignof(__slot_t) - 1)
+					 & ~(alignof(__slot_t) - 1);
+		chunk = (char *)__mem_alloc(hdr + sizeof(__slot_t) * cnt);
+		if (!chunk) {
+			return -ENOMEM;
+		}
+		list_add_tail((list_head_t *)chunk, &__chunks);
+		objs = (__slot_t *)(chunk + hdr);
+		for (idx = 0; idx < cnt; idx++) {
+			__free(&objs[idx]);
+		}
+		__cnt += cnt;
+		return 0;
+	}
+
+	// 呼び出したスレッドのスタックを取得する。
+	struct obj_pool_local *__local(void) {
+		struct obj_pool_tls *tls = __obj_pool_tls();
+		struct obj_pool_local *local;
+		uint64_t id = __reg.r_id;
+		uint32_t idx = (uint32_t)id;
+		uint64_t cnt;
+
+		if (idx >= tls->t_cnt) {
+			cnt = tls->t_cnt ? tls->t_cnt : 8;
+			while (cnt <= idx) {
+				cnt *= 2;
+			}
+			local = (struct obj_pool_local *)
+				realloc(tls->t_local, sizeof(*local) * cnt);
+			if (!local) {
+				return NULL;
+			}
+			for (uint64_t i = tls->t_cnt; i < cnt; i++) {
+				local[i].l_id = 0;
+				local[i].l_head = NULL;
+				local[i].l_cnt = 0;
+			}
+			tls->t_local = local;
+			tls->t_cnt = cnt;
+		}
+		local = &tls->t_local[idx];
+		// 破棄したpoolのスタックが残っている場合は破棄する。
+		if (local->l_id != id) {
+			local->l_id = id;
+			local->l_head = NULL;
+			local->l_cnt = 0;
+			local->l_flush = __flush;
+		}
+		return local;
+	}
+
+	// スタックのオブジェクトを共有のスタックへ返却する。
+	static void __flush(void *pool, void *head, uint32_t cnt) {
+		obj_pool *p = (obj_pool *)pool;
+		void *next;
+
+		p->__lock();
+		for (; cnt; cnt--) {
+			next = *(void **)head;
+			p->__free(head);
+			head = next;
+		}
+		p->__unlock();
+	}
+
+	void *__local_alloc(void) {
+		struct obj_pool_local *local = __local();
+		list_head_t *obj;
+		void *head;
+
+		if (!local) {
+			return NULL;
+		}
+		if (!local->l_cnt) {
+			// 共有のスタックから半分を補充する。
+			__lock();
+			while (local->l_cnt < OBJ_POOL_LOCAL_MAX / 2) {
+				if (list_empty(&__pool) && __expand()) {
+					break;
+				}
+				obj = __pool.next;
+				list_del(obj);
+				*(void **)obj = local->l_head;
+				local->l_head = obj;
+				local->l_cnt++;
+			}
+			__unlock();
+			if (!local->l_cnt) {
+				return NULL;
+			}
+		}
+		head = local->l_head;
+		local->l_head = *(void **)head;
+		local->l_cnt--;
+		return head;
+	}
+
+	void __local_free(void *obj) {
+		struct obj_pool_local *local = __local();
+		void *head;
+
+		if (!local) {
+			__lock();
+			__free(obj);
+			__unlock();
+			return;
+		}
+		*(void **)obj = local->l_head;
+		local->l_head = obj;
+		local->l_cnt++;
+		if (local->l_cnt < OBJ_POOL_LOCAL_MAX) {
+			return;
+		}
+		// 半分を共有のスタックへ返却する。
+		head = local->l_head;
+		for (uint32_t i = 0; i < OBJ_POOL_LOCAL_MAX / 2; i++) {
+			local->l_head = *(void **)local->l_head;
+		}
+		local->l_cnt -= OBJ_POOL_LOCAL_MAX / 2;
+		__flush(this, head, OBJ_POOL_LOCAL_MAX / 2);
+	}
+
 	constructor_t	__constructor;
 	destructor_t	__destructor;
 	list_head_t	__pool;
 	T		*__objp;
+	bool		__objp_own;
+	list_head_t	__chunks;	// 追加したチャンク
+	int32_t		__cnt;		// オブジェクトの総数
+	int32_t		__chunk_cnt;
+	int32_t		__max_cnt;
+	uint32_t	__lock_v;
+	struct obj_pool_reg __reg;	// MTのみ
+};
+
+// obj_poolのオブジェクトを所有するハンドル
+// 破棄時にオブジェクトをdestroyでpoolへ返却する。移動のみ可能。
+template<typename T, bool MT>
+struct pool_ptr {
+	pool_ptr() : __pool(NULL), __obj(NULL) {}
+	pool_ptr(obj_pool<T, MT> *pool, T *obj) : __pool(pool), __obj(obj) {}
+	pool_ptr(pool_ptr &&other) : __pool(other.__pool), __obj(other.__obj) {
+		other.__obj = NULL;
+	}
+	pool_ptr(const pool_ptr &) = delete;
+	pool_ptr &operator=(const pool_ptr &) = delete;
+
+	pool_ptr &operator=(pool_ptr &&other) {
+		if (this != &other) {
+			reset();
+			__pool = other.__pool;
+			__obj = other.__obj;
+			other.__obj = NULL;
+		}
+		return *this;
+	}
+
+	~pool_ptr() {
+		reset();
+	}
+
+	T *get(void) const {
+		return __obj;
+	}
+	T &operator*(void) const {
+		return *__obj;
+	}
+	T *operator->(void) const {
+		return __obj;
+	}
+	explicit operator bool(void) const {
+		return __obj != NULL;
+	}
+
+	// 所有を放棄してオブジェクトを返す。
+	T *release(void) {
+		T *obj = __obj;
+		__obj = NULL;
+		return obj;
+	}
+
+	// オブジェクトをpoolへ返却する。
+	void reset(void) {
+		if (__obj) {
+			__pool->destroy(__obj);
+			__obj = NULL;
+		}
+	}
+
+private:
+	obj_pool<T, MT>	*__pool;
+	T		*__obj;
 };
 
 #endif // _OBJ_POOL_HPP_
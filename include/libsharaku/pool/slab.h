@@ -37,26 +37,40 @@
 	#endif
 #endif
 
-#include <libsharaku/container/plist.h>
+#include <libsharaku/container/list.h>
+
+// 新しいglibcでは__malloc_and_calloc_definedが定義されないため、
+// stdlib.hのインクルードガードでも判定する。
+#if defined(__malloc_and_calloc_defined) || defined(_STDLIB_H)
+#define __SLAB_HAVE_MALLOC
+#endif
 
 #ifndef MEMORY_ALLOC
-#ifdef __malloc_and_calloc_defined
+#ifdef __SLAB_HAVE_MALLOC
 #define MEMORY_ALLOC	malloc
 #else // __malloc_and_calloc_defined
 #warning "malloc and calloc not defined"
 #define MEMORY_ALLOC	NULL
-#endif // __malloc_and_calloc_defined
+#endif // __SLAB_HAVE_MALLOC
 #endif // MEMORY_ALLOC
 
 #ifndef MEMORY_FREE
-#ifdef __malloc_and_calloc_defined
+#ifdef __SLAB_HAVE_MALLOC
 #define MEMORY_FREE	free
 #else // __malloc_and_calloc_defined
 #warning "malloc and calloc not defined"
 #define MEMORY_FREE	NULL
-#endif // __malloc_and_calloc_defined
+#endif // __SLAB_HAVE_MALLOC
 #endif // MEMORY_FREE
 
+#ifndef MEMORY_ALLOC_ALIGNED
+#ifdef __SLAB_HAVE_MALLOC
+#define MEMORY_ALLOC_ALIGNED	aligned_alloc
+#else // __SLAB_HAVE_MALLOC
+#define MEMORY_ALLOC_ALIGNED	NULL
+#endif // __SLAB_HAVE_MALLOC
+#endif // MEMORY_ALLOC_ALIGNED
+
 CPP_SRC(extern "C" {)
 
 // SLABを使用してメモリを確保する。
@@ -68,32 +82,195 @@ CPP_SRC(extern "C" {)
 // SLABは密度の濃いものから順に取得される。
 // 密度は(max_cnt - alloc_cnt) * N / max_cntの値で求められる。
 // 先にNを掛けることで、整数計算のみで0 ～ N値へ変換する。
-// この密度を優先度としてplistを使用して優先度順に並べる。
-// Nを大きくすると、細かく段階を分けられるが抜き差しが大きくなり性能が
-// 劣化する原因となる。
+// この密度ごとにN+1個のビン(list)を持ち、nodeを密度のビンに登録する。
+// 空でないビンはビットマップで管理し、獲得時は最も密度の濃いビンを
+// ctz命令1回で求める。密度0のビンはfullとして扱い、獲得には使用しない。
+// 再登録はビン間のlist移動のみのため、Nによらず一定時間で行える。
+// Nを大きくすると、細かく段階を分けられるが抜き差しが増え性能が
+// 劣化する原因となる。(Nは31以下であること)
 // 小さくすると、SLABが開放されにくくなる。
 //
 // 指定により、nodeサイズ、bufの最大数を変更できる。
 //
+// slab_set_numaでNUMAを有効にすると、NUMAノードごとにnodeのpool(密度ごとの
+// list)を持ち、獲得は呼び出したスレッドのNUMAノードのpoolから行う。
+// nodeのメモリはmbindでNUMAノードに割り当てる。NUMAノードはgetcpuで求めるが、
+// slab_set_numa_nodeでスレッドごとに指定することもできる。
+// ローカルのpoolに空きがない場合の動作はpolicyで指定する。
+//  SLAB_NUMA_PREFER	ローカルに新しいnodeを作成する。作成できない場合は
+//			他のNUMAノードのnodeを使用する。
+//  SLAB_NUMA_REMOTE	他のNUMAノードのnodeを使用する。空きがない場合は
+//			ローカルに新しいnodeを作成する。(メモリ使用量優先)
+//  SLAB_NUMA_STRICT	ローカルのnodeのみを使用する。
+// NUMAノードが1つの環境では、すべてNUMAノード0のpoolで動作する。
+//
+// 開放時にslabのロックを取得できない場合(他スレッドが獲得、開放中)は、
+// ロックを待たずにnodeのリモート開放リストへ1回のCASでつなぐ。
+// リストの要素は、次にロックを取得したスレッドが獲得、開放の際に
+// まとめて回収する。(slab_shrinkでも回収する)
+//
+// すべてのbufが開放されたnodeは、slab_set_keep_emptyで指定した数まで
+// 開放せずに保持する。(デフォルトは0)
+// nodeの境界付近で獲得、開放を繰り返す場合に、nodeの獲得と初期化が
+// 繰り返されることを防ぐ。保持したnodeはslab_shrinkで開放する。
+//
+// slab_cacheはスピンロックで保護されるため、複数スレッドから利用できる。
+// slab_set_magazineでマガジンを有効にすると、スレッドごとに空きバッファの
+// スタック(マガジン)を持ち、alloc/freeはロックもatomic命令も使用せずに
+// マガジンから行う。ロックはマガジンの補充、返却時のみ取得する。
+// マガジンに保持されているバッファはnodeからは獲得済みとして扱われるため、
+// s_buf_cnt、s_max_buf_cntの判定にはマガジン内のバッファも含まれる。
+// スレッド終了時、マガジン内のバッファはslabへ返却される。
+//
+// nodeサイズが2のべき乗で境界指定の獲得関数(s_mem_alloc_aligned)がある場合、
+// nodeはs_node_size境界に配置され、バッファの所属するnodeはアドレスを
+// s_node_size境界に丸めて求める。(slab_cache_free*のみ)
+// 獲得関数はslab_set_mem_allocator_alignedで変更できる。
+// slab_set_mem_allocatorで境界指定のない獲得関数を設定した場合、
+// nodeは境界に配置されない。
+//
+// SLAB_F_LEANを指定したslabはヘッダ、フッタを付けずにバッファを配置する。
+// 空きバッファは自身の領域で空きリストをつなぎ、所属するnodeはバッファの
+// アドレスから求める。そのためnodeは境界に配置されなければならない。
+// ヘッダを持たないため、開放にはslab_cache_free*を使用すること。
+// また参照カウント(slab_get/slab_put)、獲得元の記録は利用できない。
+// SLAB_DEFAULT_FLAGSにSLAB_F_LEANを定義すると、SLAB_INIT/INIT_SLABで
+// 初期化したすべてのslabがleanとなる。
+//
+// コンストラクタは獲得のたびに、デストラクタは開放のたびに実行する。
+// SLAB_F_CTOR_ONCEを指定したslabは、コンストラクタを要素を初めて獲得した
+// ときに1回だけ実行し、開放した要素は構築済みのまま再利用する。
+// デストラクタはnodeを開放するときに構築済みの要素に対して実行する。
+// 利用者は構築済みの状態に戻してから開放すること。
+// 空き要素のバッファを書き換えないよう、SLAB_F_LEAN、SLAB_F_POISONとは
+// 同時に指定できない。(獲得が-EINVALとなる)
+//
 // SLABの作成方法
 //  - グローバル変数としてstruct slab_cacheを作成し、SLAB_INITを使用して作成
-//  - slab_create*を使用して動的に作成。
+//  - slab_createを使用して動的に作成。slab_destroyで破棄する。
 //  - mallocでメモリを獲得、INIT_SLAB*を使用して初期化。(非推奨)
-//    この方法の場合、slab解体時の全バッファ開放チェックは利用者の責任となります。
+//    この方法の場合、slab解体時はslab_destroyでnodeを開放してから
+//    利用者がメモリを開放すること。
 
 // SLABのサイズは1MB単位とする
 #define SLAB_PRIO		10
 #define SLAB_DEFAULT_SZ		1048576
 #define SLAB_NODE_SZ_MIN	4096
 
+// nodeの先頭の要素をずらす単位(キャッシュライン)
+#define SLAB_COLOR_SZ		64
+
+// slabの動作フラグ
+#define SLAB_F_LEAN		0x00000001	// ヘッダ、フッタなし
+#define SLAB_F_BIASED		0x00000002	// 参照カウントのバイアスモード
+#define SLAB_F_POISON		0x00000004	// 開放したバッファをSLAB_POISONで埋める
+#define SLAB_F_CTOR_ONCE	0x00000008	// 構築済みの要素をキャッシュする
+#define SLAB_F_CREATED		0x80000000	// slab_createで作成(内部用)
+
+// slab_destroyの動作
+#define SLAB_DESTROY_DTOR	0x00000001	// 使用中のバッファのデストラクタを実行
+
+// SLAB_F_POISONで開放したバッファを埋める値
+#define SLAB_POISON		0x6B
+
+#ifndef SLAB_DEFAULT_FLAGS
+#define SLAB_DEFAULT_FLAGS	0
+#endif
+
+// NUMAの動作(slab_set_numa)
+#define SLAB_NUMA_OFF		0
+#define SLAB_NUMA_PREFER	1
+#define SLAB_NUMA_REMOTE	2
+#define SLAB_NUMA_STRICT	3
+#define SLAB_NUMA_MAX		8	// 扱うNUMAノードの最大数
+
+// マガジンのデフォルト段数と最大段数
+#define SLAB_MAGAZINE_SZ	32
+#define SLAB_MAGAZINE_MAX	1024
+
 typedef void (*slab_constructor)(void *buf, size_t sz);
 typedef void (*slab_destructor)(void *buf, size_t sz);
 typedef void *(*slab_mem_alloc)(size_t size);
 typedef void (*slab_mem_free)(void *buf);
+typedef void *(*slab_mem_alloc_aligned)(size_t align, size_t size);
+
+// 密度ごとのnodeのlist。NUMAノードごとに持つ。
+struct slab_pool {
+	struct list_head	p_bins[SLAB_PRIO + 1];	// 密度ごとのlist
+	uint32_t		p_bin_map;	// 空でないビンのビットマップ
+	uint32_t		p_empty_cnt;	// 保持中の空きnodeの数
+};
+
+// slabの統計カウンタ。slabのロック中に更新する。
+// スレッドごとのマガジン内の獲得、開放はマガジンごとに数え、
+// slab_statsで集計する。(c_mag_*は終了したスレッドのマガジンの分)
+struct slab_counter {
+	uint64_t		c_alloc;	// nodeからの獲得数
+	uint64_t		c_free;		// nodeへの返却数
+	uint64_t		c_node_alloc;
+	uint64_t		c_node_free;
+	uint64_t		c_buf_peak;	// s_buf_cntの最大値
+	uint64_t		c_limit_fail;	// s_max_buf_cntによる獲得失敗
+	uint64_t		c_fail;		// nodeを獲得できない獲得失敗
+	uint64_t		c_mag_alloc;
+	uint64_t		c_mag_free;
+	uint64_t		c_mag_in;
+	uint64_t		c_mag_out;
+};
+
+// slab_statsで取得する統計情報
+struct slab_stats {
+	const char		*st_name;
+	size_t			st_size;
+	size_t			st_node_size;
+	uint64_t		st_alloc;	// 利用者の獲得数
+	uint64_t		st_free;	// 利用者の開放数
+	uint64_t		st_node_alloc;	// nodeの獲得数
+	uint64_t		st_node_free;	// nodeの開放数
+	uint64_t		st_node_cnt;
+	uint64_t		st_node_objs;	// nodeあたりのバッファ数
+	uint64_t		st_buf_cnt;	// nodeから獲得中の数
+	uint64_t		st_buf_peak;	// st_buf_cntの最大値
+	uint64_t		st_mag_cnt;	// マガジンに保持中の数
+	uint64_t		st_limit_fail;	// s_max_buf_cntによる獲得失敗
+	uint64_t		st_alloc_fail;	// nodeを獲得できない獲得失敗
+	uint64_t		st_live_bytes;	// 利用者が使用中のバイト数
+	uint64_t		st_node_bytes;	// nodeのバイト数
+	uint32_t		st_bins[SLAB_PRIO + 1];	// 密度ごとのnode数
+};
+
+// slab_profileで取得する獲得箇所ごとの使用中の要素
+struct slab_site {
+	const char		*ss_src;	// 獲得したソースファイル
+	uint32_t		ss_line;	// 獲得した行
+	uint64_t		ss_cnt;		// 使用中の要素数
+	uint64_t		ss_bytes;	// 使用中のバイト数
+};
+
+// メモリの使用量が上限(slab_set_budget)に達したときに呼び出す回収処理。
+// sh_scanは少なくともbytesのnodeが空くように要素を開放し、開放した要素数を
+// 返す。nodeを獲得しようとしたスレッドで、slabをロックせずに呼び出す。
+struct slab_shrinker {
+	size_t			(*sh_scan)(struct slab_shrinker *sh,
+					   size_t bytes);
+	void			*sh_arg;
+	struct list_head	sh_list;
+};
+
+// slab_verifyの結果
+struct slab_verify {
+	uint64_t		v_objs;		// 検査した要素数
+	uint32_t		v_nodes;	// 検査したnode数
+	uint32_t		v_bad_hdr;	// ヘッダの破壊
+	uint32_t		v_bad_ftr;	// フッタの破壊(オーバーラン)
+	uint32_t		v_bad_list;	// 獲得済み、空きリストの破壊
+	uint32_t		v_bad_poison;	// 開放後の書き込み
+	void			*v_bad;		// 最初に検出した破壊のアドレス
+	int			v_done;		// 1周の検査を完了した
+};
 
 struct slab_cache {
-	struct plist_head	s_list;		// 密度ごとのlist
-	struct plist_head	s_flist;	// full list
+	struct slab_pool	s_pool;		// NUMAノード0のpool
 	uint32_t		s_node_cnt;
 	size_t			s_size;
 	size_t			s_node_size;
@@ -103,16 +280,42 @@ struct slab_cache {
 	slab_destructor		s_destructor;
 	slab_mem_alloc		s_mem_alloc;
 	slab_mem_free		s_mem_free;
+	uint32_t		s_lock;		// slab全体のロック
+	uint32_t		s_mag_id;	// マガジンの識別子(0は未割当)
+	uint32_t		s_mag_size;	// マガジン段数(0は無効)
+	uint32_t		s_flags;	// SLAB_F_*
+	slab_mem_alloc_aligned	s_mem_alloc_aligned;
+	uint32_t		s_keep_empty;	// 保持する空きnodeの数
+	uint32_t		s_numa_policy;	// SLAB_NUMA_*
+	struct slab_pool	*s_numa;	// NUMAノード1以降のpool
+	struct slab_node	*s_remote;	// リモート開放の回収待ちnode
+	const char		*s_name;
+	struct list_head	s_reg;		// 登録リスト(slab_register)
+	struct list_head	s_mags;		// マガジンのリスト
+	struct slab_counter	s_stat;
+	uint32_t		s_verify;	// slab_verifyの検査済みnode数
+	uint32_t		s_align;	// バッファの境界(0は指定なし)
+	uint32_t		s_color;	// 次に作成するnodeの色
 };
 
+// 要素はnodeの直後から配置するため、16バイト境界になるようにnodeの
+// サイズを16の倍数にする。
 struct slab_node {
-	struct plist_node		sn_plist;
-	struct list_head		sn_alist;
-	struct list_head		sn_flist;
+	struct list_head		sn_list;	// 密度のビン
+	uint32_t			sn_bin;
+	uint32_t			sn_nid;		// NUMAノード
+	struct slab_pool		*sn_pool;
+	struct list_head		sn_alist;	// 獲得済み(ヘッダ付きのみ)
+	void				*sn_free;	// 空きリスト
+	void				*sn_remote;	// リモート開放リスト
+	struct slab_node		*sn_rnext;	// 回収待ちのリスト
+	char				*sn_base;	// 先頭の要素
+	char				*sn_bump;	// 未使用領域の先頭
+	char				*sn_bump_end;	// 未使用領域の終端
 	uint32_t			sn_alloc_cnt;
 	uint32_t			sn_max_cnt;
 	struct slab_cache		*sn_slab;
-};
+} __attribute__((aligned(16)));
 
 // スラブを初期化する。（静的初期化）
 // SLAB_NODE_INIT	Nodeのサイズ、bufの数を指定する。
@@ -120,8 +323,7 @@ struct slab_node {
 // SLAB_NODE_INIT_DEF	Nodeのサイズは1MB、bufの数は無限。
 #define SLAB_INIT(slab, size, node_size, max_cnt)	\
 	{						\
-		PLIST_HEAD_INIT((slab).s_list),		\
-		PLIST_HEAD_INIT((slab).s_flist),	\
+		{ { { NULL, NULL } }, 0, 0 },		\
 		0,					\
 		size,					\
 		node_size,				\
@@ -130,8 +332,38 @@ struct slab_node {
 		NULL,					\
 		NULL,					\
 		MEMORY_ALLOC,				\
-		MEMORY_FREE				\
+		MEMORY_FREE,				\
+		0,					\
+		0,					\
+		0,					\
+		SLAB_DEFAULT_FLAGS,			\
+		MEMORY_ALLOC_ALIGNED,			\
+		0,					\
+		SLAB_NUMA_OFF,				\
+		NULL,					\
+		NULL,					\
+		#slab,					\
+		{ NULL, NULL },				\
+		{ NULL, NULL },				\
+		{ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 },	\
+		0,					\
+		0,					\
+		0					\
+	}
+
+// slabを定義し、プログラムの開始時にslab_registerで登録する。
+// staticを前に付けることができる。
+#define SLAB_DEFINE(slab, size, node_size, max_cnt)		\
+	struct slab_cache slab = SLAB_INIT(slab, size, node_size, max_cnt); \
+	static void __attribute__((constructor))		\
+	__slab_define_##slab(void)				\
+	{							\
+		slab_register(&slab);				\
 	}
+#define SLAB_DEFINE_SZ(slab, size, node_size)			\
+	SLAB_DEFINE(slab, size, node_size, 0)
+#define SLAB_DEFINE_DEF(slab, size)				\
+	SLAB_DEFINE(slab, size, SLAB_DEFAULT_SZ, 0)
 
 #define SLAB_INIT_SZ(slab, size, node_size)	\
 	SLAB_INIT(slab, size, node_size, 0)
@@ -139,11 +371,27 @@ struct slab_node {
 #define SLAB_INIT_DEF(slab, size)	\
 	SLAB_INIT(slab, size, SLAB_DEFAULT_SZ, 0)
 
+static inline void
+__slab_counter_init(struct slab_counter *c)
+{
+	c->c_alloc = 0;
+	c->c_free = 0;
+	c->c_node_alloc = 0;
+	c->c_node_free = 0;
+	c->c_buf_peak = 0;
+	c->c_limit_fail = 0;
+	c->c_fail = 0;
+	c->c_mag_alloc = 0;
+	c->c_mag_free = 0;
+	c->c_mag_in = 0;
+	c->c_mag_out = 0;
+}
+
 // slabを初期化する。
 #define INIT_SLAB(slab, size, node_size, max_cnt)	\
 	{						\
-		init_plist_head(&(slab)->s_list);	\
-		init_plist_head(&(slab)->s_flist);	\
+		(slab)->s_pool.p_bin_map = 0;		\
+		(slab)->s_pool.p_empty_cnt = 0;		\
 		(slab)->s_node_cnt = 0;			\
 		(slab)->s_size = size;			\
 		(slab)->s_node_size = node_size;	\
@@ -153,6 +401,24 @@ struct slab_node {
 		(slab)->s_destructor = NULL;		\
 		(slab)->s_mem_alloc = MEMORY_ALLOC;	\
 		(slab)->s_mem_free = MEMORY_FREE;	\
+		(slab)->s_lock = 0;			\
+		(slab)->s_mag_id = 0;			\
+		(slab)->s_mag_size = 0;			\
+		(slab)->s_flags = SLAB_DEFAULT_FLAGS;	\
+		(slab)->s_mem_alloc_aligned = MEMORY_ALLOC_ALIGNED;	\
+		(slab)->s_keep_empty = 0;		\
+		(slab)->s_numa_policy = SLAB_NUMA_OFF;	\
+		(slab)->s_numa = NULL;			\
+		(slab)->s_remote = NULL;		\
+		(slab)->s_name = #slab;			\
+		(slab)->s_reg.next = NULL;		\
+		(slab)->s_reg.prev = NULL;		\
+		(slab)->s_mags.next = NULL;		\
+		(slab)->s_mags.prev = NULL;		\
+		__slab_counter_init(&(slab)->s_stat);	\
+		(slab)->s_verify = 0;			\
+		(slab)->s_align = 0;			\
+		(slab)->s_color = 0;			\
 	}
 
 #define INIT_SLAB_SZ(slab, size, node_size)	\
@@ -165,10 +431,167 @@ struct slab_node {
 extern void* _slab_alloc(struct slab_cache *slab,
 				   const char *src, uint32_t line);
 // スラブから獲得したメモリを開放する。(参照カウント無視)
+// ヘッダ付きのslabのみ使用できる。
 extern int slab_free(void *buf);
+// 獲得元のslabを指定して開放する。(参照カウント無視)
+// leanのslabはこちらを使用すること。
+extern int slab_cache_free(struct slab_cache *slab, void *buf);
 #define slab_alloc(slab)	\
 		_slab_alloc(slab, __FILE__, __LINE__)
 
+// スラブからn個のメモリを一括で獲得する。
+// 獲得できた個数を返す。1個も獲得できない場合は-errnoを返す。
+// マガジンは経由せず、nodeの空きリストから直接獲得する。
+extern int _slab_alloc_bulk(struct slab_cache *slab, void **out, int n,
+			    const char *src, uint32_t line);
+#define slab_alloc_bulk(slab, out, n)	\
+		_slab_alloc_bulk(slab, out, n, __FILE__, __LINE__)
+
+// スラブから獲得したn個のメモリを一括で開放する。(参照カウント無視)
+// 異なるslabのメモリが混在してもよい。bufsの内容は書き換えられる。
+// 不正なメモリが含まれる場合は、それ以外を開放して-EFAULTを返す。
+extern int slab_free_bulk(void **bufs, int n);
+// 獲得元のslabを指定してn個のメモリを一括で開放する。
+extern int slab_cache_free_bulk(struct slab_cache *slab, void **bufs, int n);
+
+// 保持している空きnodeをすべて開放する。開放したnodeの数を返す。
+extern int slab_shrink(struct slab_cache *slab);
+
+// slabを作成し、nameで登録する。nameは複製する。
+// alignはバッファの境界で、0(指定なし)または2のべき乗。(slab_set_align)
+// node_sizeが0の場合はSLAB_DEFAULT_SZ、max_cntが0の場合は無制限とする。
+// flagsはSLAB_F_*。作成できない場合はNULLを返す。
+extern struct slab_cache *slab_create(const char *name, size_t size,
+				      size_t align, size_t node_size,
+				      uint64_t max_cnt, uint32_t flags);
+
+// slabのすべてのnodeを開放し、登録を解除する。
+// slab_createで作成したslabはslab_cache自体も開放する。
+// SLAB_INIT/INIT_SLABで初期化したslabは、破棄後に再度利用できる。
+// 開放されていないバッファの数を返す。バッファの内訳は破棄する前に
+// slab_dump_leaksで出力できる。
+// flagsにSLAB_DESTROY_DTORを指定した場合は、開放されていないバッファの
+// デストラクタを実行する。(ヘッダ付きのみ)
+// 破棄中、破棄後にslabとそのバッファを使用してはならない。他スレッドの
+// マガジンに保持している要素は破棄され、マガジンはslabから切り離される。
+extern int slab_destroy(struct slab_cache *slab, uint32_t flags);
+
+// NUMAの動作(SLAB_NUMA_*)を設定する。slabを利用し始める前に呼び出すこと。
+extern int slab_set_numa(struct slab_cache *slab, uint32_t policy);
+
+// 呼び出したスレッドが使用するNUMAノードを指定する。-1で自動。
+extern void slab_set_numa_node(int nid);
+
+// slabの統計情報を取得する。
+// 獲得、開放の回数はスレッドごとのマガジンの分も集計する。
+// st_live_bytes/st_node_bytesがnodeの使用率(断片化の度合い)となる。
+// st_binsは密度ごとのnode数であり、0は使用率が最も高いnode、
+// SLAB_PRIOは空きnodeの数である。
+extern int slab_stats(struct slab_cache *slab, struct slab_stats *st);
+
+// 使用中の要素を獲得箇所(slab_allocを呼び出したファイルと行)ごとに集計し、
+// バイト数の多い順にsitesへ格納する。獲得箇所の数を返す。
+// 獲得箇所の数がnを超える場合は-ENOSPC、leanのslabは-ENOTSUPを返す。
+// デバッグ用の関数であり、一貫した集計とするため、すべてのnodeの
+// sn_alistを走査し終えるまでslabをロックし続ける。集計中はロックを取得する
+// 他スレッドの獲得、開放(マガジンの補充、返却を含む)が待たされ、その時間は
+// 使用中の要素数に比例する。運用中の定期的な監視にはslab_statsを使用すること。
+extern int slab_profile(struct slab_cache *slab,
+			struct slab_site *sites, int n);
+
+// slabのnodeを検査する。
+// ヘッダ付きの場合は獲得済みの要素のヘッダ、フッタを検査する。
+// 空きリストの要素はnodeの範囲内、要素の境界にあることを検査し、
+// SLAB_F_POISONの場合はSLAB_POISONが書き換えられていないことを検査する。
+// 検査はnode単位に、budget個の要素を検査するまで行い、次の呼び出しで
+// 続きから再開する。budgetが0の場合はすべてのnodeを検査する。
+// 最後のnodeを検査した場合はv_doneを1とし、次の呼び出しは先頭から行う。
+// 破壊を検出した場合は-EFAULTを返す。vはNULLでもよい。
+extern int slab_verify(struct slab_cache *slab, uint32_t budget,
+		       struct slab_verify *v);
+
+// slabを登録し、slab_foreach/slab_find/slab_dumpで参照できるようにする。
+// グローバルなslabはSLAB_DEFINEで定義すると自動的に登録される。
+// 登録済みの場合は-EBUSYを返す。slabを破棄する前に登録を解除すること。
+extern int slab_register(struct slab_cache *slab);
+extern void slab_unregister(struct slab_cache *slab);
+
+// 登録したslabを名前で検索する。見つからない場合はNULLを返す。
+extern struct slab_cache *slab_find(const char *name);
+
+// 登録したslabを列挙する。fnが0以外を返した場合は中断し、その値を返す。
+// fnの中でslab_register/slab_unregisterを呼び出してはならない。
+extern int slab_foreach(int (*fn)(struct slab_cache *slab, void *arg),
+			void *arg);
+
+// プロセス全体のnodeのバイト数の上限を設定する。0は無制限。
+// 上限に達した場合、nodeを獲得する前に次の順でメモリを回収する。
+//  1. 獲得するslab、slab_registerで登録したslabの空きnodeを開放する。
+//  2. 登録したshrinkerを登録順に呼び出し、その後に空いたnodeを開放する。
+// 回収しても獲得できない場合、獲得は-ENOMEMとなる。
+extern void slab_set_budget(size_t bytes);
+
+// プロセス全体のnodeのバイト数を取得する。
+extern size_t slab_usage(void);
+
+// shrinkerを登録、解除する。
+// sh_scanの中で獲得した場合、上限に達しても回収は行わない。
+extern void slab_shrinker_register(struct slab_shrinker *sh);
+extern void slab_shrinker_unregister(struct slab_shrinker *sh);
+
+// バッファをalign境界に配置する。alignは0(指定なし)または2のべき乗。
+// 要素の間隔をalignの倍数に切り上げるため、64を指定するとバッファが
+// キャッシュラインをまたがなくなる。
+// また、nodeごとに先頭の要素をSLAB_COLOR_SZ(alignが大きい場合はalign)の
+// 倍数ずつずらし(カラーリング)、nodeの間でキャッシュのセットが
+// 重ならないようにする。ずらす量はnodeの末尾の余りの範囲とする。
+// nodeが存在する場合は-EBUSYを返す。slabを利用し始める前に呼び出すこと。
+extern int slab_set_align(struct slab_cache *slab, uint32_t align);
+
+// スレッドごとのマガジンを有効にする。sizeは0で無効、最大SLAB_MAGAZINE_MAX。
+// slabを利用し始める前に呼び出すこと。
+extern int slab_set_magazine(struct slab_cache *slab, uint32_t size);
+
+// 呼び出したスレッドのマガジンをすべてslabへ返却する。
+extern void slab_magazine_flush(void);
+
+// エポックによる遅延開放
+// ロックを取得せずにバッファを参照する読み出し側は、参照する区間を
+// slab_epoch_enter/slab_epoch_exitで囲む。(入れ子にできる)
+// slab_free_deferredで開放したバッファは、開放した時点で区間内にいた
+// すべてのスレッドが区間を抜けるまで開放しない。
+// 開放するバッファはスレッドごとにまとめ、猶予期間の経過後にslabへ
+// 一括で返却する。デストラクタは返却時に実行する。
+// 遅延開放したバッファが残っている間はslab_destroyを呼び出してはならない。
+// (slab_deferred_barrierで返却を待つこと)
+// slab_epoch_enterはスレッドの記録を作成できない場合に-ENOMEMを返す。
+// 区間外でのslab_epoch_exitは何もしない。
+extern int slab_epoch_enter(void);
+extern void slab_epoch_exit(void);
+
+// 読み出し側の区間を抜けた後にバッファを開放する。
+// 不正なバッファの場合は-EFAULTを返す。
+extern int slab_free_deferred(void *buf);
+extern int slab_cache_free_deferred(struct slab_cache *slab, void *buf);
+
+// エポックを進め、猶予期間が経過したバッファを返却する。
+// 呼び出したスレッドが返却を待っているバッファの数を返す。
+extern int slab_deferred_reclaim(void);
+
+// 呼び出したスレッド、および終了したスレッドが遅延開放したバッファを
+// すべて返却するまで待つ。区間内で呼び出した場合は-EBUSYを返す。
+extern int slab_deferred_barrier(void);
+
+// 以下の参照カウント操作はヘッダ付きのslabのみ使用できる。
+// 参照カウントはアトミックに操作し、最後のslab_putでバッファを開放する。
+// 加算は参照を持つスレッドのみが行えるため、加算の上限を超えた場合は
+// -EOVERFLOWを返す。
+// SLAB_F_BIASEDを指定したslabでは、獲得したスレッド(所有スレッド)は
+// 非アトミックに、他スレッドはアトミックに別のカウントを操作する。
+// 所有スレッドの参照がなくなった時点で他スレッドのカウントに統合する。
+// 所有スレッドの参照を他スレッドでslab_putした場合は、所有スレッドが
+// 次にslab_alloc/slab_putするか、終了した時点で減算する。(0を返す)
+// 所有スレッドが終了している場合は、その場で他スレッドのカウントに統合する。
 // スラブの参照カウントを加算する。
 extern int slab_get(void *buf);
 
@@ -178,6 +601,29 @@ extern int slab_get_refcnt(void *buf);
 // スラブから獲得したメモリの参照カウントを減算する。
 extern int slab_put(void *buf);
 
+// 統計情報、ダンプで表示する名前を設定する。
+// SLAB_INIT/INIT_SLABは変数名を設定する。
+static inline void
+slab_set_name(struct slab_cache *slab, const char *name)
+{
+	slab->s_name = name;
+}
+
+// SLAB_F_*を設定する。slabを利用し始める前に呼び出すこと。
+static inline void
+slab_set_flags(struct slab_cache *slab, uint32_t flags)
+{
+	slab->s_flags = (slab->s_flags & SLAB_F_CREATED)
+			 | (flags & ~SLAB_F_CREATED);
+}
+
+// すべてのbufが開放されたnodeを保持する数を設定する。
+static inline void
+slab_set_keep_empty(struct slab_cache *slab, uint32_t keep)
+{
+	slab->s_keep_empty = keep;
+}
+
 static inline void
 slab_set_constructor(struct slab_cache *slab, slab_constructor constructor)
 {
@@ -196,6 +642,20 @@ slab_set_mem_allocator(struct slab_cache *slab,
 {
 	slab->s_mem_alloc = mem_alloc;
 	slab->s_mem_free = mem_free;
+	slab->s_mem_alloc_aligned = NULL;
+}
+
+// 境界指定の獲得関数を設定する。
+// nodeはmem_alloc_aligned(s_node_size, s_node_size)で獲得し、
+// mem_freeで開放する。
+static inline void
+slab_set_mem_allocator_aligned(struct slab_cache *slab,
+			       slab_mem_alloc_aligned mem_alloc_aligned,
+			       slab_mem_free mem_free)
+{
+	slab->s_mem_alloc = NULL;
+	slab->s_mem_free = mem_free;
+	slab->s_mem_alloc_aligned = mem_alloc_aligned;
 }
 
 CPP_SRC(})
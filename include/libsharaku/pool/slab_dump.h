@@ -0,0 +1,69 @@
+﻿/* --
+ *
+ * MIT License
+ * 
+ * Copyright (c) 2017 Abe Takafumi
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifndef _SLAB_DUMP_H
+#define _SLAB_DUMP_H
+
+#include <stdio.h>
+#include <libsharaku/pool/slab.h>
+
+CPP_SRC(extern "C" {)
+
+// slab_registerで登録したslabの一覧を出力する。
+//
+// slab_dumpは/proc/slabinfoと同様の表を出力する。
+//  name	slabの名前(s_name)
+//  objsize	バッファのサイズ
+//  objpernode	nodeあたりのバッファ数
+//  active	利用者が使用中のバッファ数
+//  total	獲得済みnodeのバッファ数
+//  nodes	nodeの数
+//  bytes	nodeのバイト数(メモリ使用量)
+// slab_dump_jsonは同じ内容とslab_statsのすべての値をJSONの配列で出力する。
+
+// 表形式で出力する。
+extern int slab_dump(FILE *fp);
+
+// JSON形式で出力する。
+extern int slab_dump_json(FILE *fp);
+
+// 登録したslabの使用中の要素を獲得箇所ごとに出力する。(slab_profile)
+// 1行が1つの獲得箇所であり、slabごとにバイト数の多い順に出力する。
+//  objs	使用中の要素数
+//  bytes	使用中のバイト数
+//  name	slabの名前
+//  site	獲得したファイル:行
+// leanのslabは獲得箇所を記録しないため出力しない。出力した行数を返す。
+extern int slab_profile_dump(FILE *fp);
+
+// slabの開放されていない要素を報告する。slabを破棄する前の検査に使用する。
+// 要素が残っている場合は要素数、バイト数と獲得箇所ごとの内訳を出力し、
+// 残っている要素数を返す。すべて開放済みの場合は何も出力せず0を返す。
+extern int slab_dump_leaks(struct slab_cache *slab, FILE *fp);
+
+CPP_SRC(})
+
+#endif /* _SLAB_DUMP_H */
@@ -0,0 +1,61 @@
+﻿/* --
+ *
+ * MIT License
+ * 
+ * Copyright (c) 2017 Abe Takafumi
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifndef _SLAB_KMALLOC_H
+#define _SLAB_KMALLOC_H
+
+#include <libsharaku/pool/slab.h>
+
+CPP_SRC(extern "C" {)
+
+// サイズクラスごとのslab_cacheによる汎用のメモリ獲得関数。
+//
+// 16バイトからSLAB_KMALLOC_MAXバイトまでを2のべき乗とその中間のサイズ
+// クラスに分け、クラスごとにleanのslab_cacheを持つ。サイズからクラスへは
+// テーブル参照で変換するため、獲得は一定時間で行える。
+// すべてのクラスのnodeはSLAB_KMALLOC_NODE_SZの境界に配置するため、
+// 開放時はアドレスをマスクして所属するnodeとslab_cacheを求める。
+// SLAB_KMALLOC_MAXを超えるサイズはmmapで直接獲得する。この領域の先頭にも
+// nodeと同じ位置にsn_slab(NULL)を持つヘッダを置き、開放時に区別する。
+//
+// 獲得した領域は16バイト境界に配置される。
+// 各クラスのslab_cacheはスレッドごとのマガジンを使用する。
+
+#define SLAB_KMALLOC_MAX	8192
+#define SLAB_KMALLOC_NODE_SZ	SLAB_DEFAULT_SZ
+
+// sizeバイトを獲得する。獲得できない場合はNULLを返す。
+extern void *slab_kmalloc(size_t size);
+
+// slab_kmallocで獲得した領域を開放する。
+extern int slab_kfree(void *buf);
+
+// slab_kmallocで獲得した領域の使用可能なサイズを返す。
+extern size_t slab_ksize(void *buf);
+
+CPP_SRC(})
+
+#endif /* _SLAB_KMALLOC_H */
@@ -0,0 +1,76 @@
+﻿/* --
+ *
+ * MIT License
+ * 
+ * Copyright (c) 2017 Abe Takafumi
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifndef _SLAB_MMAP_H
+#define _SLAB_MMAP_H
+
+#include <libsharaku/pool/slab.h>
+
+CPP_SRC(extern "C" {)
+
+// mmapで予約した仮想領域からslabのnodeを切り出すnode獲得関数。
+//
+// 最初に大きな仮想領域をmmap(MAP_NORESERVE)で予約し、nodeはその中から
+// nodeサイズ境界に切り出す。物理メモリは使用時に割り当てられる。
+// 開放されたnodeはmunmapせず、madvise(MADV_DONTNEED/MADV_FREE)で物理メモリ
+// のみを返却し、同じサイズのnodeの獲得時に再利用する。
+// SLAB_MMAP_HUGETLBを指定するとMAP_HUGETLBで予約し(予約サイズ分の
+// ヒュージページを確保できない場合は通常のページで予約する)、
+// SLAB_MMAP_THPを指定するとmadvise(MADV_HUGEPAGE)で
+// Transparent Huge Pageを要求する。大きなページを使用することで、
+// slab上の多数のオブジェクトへのアクセスでのTLBミスを削減する。
+// 予約した領域を使い切った場合はaligned_allocへフォールバックする。
+//
+// 使用方法
+//  - 必要であればslab_mmap_initで予約サイズ、フラグを指定する。
+//    (指定しない場合は最初の獲得時にSLAB_MMAP_RESERVE_DEFで予約する)
+//  - slab_set_mem_mmapでslabのnode獲得関数として設定する。
+
+#define SLAB_MMAP_HUGETLB	0x00000001	// MAP_HUGETLBで予約する
+#define SLAB_MMAP_THP		0x00000002	// MADV_HUGEPAGEを指定する
+#define SLAB_MMAP_MADV_FREE	0x00000004	// 返却にMADV_FREEを使用する
+
+#define SLAB_MMAP_RESERVE_DEF	(4ULL << 30)
+
+// 仮想領域を予約する。予約済みの場合は-EBUSYを返す。
+extern int slab_mmap_init(size_t reserve, uint32_t flags);
+
+// 予約した仮想領域からalign境界のsizeバイトを獲得する。
+extern void *slab_mmap_alloc(size_t align, size_t size);
+
+// slab_mmap_allocで獲得した領域を開放する。
+extern void slab_mmap_free(void *buf);
+
+// slabのnode獲得関数としてslab_mmap_alloc/slab_mmap_freeを設定する。
+static inline void
+slab_set_mem_mmap(struct slab_cache *slab)
+{
+	slab_set_mem_allocator_aligned(slab, slab_mmap_alloc, slab_mmap_free);
+}
+
+CPP_SRC(})
+
+#endif /* _SLAB_MMAP_H */
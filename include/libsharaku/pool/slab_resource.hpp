@@ -0,0 +1,205 @@
+/*-
+ *
+ * MIT License
+ * 
+ * Copyright (c) 2018 Abe Takafumi
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE. *
+ *
+ */
+
+#ifndef _SLAB_RESOURCE_HPP_
+#define _SLAB_RESOURCE_HPP_
+
+// 標準コンテナからslabを使用するためのアダプタ
+//
+// slab_allocator<T>はstd::allocatorの要件を満たすアロケータであり、
+// slab_kmallocのサイズクラスから獲得する。std::list、std::map、
+// std::unordered_map等のノードのように、同じサイズの獲得、開放を繰り返す
+// コンテナに適している。状態を持たないため、すべてのインスタンスは等価。
+// slab_memory_resourceはstd::pmr::memory_resourceの実装であり、
+// std::pmrのコンテナから同様にslab_kmallocで獲得する。
+//
+// どちらもSLAB_KMALLOC_MAXを超えるサイズと、slab_kmallocが保証する境界
+// (SLAB_RESOURCE_ALIGN)を超える境界の要求はoperator newで獲得する。
+#include <stddef.h>
+#include <stdlib.h>
+#include <new>
+#include <libsharaku/pool/slab_kmalloc.h>
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define SLAB_HAVE_PMR	1
+#endif
+#endif
+
+#define SLAB_RESOURCE_ALIGN	16	// slab_kmallocの境界
+
+// sizeバイト、align境界の要求をslab_kmallocで扱えるかを判定する。
+static inline bool
+__slab_resource_fit(size_t size, size_t align)
+{
+	return size <= SLAB_KMALLOC_MAX && align <= SLAB_RESOURCE_ALIGN;
+}
+
+// slab_kmallocで扱えない要求をoperator newで獲得する。
+// operator newの既定の境界を超える場合は境界付きのoperator newを使用する。
+// (C++17より前はposix_memalignを使用する)
+#ifdef __cpp_aligned_new
+#define SLAB_RESOURCE_NEW_ALIGN	__STDCPP_DEFAULT_NEW_ALIGNMENT__
+#else
+#define SLAB_RESOURCE_NEW_ALIGN	alignof(max_align_t)
+#endif
+
+static inline void *
+__slab_resource_new(size_t size, size_t align)
+{
+	if (align <= SLAB_RESOURCE_NEW_ALIGN) {
+		return ::operator new(size);
+	}
+#ifdef __cpp_aligned_new
+	return ::operator new(size, std::align_val_t(align));
+#else
+	void *buf;
+
+	if (posix_memalign(&buf, align, size)) {
+		throw std::bad_alloc();
+	}
+	return buf;
+#endif
+}
+
+static inline void
+__slab_resource_delete(void *buf, size_t size, size_t align)
+{
+	if (align <= SLAB_RESOURCE_NEW_ALIGN) {
+		::operator delete(buf);
+		return;
+	}
+#ifdef __cpp_aligned_new
+	::operator delete(buf, size, std::align_val_t(align));
+#else
+	(void)size;
+	free(buf);
+#endif
+}
+
+template<typename T>
+struct slab_allocator {
+	typedef T value_type;
+
+	slab_allocator() noexcept {}
+	template<typename U>
+	slab_allocator(const slab_allocator<U> &) noexcept {}
+
+	T *allocate(size_t n) {
+		void *buf;
+
+		if (n > (size_t)-1 / sizeof(T)) {
+			throw std::bad_alloc();
+		}
+		if (!__slab_resource_fit(n * sizeof(T), alignof(T))) {
+			return (T *)__slab_resource_new(n * sizeof(T),
+							alignof(T));
+		}
+		buf = slab_kmalloc(n * sizeof(T));
+		if (!buf) {
+			throw std::bad_alloc();
+		}
+		return (T *)buf;
+	}
+
+	void deallocate(T *p, size_t n) noexcept {
+		if (!__slab_resource_fit(n * sizeof(T), alignof(T))) {
+			__slab_resource_delete(p, n * sizeof(T), alignof(T));
+			return;
+		}
+		slab_kfree(p);
+	}
+};
+
+template<typename T, typename U>
+inline bool
+operator==(const slab_allocator<T> &, const slab_allocator<U> &) noexcept
+{
+	return true;
+}
+
+template<typename T, typename U>
+inline bool
+operator!=(const slab_allocator<T> &, const slab_allocator<U> &) noexcept
+{
+	return false;
+}
+
+#ifdef SLAB_HAVE_PMR
+struct slab_memory_resource : public std::pmr::memory_resource {
+	// upstreamはslab_kmallocで扱えない要求に使用する。
+	explicit slab_memory_resource(std::pmr::memory_resource *upstream
+				      = std::pmr::new_delete_resource())
+	    : __upstream(upstream) {}
+
+	std::pmr::memory_resource *upstream_resource(void) const {
+		return __upstream;
+	}
+
+protected:
+	void *do_allocate(size_t bytes, size_t align) override {
+		void *buf;
+
+		if (!__slab_resource_fit(bytes, align)) {
+			return __upstream->allocate(bytes, align);
+		}
+		buf = slab_kmalloc(bytes);
+		if (!buf) {
+			throw std::bad_alloc();
+		}
+		return buf;
+	}
+
+	void do_deallocate(void *p, size_t bytes, size_t align) override {
+		if (!__slab_resource_fit(bytes, align)) {
+			__upstream->deallocate(p, bytes, align);
+			return;
+		}
+		slab_kfree(p);
+	}
+
+	// slab_kmallocは共通のため、upstreamが等しければ互いに開放できる。
+	bool do_is_equal(const std::pmr::memory_resource &other)
+						 const noexcept override {
+		const slab_memory_resource *o
+			= dynamic_cast<const slab_memory_resource *>(&other);
+		return o && o->__upstream->is_equal(*__upstream);
+	}
+
+private:
+	std::pmr::memory_resource	*__upstream;
+};
+
+// プロセスで共通のslab_memory_resourceを返す。
+inline slab_memory_resource *
+slab_default_resource(void)
+{
+	static slab_memory_resource resource;
+	return &resource;
+}
+#endif // SLAB_HAVE_PMR
+
+#endif // _SLAB_RESOURCE_HPP_
@@ -24,18 +24,47 @@
  *
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 #include <libsharaku/pool/slab.h>
-#include <libsharaku/atomic/atomic.h>
 
 #define _SLAB_MAGIC	0xF324ABE3
+// マガジンに保持中の要素のh_magic。開放済みとして扱う。
+#define _SLAB_MAGIC_MAG	0xF324ABE4
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED	1
+#endif
+#define _SLAB_PAGE_SZ	4096
+
+// ロック待ちでCPUを譲るまでのスピン回数
+#define _SLAB_LOCK_SPIN		128
+
+// 参照カウントの最大値
+#define _SLAB_REFCNT_MAX	0x7FFFFFFFU
+// バイアスモードで所有スレッドのカウントを統合したことを示すビット
+#define _SLAB_REF_MERGED	0x80000000U
+
 // メモリバッファのヘッダ。
 // 利用者からは参照できない領域
+// h_refcntはアトミックに操作する。バイアスモード(SLAB_F_BIASED)では、
+// h_refcntは所有スレッド(h_owner)のみが非アトミックに操作し、他スレッドは
+// h_sharedをアトミックに操作する。
 typedef struct smem_header {
 	uint32_t		h_magic;
-	uint16_t		h_refcnt;
-	uint16_t		h_rsv;
+	uint32_t		h_refcnt;
+	uint32_t		h_shared;
+	uint32_t		h_owner;
 	struct slab_node	*h_node;
 	struct list_head	h_list;
 } smem_header_t;
@@ -45,10 +74,186 @@ typedef struct smem_header {
 typedef struct mem_footer {
 	const char		*f_src;
 	uint16_t		f_line;
-	uint16_t		f_rsv;
+	uint16_t		f_ctor;		// 構築済み(SLAB_F_CTOR_ONCE)
 	uint32_t		f_magic;
 } smem_footer_t;
 
+// スレッドごとのマガジン。
+// m_bufは空きバッファのスタックであり、所有スレッドのみが操作する。
+// m_alloc〜m_outは所有スレッドのみが更新し、slab_statsで集計する。
+struct slab_magazine {
+	struct slab_cache	*m_slab;
+	struct list_head	m_list;		// slabのマガジンのリスト
+	uint64_t		m_alloc;	// マガジンからの獲得数
+	uint64_t		m_free;		// マガジンへの開放数
+	uint64_t		m_in;		// slabからの補充数
+	uint64_t		m_out;		// slabへの返却数
+	uint32_t		m_cnt;
+	uint32_t		m_size;
+	void			*m_buf[];
+};
+
+// スレッドごとのマガジン表。s_mag_idで索引する。
+struct slab_mag_table {
+	uint32_t		t_cnt;
+	struct slab_magazine	*t_mags[];
+};
+
+// マガジン識別子の払い出し元。0は未割当を表すため1から払い出す。
+// slab_destroyで返却した識別子は__slab_mag_id_freeから再利用する。
+static pthread_mutex_t __slab_mag_id_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t __slab_mag_id_next = 1;
+static uint32_t *__slab_mag_id_free;
+static uint32_t __slab_mag_id_free_cnt;
+static uint32_t __slab_mag_id_free_size;
+
+// バイアスモードの所有スレッドの識別子。0は未割り当て。
+static uint32_t __slab_tid_next = 1;
+static __thread uint32_t __slab_tid;
+
+// バイアスモードで他スレッドが返却した所有スレッドの参照。
+// 所有スレッドが次に獲得、開放する時点か、スレッド終了時に減算する。
+// q_cnt以外は__slab_ref_lockで保護する。
+struct slab_ref_queue {
+	uint32_t		q_tid;
+	uint32_t		q_cnt;
+	uint32_t		q_size;
+	void			**q_bufs;
+	struct list_head	q_list;
+};
+
+// 所有スレッドのキューのリスト。終了したスレッドのキューは含まない。
+static pthread_mutex_t __slab_ref_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct list_head __slab_ref_list = { &__slab_ref_list, &__slab_ref_list };
+static pthread_once_t __slab_ref_once = PTHREAD_ONCE_INIT;
+static pthread_key_t __slab_ref_key;
+static __thread struct slab_ref_queue *__slab_ref_self;
+static pthread_once_t __slab_mag_once = PTHREAD_ONCE_INIT;
+static pthread_key_t __slab_mag_key;
+static __thread struct slab_mag_table *__slab_mags;
+
+// スレッドが使用するNUMAノード。-1の場合は実行中のCPUから求める。
+static __thread int __slab_numa_node = -1;
+
+// 登録したslabのリスト
+static pthread_mutex_t __slab_reg_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct list_head __slab_reg_list = { &__slab_reg_list, &__slab_reg_list };
+
+// プロセス全体のnodeのバイト数と上限(0は無制限)
+static size_t __slab_usage;
+static size_t __slab_budget;
+
+// 登録したshrinkerのリスト。回収中は保持する。
+static pthread_mutex_t __slab_shrinker_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct list_head __slab_shrinker_list
+	 = { &__slab_shrinker_list, &__slab_shrinker_list };
+
+// 回収中のスレッド。shrinkerから獲得した場合に回収を繰り返さない。
+static __thread int __slab_in_reclaim;
+
+// 遅延開放するバッファをエポックごとにまとめたもの
+struct slab_epoch_bucket {
+	uint64_t		b_epoch;
+	uint32_t		b_cnt;
+	uint32_t		b_size;
+	struct slab_cache	**b_slabs;
+	void			**b_bufs;
+};
+
+// 遅延開放のエポックの数。エポックeで開放したバッファは、e+2で返却できる。
+#define SLAB_EPOCH_CNT		3
+
+// 返却を試みる遅延開放の間隔
+#define SLAB_EPOCH_BATCH	64
+
+// スレッドごとのエポックの記録
+// r_epochは区間内であれば(エポック << 1) | 1、区間外であれば0とする。
+struct slab_epoch_rec {
+	uint64_t		r_epoch;
+	uint32_t		r_nest;
+	uint32_t		r_retired;	// 前回の返却以降の遅延開放数
+	struct list_head	r_list;
+	struct slab_epoch_bucket r_buckets[SLAB_EPOCH_CNT];
+};
+
+// グローバルエポックと、スレッドの記録のリスト
+static uint64_t __slab_epoch = 1;
+static pthread_mutex_t __slab_epoch_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct list_head __slab_epoch_list
+	 = { &__slab_epoch_list, &__slab_epoch_list };
+static pthread_once_t __slab_epoch_once = PTHREAD_ONCE_INIT;
+static pthread_key_t __slab_epoch_key;
+static __thread struct slab_epoch_rec *__slab_epoch_self;
+
+// 終了したスレッドから引き継いだバッファ。__slab_epoch_lockで保護する。
+static struct slab_epoch_bucket __slab_epoch_orphan[SLAB_EPOCH_CNT];
+
+// _slab_allocが返すエラー値(-errnoをポインタにしたもの)を判定する。
+static inline int
+__slab_is_err(void *buf)
+{
+	return (uintptr_t)buf >= (uintptr_t)-4095;
+}
+
+// ロックの解放を待つ間、同じコアの他のハードウェアスレッドへ譲る。
+static inline void
+__slab_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield" ::: "memory");
+#endif
+}
+
+// slabをロックする。
+// 保持しているスレッドが横取りされている場合に備え、_SLAB_LOCK_SPIN回を
+// 超えて待つ場合はCPUを譲る。
+static inline void
+__slab_lock(struct slab_cache *slab)
+{
+	uint32_t spin = 0;
+
+	while (__atomic_exchange_n(&slab->s_lock, 1, __ATOMIC_ACQUIRE)) {
+		while (__atomic_load_n(&slab->s_lock, __ATOMIC_RELAXED)) {
+			if (++spin < _SLAB_LOCK_SPIN) {
+				__slab_cpu_relax();
+			} else {
+				sched_yield();
+			}
+		}
+	}
+}
+
+// slabをアンロックする。
+static inline void
+__slab_unlock(struct slab_cache *slab)
+{
+	__atomic_store_n(&slab->s_lock, 0, __ATOMIC_RELEASE);
+}
+
+// slabのロックを試みる。ロックできた場合は1を返す。
+static inline int
+__slab_trylock(struct slab_cache *slab)
+{
+	return !__atomic_load_n(&slab->s_lock, __ATOMIC_RELAXED) &&
+	       !__atomic_exchange_n(&slab->s_lock, 1, __ATOMIC_ACQUIRE);
+}
+
+// leanのslabかを判定する。
+static inline int
+__slab_is_lean(struct slab_cache *slab)
+{
+	return slab->s_flags & SLAB_F_LEAN;
+}
+
+// 構築済みの要素をキャッシュするslab(SLAB_F_CTOR_ONCE)かを判定する。
+static inline int
+__slab_is_ctor_once(struct slab_cache *slab)
+{
+	return slab->s_flags & SLAB_F_CTOR_ONCE;
+}
+
 // slab獲得の優先度を計算する。
 static inline int64_t
 __get_slab_prio(struct slab_node *node)
@@ -57,13 +262,31 @@ __get_slab_prio(struct slab_node *node)
 			 * SLAB_PRIO / node->sn_max_cnt;
 }
 
+// nodeがs_node_size境界に配置されるかを判定する。
+// 境界指定の獲得関数があり、nodeサイズが2のべき乗の場合に配置される。
+static inline int
+__slab_is_aligned(struct slab_cache *slab)
+{
+	return slab->s_mem_alloc_aligned &&
+	       slab->s_node_size >= SLAB_NODE_SZ_MIN &&
+	       !(slab->s_node_size & (slab->s_node_size - 1));
+}
+
+// ヘッダモードでバッファに割り当てるサイズを取得する。
+// フッタと次の要素のヘッダがポインタ境界となるよう、ポインタの倍数とする。
+static inline size_t
+__slab_body_size(struct slab_cache *slab)
+{
+	return (slab->s_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+}
+
 // ヘッダからフッタを取得する
 static inline smem_footer_t*
-__slab_h2f(smem_header_t *h)
+__slab_h2f(struct slab_cache *slab, smem_header_t *h)
 {
 	return (smem_footer_t*)
 			((char *)(h)
-				 + h->h_node->sn_slab->s_size
+				 + __slab_body_size(slab)
 				 + sizeof(smem_header_t));
 }
 
@@ -81,309 +304,2607 @@ __slab_b2h(void *buf)
 	return (smem_header_t *)(((char *)buf) - sizeof(smem_header_t));
 }
 
-// slab獲得の優先度キューの再登録を行う。
-static inline void
-__slab_resched(struct slab_cache *slab,
-			struct slab_node *node)
-{
-	int64_t	prio;
-
-	plist_del(&node->sn_plist, &slab->s_list);
-	// 空きがある場合は空きリストに入れる
-	// fullの場合はfullリストに入れる
-	// リストは同一優先度の末端に挿入されるため、抜き差しが頻発する
-	// 可能性は少ない。
-	prio = __get_slab_prio(node);
-	node->sn_plist.prio = prio;
-	if (prio) {
-		plist_add(&node->sn_plist, &slab->s_list);
+// 1要素あたりの領域サイズを取得する。
+// leanの場合、空き要素は自身の領域で空きリストをつなぐため、
+// ポインタ以上のサイズ、ポインタ境界とする。
+// ヘッダモードもヘッダ、バッファ、フッタの各サイズがポインタの倍数のため、
+// ポインタ境界となる。
+// s_alignが指定されている場合はその倍数とする。
+static inline size_t
+__slab_stride(struct slab_cache *slab)
+{
+	size_t align = slab->s_align;
+	size_t sz;
+
+	if (__slab_is_lean(slab)) {
+		sz = slab->s_size < sizeof(void *) ?
+				sizeof(void *) : slab->s_size;
+		if (align < sizeof(void *)) {
+			align = sizeof(void *);
+		}
 	} else {
-		plist_add(&node->sn_plist, &slab->s_flist);
+		sz = __slab_body_size(slab) + sizeof(smem_header_t)
+					    + sizeof(smem_footer_t);
+		if (!align) {
+			return sz;
+		}
 	}
+	return (sz + align - 1) & ~(align - 1);
 }
 
-// nodeからメモリを獲得する
-static inline void *
-__slab_alloc(struct slab_node *node,
-			const char *src, uint32_t line)
+// 要素の先頭からバッファを取得する
+static inline void*
+__slab_s2b(struct slab_cache *slab, void *slot)
 {
-	smem_header_t *h;
-	smem_footer_t *f;
+	return __slab_is_lean(slab) ? slot : __slab_h2b((smem_header_t *)slot);
+}
 
-	h = list_first_entry_or_null(&node->sn_flist, smem_header_t, h_list);
-	if (!h) {
-		return NULL;
-	}
-	list_del_init(&h->h_list);
-	list_add_tail(&h->h_list, &node->sn_alist);
-	h->h_magic = _SLAB_MAGIC;
-	h->h_refcnt = 1;
-	h->h_node = node;
+// バッファから要素の先頭を取得する
+static inline void*
+__slab_b2s(struct slab_cache *slab, void *buf)
+{
+	return __slab_is_lean(slab) ? buf : (void *)__slab_b2h(buf);
+}
 
-	f = __slab_h2f(h);
-	f->f_src = src;
-	f->f_line = line;
-	f->f_magic = _SLAB_MAGIC;
+// nodeの要素の配置を求める。nodeに配置できる要素数を返す。
+// 先頭の要素はバッファがs_align境界となるように配置し、さらに末尾の余りの
+// 範囲でcolor番目の色の分ずらす。*firstに先頭の要素を格納する。
+static uint32_t
+__slab_node_layout(struct slab_cache *slab, uintptr_t node,
+		   uint32_t color, uintptr_t *first)
+{
+	size_t hdr = __slab_is_lean(slab) ? 0 : sizeof(smem_header_t);
+	size_t stride = __slab_stride(slab);
+	size_t step = SLAB_COLOR_SZ;
+	uintptr_t end = node + slab->s_node_size;
+	uintptr_t buf = node + sizeof(struct slab_node) + hdr;
+	size_t cnt;
+	size_t left;
 
-	node->sn_alloc_cnt++;
-	return __slab_h2b(h);
+	if (slab->s_align) {
+		buf = (buf + slab->s_align - 1)
+			 & ~((uintptr_t)slab->s_align - 1);
+		if (step < slab->s_align) {
+			step = slab->s_align;
+		}
+	}
+	if (buf - hdr >= end) {
+		return 0;
+	}
+	cnt = (end - (buf - hdr)) / stride;
+	left = (end - (buf - hdr)) - cnt * stride;
+	*first = buf - hdr + (color % (left / step + 1)) * step;
+	return (uint32_t)cnt;
 }
 
-// nodへメモリを返却する
-static inline int
-__slab_free_nochk(smem_header_t *h, struct slab_node *node)
+// SLAB_F_POISONで開放した要素を埋める範囲を取得する。
+// leanの場合は空きリストのポインタを除く。
+static inline size_t
+__slab_poison_range(struct slab_cache *slab, void *slot, char **start)
+{
+	if (!__slab_is_lean(slab)) {
+		*start = (char *)__slab_h2b((smem_header_t *)slot);
+		return slab->s_size;
+	}
+	*start = (char *)slot + sizeof(void *);
+	return slab->s_size > sizeof(void *) ? slab->s_size - sizeof(void *) : 0;
+}
+
+// 開放した要素をSLAB_POISONで埋める。
+static inline void
+__slab_poison(struct slab_cache *slab, void *slot)
 {
-	list_del_init(&h->h_list);
-	list_add_tail(&h->h_list, &node->sn_flist);
-	node->sn_alloc_cnt--;
+	char *start;
+	size_t len;
 
-	return 0;
+	if (!(slab->s_flags & SLAB_F_POISON)) {
+		return;
+	}
+	len = __slab_poison_range(slab, slot, &start);
+	memset(start, SLAB_POISON, len);
 }
 
-// nodeへメモリを返却する
-static inline int
-__slab_free(void *buf)
+// 獲得したバッファのコンストラクタを実行する。
+// SLAB_F_CTOR_ONCEの場合は、未構築の要素に対してのみ実行する。
+static inline void
+__slab_construct(struct slab_cache *slab, void *buf)
 {
-	struct slab_node *node;
-	smem_header_t *h;
 	smem_footer_t *f;
 
-	h = __slab_b2h(buf);
-	if (h->h_magic != _SLAB_MAGIC) {
-		// 不正アクセス。
-		return -EFAULT;
+	if (!slab->s_constructor) {
+		return;
 	}
+	if (__slab_is_ctor_once(slab)) {
+		f = __slab_h2f(slab, __slab_b2h(buf));
+		if (f->f_ctor) {
+			return;
+		}
+		f->f_ctor = 1;
+	}
+	slab->s_constructor(buf, slab->s_size);
+}
 
-	f = __slab_h2f(h);
-	node = h->h_node;
-
-	if (f->f_magic != _SLAB_MAGIC) {
-		// 不正アクセス。
-		return -EFAULT;
+// 開放するバッファのデストラクタを実行する。
+// SLAB_F_CTOR_ONCEの場合は構築済みのままキャッシュし、nodeの開放時に実行する。
+static inline void
+__slab_destruct(struct slab_cache *slab, void *buf)
+{
+	if (slab->s_destructor && !__slab_is_ctor_once(slab)) {
+		slab->s_destructor(buf, slab->s_size);
 	}
+}
 
-	__slab_free_nochk(h, node);
-	return 0;
+// バッファからnodeを取得する
+// nodeがs_node_size境界に配置されている場合は、アドレスから求める。
+static inline struct slab_node*
+__slab_b2n(struct slab_cache *slab, void *buf)
+{
+	if (__slab_is_aligned(slab)) {
+		return (struct slab_node *)
+			((uintptr_t)buf & ~((uintptr_t)slab->s_node_size - 1));
+	}
+	return __slab_b2h(buf)->h_node;
 }
 
-static inline int
-__slab_node_alloc(struct slab_cache *slab)
+// バッファを検査し、所属するnodeを取得する。
+// slabがNULLの場合はヘッダから求める。(ヘッダ付きのみ)
+// 不正なバッファの場合はNULLを返す。
+static inline struct slab_node*
+__slab_check(struct slab_cache *slab, void *buf)
 {
 	struct slab_node *node;
 	smem_header_t *h;
-	char *buf;
-	int buf_sz;
-	unsigned int i;
 
-	buf_sz = slab->s_size + sizeof(smem_header_t) + sizeof(smem_footer_t);
-	if (slab->s_mem_alloc) {
-		node = (struct slab_node *)slab->s_mem_alloc(slab->s_node_size);
+	if (!buf) {
+		return NULL;
+	}
+	if (slab && __slab_is_aligned(slab)) {
+		// ヘッダを経由せずにnodeを求める。
+		node = __slab_b2n(slab, buf);
+		if (node->sn_slab != slab) {
+			return NULL;
+		}
+		if (__slab_is_lean(slab)) {
+			return node;
+		}
+		h = __slab_b2h(buf);
+		if (h->h_magic != _SLAB_MAGIC || h->h_node != node) {
+			return NULL;
+		}
 	} else {
-		return -ENOMEM;
+		h = __slab_b2h(buf);
+		if (h->h_magic != _SLAB_MAGIC) {
+			return NULL;
+		}
+		node = h->h_node;
+		if (!node || (slab && node->sn_slab != slab)) {
+			return NULL;
+		}
+		slab = node->sn_slab;
+	}
+	if (__slab_h2f(slab, h)->f_magic != _SLAB_MAGIC) {
+		return NULL;
 	}
+	return node;
+}
 
-	init_plist_node(&node->sn_plist, 0);
-	init_list_head(&node->sn_alist);
-	init_list_head(&node->sn_flist);
-	node->sn_max_cnt
-		 = (slab->s_node_size - sizeof(struct slab_node))
-		 						 / buf_sz;
-	node->sn_slab = slab;
+// nodeを優先度のビンへ登録する。
+// ビンは空になるたびにp_bin_mapから外れ、次の登録時に初期化される。
+// そのため静的初期化ではビンを初期化する必要がない。
+// ビンSLAB_PRIOは未使用のnodeのみが登録されるため、その数を数えておく。
+static inline void
+__slab_bin_add(struct slab_node *node, uint32_t bin)
+{
+	struct slab_pool *pool = node->sn_pool;
 
-	// 最初にすべての領域を獲得しているものとして初期化。
-	// その後、全領域をfreeすることでリストにつなげつつallocカウンタを
-	// 適切に集計する。
-	node->sn_alloc_cnt	= node->sn_max_cnt;
-	buf = (char *)(node + 1);
-	for (i = 0; i < node->sn_max_cnt; i++) {
-		h = (smem_header_t *)buf;
-		init_list_head(&h->h_list);
-		__slab_free_nochk(h, node);
-		buf += buf_sz;
+	if (!(pool->p_bin_map & (1U << bin))) {
+		init_list_head(&pool->p_bins[bin]);
+		pool->p_bin_map |= 1U << bin;
+	}
+	list_add_tail(&node->sn_list, &pool->p_bins[bin]);
+	node->sn_bin = bin;
+	if (bin == SLAB_PRIO) {
+		pool->p_empty_cnt++;
 	}
-	__slab_resched(slab, node);
-
-	slab->s_node_cnt++;
-	return 0;
 }
 
-// slab獲得の優先度キューの再登録を行う。
-static inline int
-__slab_node_free(struct slab_cache *slab, struct slab_node *node)
+// nodeを優先度のビンから外す。
+static inline void
+__slab_bin_del(struct slab_node *node)
 {
-	plist_del(&node->sn_plist, &slab->s_list);
-	if (slab->s_mem_free) {
-		slab->s_mem_free(node);
-		return 0;
-	} else {
-		return -EINVAL;
+	struct slab_pool *pool = node->sn_pool;
+
+	list_del(&node->sn_list);
+	if (list_empty(&pool->p_bins[node->sn_bin])) {
+		pool->p_bin_map &= ~(1U << node->sn_bin);
+	}
+	if (node->sn_bin == SLAB_PRIO) {
+		pool->p_empty_cnt--;
 	}
 }
 
-// slabからメモリを獲得する。
-// 空きがない場合は新しいslabを獲得する。
-void*
-_slab_alloc(struct slab_cache *slab,
-		   const char *src, uint32_t line)
+// 獲得に使用するnodeを取得する。
+// ビン0(full)を除いた最も密度の濃いビンの先頭を使用する。
+static inline struct slab_node*
+__slab_bin_first(struct slab_pool *pool)
 {
-	struct slab_node *node;
-	char *buf = NULL;
-	int64_t prio = -1;
+	uint32_t map = pool->p_bin_map & ~1U;
 
-	// 最大バッファ数を超える場合は獲得させない。
-	if (slab->s_max_buf_cnt &&
-	    slab->s_max_buf_cnt <= slab->s_buf_cnt) {
-		return (void*)-EINVAL;
+	if (!map) {
+		return NULL;
 	}
+	return list_first_entry(&pool->p_bins[__builtin_ctz(map)],
+				struct slab_node, sn_list);
+}
 
-	if (plist_empty(&slab->s_list)) {
-		if (__slab_node_alloc(slab)) {
-			return (void*)-ENOMEM;
-		}
-	}
+// slab獲得の優先度キューの再登録を行う。
+static inline void
+__slab_resched(struct slab_node *node)
+{
+	uint32_t prio;
 
-	node = list_entry(slab->s_list.node_list.next,
-				struct slab_node,
-				sn_plist.node_list);
-	if (node) {
-		prio = __get_slab_prio(node);
-		buf = __slab_alloc(node, src, line);
-		if (slab->s_constructor) {
-			slab->s_constructor((void*)buf, slab->s_size);
-		}
-		node->sn_slab->s_buf_cnt++;
-	} else {
-		// このルートを通ることはない。もし通過する場合バグである。
+	// 空きがある場合は優先度のビンに入れる
+	// fullの場合はビン0(full)に入れる
+	// ビンの末端に挿入されるため、抜き差しが頻発する可能性は少ない。
+	prio = (uint32_t)__get_slab_prio(node);
+	if (prio == node->sn_bin) {
+		return;
 	}
-	// もしslabの獲得により優先度に変化が発生した時は、nodeを入れなおす。
-	if (prio != __get_slab_prio(node)) {
-		__slab_resched(slab, node);
-	}
-	return buf;
+	__slab_bin_del(node);
+	__slab_bin_add(node, prio);
 }
 
-int
-slab_free(void *buf)
+// NUMAノードのpoolを取得する。
+static inline struct slab_pool*
+__slab_pool(struct slab_cache *slab, uint32_t nid)
 {
-	struct slab_node *node;
-	smem_header_t *h;
-	int64_t prio;
-	int rc;
+	return nid ? &slab->s_numa[nid - 1] : &slab->s_pool;
+}
 
-	if (!buf) {
-		// 不正アクセス。
-		return -EFAULT;
-	}
-	h = __slab_b2h(buf);
-	if (h->h_magic != _SLAB_MAGIC) {
-		// 不正アクセス。
-		return -EFAULT;
-	}
-	node = h->h_node;
-	if (!node) {
-		// 不正アクセス。
-		return -EFAULT;
-	}
-	prio = __get_slab_prio(node);
-	if (node->sn_slab->s_destructor) {
-		node->sn_slab->s_destructor((void*)buf, node->sn_slab->s_size);
-	}
-	rc = __slab_free(buf);
-	node->sn_slab->s_buf_cnt--;
-	if (rc) {
-		return rc;
+// 呼び出したスレッドのNUMAノードを取得する。
+static inline uint32_t
+__slab_numa_local(struct slab_cache *slab)
+{
+	unsigned int cpu;
+	unsigned int nid = 0;
+
+	if (!slab->s_numa) {
+		return 0;
 	}
-	if (!node->sn_alloc_cnt) {
-		// カウンタが0であれば、すべて開放済み。
-		// よってnodeを破棄する。
-		if (__slab_node_free(node->sn_slab, node)) {
-			return -EFAULT;
-		}
+	if (__slab_numa_node >= 0) {
+		nid = (unsigned int)__slab_numa_node;
 	} else {
-		// もしslabの獲得により優先度に変化が発生した時は、
-		// nodeを入れなおす。
-		if (prio != __get_slab_prio(node)) {
-			__slab_resched(node->sn_slab, node);
+#ifdef __linux__
+		if (getcpu(&cpu, &nid)) {
+			nid = 0;
 		}
+#endif
 	}
-	return 0;
+	return nid % SLAB_NUMA_MAX;
 }
 
-int
-slab_get(void *buf)
+// nodeのメモリをNUMAノードに割り当てる。
+// ページは使用時に割り当てられるため、nodeに触れる前に設定する。
+// 設定できない場合(NUMAノードが存在しない等)は何もしない。
+static inline void
+__slab_numa_bind(void *mem, size_t size, uint32_t nid)
 {
-	struct slab_node *node;
-	smem_header_t *h;
+#if defined(__linux__) && defined(SYS_mbind)
+	unsigned long mask = 1UL << nid;
+	uintptr_t start;
+	uintptr_t end;
 
-	if (!buf) {
-		// 不正アクセス。
-		return -EFAULT;
+	start = ((uintptr_t)mem + _SLAB_PAGE_SZ - 1)
+					 & ~(uintptr_t)(_SLAB_PAGE_SZ - 1);
+	end = ((uintptr_t)mem + size) & ~(uintptr_t)(_SLAB_PAGE_SZ - 1);
+	if (end > start) {
+		syscall(SYS_mbind, start, end - start, MPOL_PREFERRED,
+			&mask, sizeof(mask) * 8, 0);
 	}
-	h = __slab_b2h(buf);
-	if (h->h_magic != _SLAB_MAGIC) {
-		// 不正アクセス。
-		return -EFAULT;
+#endif
+}
+
+// 呼び出したスレッドの識別子を取得する。
+static inline uint32_t
+__slab_self(void)
+{
+	if (!__slab_tid) {
+		__slab_tid = __atomic_fetch_add(&__slab_tid_next, 1,
+						__ATOMIC_RELAXED);
 	}
-	node = h->h_node;
-	if (!node) {
-		// 不正アクセス。
-		return -EFAULT;
+	return __slab_tid;
+}
+
+// 所有スレッドとして参照を減算する。
+static int
+__slab_ref_put_owner(smem_header_t *h, void *buf)
+{
+	uint32_t old;
+	uint32_t cnt;
+
+	if (--h->h_refcnt) {
+		return (int)h->h_refcnt;
 	}
+	// 所有スレッドの参照がなくなったため、以降は他スレッドの
+	// カウントで管理する。
+	old = __atomic_fetch_or(&h->h_shared, _SLAB_REF_MERGED,
+				__ATOMIC_RELEASE);
+	cnt = old & _SLAB_REFCNT_MAX;
+	if (!cnt) {
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		slab_free(buf);
+	}
+	return (int)cnt;
+}
+
+// キューに溜まった参照をすべて取り出す。__slab_ref_lockを保持して呼び出す。
+static void**
+__slab_ref_take(struct slab_ref_queue *q, uint32_t *cnt)
+{
+	void **bufs = q->q_bufs;
 
-	mb();
-	h->h_refcnt++;
-	return h->h_refcnt;
+	*cnt = q->q_cnt;
+	q->q_bufs = NULL;
+	q->q_size = 0;
+	__atomic_store_n(&q->q_cnt, 0, __ATOMIC_RELAXED);
+	return bufs;
 }
 
-int
-slab_get_refcnt(void *buf)
+// 他スレッドが返却した参照を所有スレッドのカウントから減算する。
+static void
+__slab_ref_drain(void)
 {
-	struct slab_node *node;
-	smem_header_t *h;
+	struct slab_ref_queue *q = __slab_ref_self;
+	void **bufs;
+	uint32_t cnt;
+	uint32_t i;
 
-	if (!buf) {
-		// 不正アクセス。
-		return -EFAULT;
+	if (!q || !__atomic_load_n(&q->q_cnt, __ATOMIC_RELAXED)) {
+		return;
 	}
-	h = __slab_b2h(buf);
-	if (h->h_magic != _SLAB_MAGIC) {
-		// 不正アクセス。
-		return -EFAULT;
+	pthread_mutex_lock(&__slab_ref_lock);
+	bufs = __slab_ref_take(q, &cnt);
+	pthread_mutex_unlock(&__slab_ref_lock);
+	for (i = 0; i < cnt; i++) {
+		__slab_ref_put_owner(__slab_b2h(bufs[i]), bufs[i]);
 	}
-	node = h->h_node;
-	if (!node) {
-		// 不正アクセス。
-		return -EFAULT;
+	free(bufs);
+}
+
+// スレッド終了時に残った参照を減算し、キューを破棄する。
+// リストから外した後は、他スレッドが所有スレッドのカウントを統合する。
+static void
+__slab_ref_destructor(void *arg)
+{
+	struct slab_ref_queue *q = (struct slab_ref_queue *)arg;
+	void **bufs;
+	uint32_t cnt;
+	uint32_t i;
+
+	for (;;) {
+		pthread_mutex_lock(&__slab_ref_lock);
+		if (!q->q_cnt) {
+			list_del(&q->q_list);
+			pthread_mutex_unlock(&__slab_ref_lock);
+			break;
+		}
+		bufs = __slab_ref_take(q, &cnt);
+		pthread_mutex_unlock(&__slab_ref_lock);
+		for (i = 0; i < cnt; i++) {
+			__slab_ref_put_owner(__slab_b2h(bufs[i]), bufs[i]);
+		}
+		free(bufs);
 	}
+	__slab_ref_self = NULL;
+	free(q);
+}
 
-	return h->h_refcnt;
+static void
+__slab_ref_key_init(void)
+{
+	pthread_key_create(&__slab_ref_key, __slab_ref_destructor);
 }
 
-int
-slab_put(void *buf)
+// 呼び出したスレッドを所有スレッドとして登録し、識別子を返す。
+// 登録できない場合は0を返す。(バイアスモードを使用しない)
+static uint32_t
+__slab_ref_owner(void)
 {
-	struct slab_node *node;
-	smem_header_t *h;
+	struct slab_ref_queue *q = __slab_ref_self;
 
-	if (!buf) {
-		// 不正アクセス。
-		return -EFAULT;
+	if (q) {
+		return q->q_tid;
 	}
-	h = __slab_b2h(buf);
-	if (h->h_magic != _SLAB_MAGIC) {
-		// 不正アクセス。
-		return -EFAULT;
+	q = (struct slab_ref_queue *)calloc(1, sizeof(*q));
+	if (!q) {
+		return 0;
 	}
-	node = h->h_node;
-	if (!node) {
-		// 不正アクセス。
-		return -EFAULT;
+	q->q_tid = __slab_self();
+	pthread_once(&__slab_ref_once, __slab_ref_key_init);
+	pthread_setspecific(__slab_ref_key, q);
+	pthread_mutex_lock(&__slab_ref_lock);
+	list_add_tail(&q->q_list, &__slab_ref_list);
+	pthread_mutex_unlock(&__slab_ref_lock);
+	__slab_ref_self = q;
+	return q->q_tid;
+}
+
+// 獲得した要素の参照カウントを初期化する。
+// バイアスモードでは獲得したスレッドが所有スレッドとなる。
+static inline void
+__slab_ref_init(struct slab_cache *slab, smem_header_t *h)
+{
+	h->h_refcnt = 1;
+	h->h_shared = 0;
+	h->h_owner = (slab->s_flags & SLAB_F_BIASED) ? __slab_ref_owner() : 0;
+}
+
+// 獲得した要素のヘッダ、フッタを設定し、バッファを返す。
+static inline void*
+__slab_slot_init(struct slab_node *node, void *slot,
+			const char *src, uint32_t line)
+{
+	smem_header_t *h;
+	smem_footer_t *f;
+
+	if (__slab_is_lean(node->sn_slab)) {
+		return slot;
+	}
+	h = (smem_header_t *)slot;
+	h->h_magic = _SLAB_MAGIC;
+	__slab_ref_init(node->sn_slab, h);
+	h->h_node = node;
+	list_add_tail(&h->h_list, &node->sn_alist);
+
+	f = __slab_h2f(node->sn_slab, h);
+	f->f_src = src;
+	f->f_line = line;
+	f->f_magic = _SLAB_MAGIC;
+	return __slab_h2b(h);
+}
+
+// nodeから最大n個のメモリを一括で獲得する。
+// 開放済みの要素を再利用する空きリストから先に獲得し、不足する場合は
+// 一度も使用していない領域の先頭(sn_bump)から切り出す。
+// 空きリストを一度だけ走査し、カウンタは最後にまとめて更新する。
+static inline int
+__slab_alloc_bulk(struct slab_node *node, void **out, int n,
+			const char *src, uint32_t line)
+{
+	size_t stride;
+	void *slot = node->sn_free;
+	int cnt = 0;
+
+	while (cnt < n && slot) {
+		void *next = *(void **)slot;
+
+		out[cnt++] = __slab_slot_init(node, slot, src, line);
+		slot = next;
+	}
+	node->sn_free = slot;
+
+	if (cnt < n && node->sn_bump < node->sn_bump_end) {
+		stride = __slab_stride(node->sn_slab);
+		while (cnt < n && node->sn_bump < node->sn_bump_end) {
+			out[cnt++] = __slab_slot_init(node, node->sn_bump,
+						      src, line);
+			if (!__slab_is_lean(node->sn_slab)) {
+				// 初めて切り出した要素は未構築
+				__slab_h2f(node->sn_slab, (smem_header_t *)
+					   node->sn_bump)->f_ctor = 0;
+			}
+			node->sn_bump += stride;
+		}
+	}
+	node->sn_alloc_cnt += cnt;
+	return cnt;
+}
+
+// nodeのメモリを獲得する。
+// 可能な場合は、バッファのアドレスからnodeを求められるよう
+// s_node_size境界に配置する。
+static inline struct slab_node*
+__slab_node_mem_alloc(struct slab_cache *slab)
+{
+	void *mem;
+
+	if (__slab_is_aligned(slab)) {
+		mem = slab->s_mem_alloc_aligned(slab->s_node_size,
+						slab->s_node_size);
+		if (mem && ((uintptr_t)mem & (slab->s_node_size - 1))) {
+			// 境界に配置されていない。獲得関数の誤り。
+			if (slab->s_mem_free) {
+				slab->s_mem_free(mem);
+			}
+			return NULL;
+		}
+		return (struct slab_node *)mem;
+	}
+	if (!slab->s_mem_alloc) {
+		return NULL;
+	}
+	return (struct slab_node *)slab->s_mem_alloc(slab->s_node_size);
+}
+
+// nodeのバイト数をプロセス全体の使用量に加算する。
+// 上限を超える場合は加算せずに-ENOMEMを返す。
+static inline int
+__slab_budget_charge(size_t size)
+{
+	size_t budget = __atomic_load_n(&__slab_budget, __ATOMIC_RELAXED);
+	size_t usage;
+
+	usage = __atomic_add_fetch(&__slab_usage, size, __ATOMIC_RELAXED);
+	if (budget && usage > budget) {
+		__atomic_sub_fetch(&__slab_usage, size, __ATOMIC_RELAXED);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static inline void
+__slab_budget_uncharge(size_t size)
+{
+	__atomic_sub_fetch(&__slab_usage, size, __ATOMIC_RELAXED);
+}
+
+static inline int
+__slab_node_alloc(struct slab_cache *slab, uint32_t nid)
+{
+	struct slab_node *node;
+	uintptr_t first;
+	size_t buf_sz;
+
+	// leanの場合、nodeは境界に配置されなければならない。
+	if (__slab_is_lean(slab) && !__slab_is_aligned(slab)) {
+		return -EINVAL;
+	}
+	// SLAB_F_CTOR_ONCEは空き要素のバッファを書き換えてはならない。
+	// leanは空きリストを、SLAB_F_POISONはSLAB_POISONを書き込む。
+	if (__slab_is_ctor_once(slab) &&
+	    (slab->s_flags & (SLAB_F_LEAN | SLAB_F_POISON))) {
+		return -EINVAL;
+	}
+
+	buf_sz = __slab_stride(slab);
+	if (__slab_budget_charge(slab->s_node_size)) {
+		return -ENOMEM;
+	}
+	node = __slab_node_mem_alloc(slab);
+	if (!node) {
+		__slab_budget_uncharge(slab->s_node_size);
+		return -ENOMEM;
+	}
+	if (slab->s_numa) {
+		__slab_numa_bind(node, slab->s_node_size, nid);
+	}
+
+	init_list_head(&node->sn_alist);
+	node->sn_max_cnt = __slab_node_layout(slab, (uintptr_t)node,
+					      slab->s_color++, &first);
+	if (!node->sn_max_cnt) {
+		// nodeにバッファが1つも入らない。
+		if (slab->s_mem_free) {
+			slab->s_mem_free(node);
+		}
+		__slab_budget_uncharge(slab->s_node_size);
+		return -EINVAL;
+	}
+	node->sn_slab = slab;
+	node->sn_pool = __slab_pool(slab, nid);
+	node->sn_nid = nid;
+	node->sn_alloc_cnt = 0;
+
+	// 要素は獲得時にsn_bumpから順に切り出す。
+	// nodeの作成時には領域に触れないため、ページは使用時に割り当てられる。
+	node->sn_free = NULL;
+	node->sn_remote = NULL;
+	node->sn_rnext = NULL;
+	node->sn_base = (char *)first;
+	node->sn_bump = node->sn_base;
+	node->sn_bump_end = node->sn_bump + buf_sz * node->sn_max_cnt;
+	__slab_bin_add(node, (uint32_t)__get_slab_prio(node));
+
+	slab->s_node_cnt++;
+	slab->s_stat.c_node_alloc++;
+	return 0;
+}
+
+// 構築済みの要素のデストラクタを実行する。(SLAB_F_CTOR_ONCE)
+static void
+__slab_node_destruct(struct slab_cache *slab, struct slab_node *node)
+{
+	size_t stride = __slab_stride(slab);
+	smem_header_t *h;
+	char *slot;
+
+	for (slot = node->sn_base; slot < node->sn_bump; slot += stride) {
+		h = (smem_header_t *)slot;
+		if (__slab_h2f(slab, h)->f_ctor) {
+			slab->s_destructor(__slab_h2b(h), slab->s_size);
+		}
+	}
+}
+
+// slab獲得の優先度キューの再登録を行う。
+static inline int
+__slab_node_free(struct slab_cache *slab, struct slab_node *node)
+{
+	if (__slab_is_ctor_once(slab) && slab->s_destructor) {
+		__slab_node_destruct(slab, node);
+	}
+	__slab_bin_del(node);
+	slab->s_node_cnt--;
+	slab->s_stat.c_node_free++;
+	__slab_budget_uncharge(slab->s_node_size);
+	if (slab->s_mem_free) {
+		slab->s_mem_free(node);
+		return 0;
+	} else {
+		return -EINVAL;
+	}
+}
+
+// 他のNUMAノードのpoolから獲得に使用するnodeを取得する。
+static inline struct slab_node*
+__slab_numa_remote(struct slab_cache *slab, uint32_t nid)
+{
+	struct slab_node *node;
+	uint32_t i;
+
+	for (i = 1; i < SLAB_NUMA_MAX; i++) {
+		node = __slab_bin_first(__slab_pool(slab,
+						    (nid + i) % SLAB_NUMA_MAX));
+		if (node) {
+			return node;
+		}
+	}
+	return NULL;
+}
+
+// 獲得に使用するnodeを取得する。
+// ローカルのpoolに空きがない場合は、s_numa_policyに従って
+// 新しいnodeを作成するか、他のNUMAノードのnodeを使用する。
+static struct slab_node*
+__slab_node_get(struct slab_cache *slab, uint32_t nid, int *rc)
+{
+	struct slab_pool *pool = __slab_pool(slab, nid);
+	struct slab_node *node;
+
+	node = __slab_bin_first(pool);
+	if (node) {
+		return node;
+	}
+	if (slab->s_numa && slab->s_numa_policy == SLAB_NUMA_REMOTE) {
+		node = __slab_numa_remote(slab, nid);
+		if (node) {
+			return node;
+		}
+	}
+	*rc = __slab_node_alloc(slab, nid);
+	if (!*rc) {
+		return __slab_bin_first(pool);
+	}
+	if (slab->s_numa && slab->s_numa_policy == SLAB_NUMA_PREFER) {
+		node = __slab_numa_remote(slab, nid);
+	}
+	return node;
+}
+
+// nodeのn個の要素を開放済みとし、nodeを再登録、もしくは破棄する。
+static void
+__slab_node_put(struct slab_node *node, int n)
+{
+	struct slab_cache *slab = node->sn_slab;
+
+	node->sn_alloc_cnt -= n;
+	slab->s_buf_cnt -= n;
+	slab->s_stat.c_free += n;
+	if (!node->sn_alloc_cnt &&
+	    node->sn_pool->p_empty_cnt >= slab->s_keep_empty) {
+		// カウンタが0であれば、すべて開放済み。
+		// 保持数を超える場合はnodeを破棄する。
+		__slab_node_free(slab, node);
+	} else {
+		// もしslabの開放により優先度に変化が発生した時は、
+		// nodeを入れなおす。
+		__slab_resched(node);
+	}
+}
+
+// 他スレッドから開放されたn個の要素をnodeのリモート開放リストへつなぐ。
+// ロックを取得せず、1回のCASでつなぐ。
+// リストが空であった場合は、nodeをslabの回収待ちのリストへつなぐ。
+// 要素はロックを取得したスレッドが__slab_remote_reclaimで回収する。
+static void
+__slab_remote_free_run(struct slab_node *node, void **bufs, int n)
+{
+	struct slab_cache *slab = node->sn_slab;
+	struct slab_node *head;
+	void *first;
+	void *last;
+	void *old;
+	int i;
+
+	// 要素同士を先につないでおく。
+	first = __slab_b2s(slab, bufs[0]);
+	__slab_poison(slab, first);
+	last = first;
+	for (i = 1; i < n; i++) {
+		*(void **)last = __slab_b2s(slab, bufs[i]);
+		last = *(void **)last;
+		__slab_poison(slab, last);
+	}
+
+	// 回収側がsn_rnextを読み出した後に再登録するように、acquireも行う。
+	old = __atomic_load_n(&node->sn_remote, __ATOMIC_RELAXED);
+	do {
+		*(void **)last = old;
+	} while (!__atomic_compare_exchange_n(&node->sn_remote, &old, first,
+					      1, __ATOMIC_ACQ_REL,
+					      __ATOMIC_RELAXED));
+	if (old) {
+		// 回収待ちのリストに登録済み。
+		return;
+	}
+
+	// 以降、回収されるまでnodeは開放されない。
+	head = __atomic_load_n(&slab->s_remote, __ATOMIC_RELAXED);
+	do {
+		__atomic_store_n(&node->sn_rnext, head, __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(&slab->s_remote, &head, node,
+					      1, __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+}
+
+// リモート開放リストの要素を回収する。
+// 呼び出し元でロックしていること。
+static void
+__slab_remote_reclaim(struct slab_cache *slab)
+{
+	struct slab_node *node;
+	struct slab_node *next;
+	void *slot;
+	void *last;
+	int n;
+
+	if (!__atomic_load_n(&slab->s_remote, __ATOMIC_RELAXED)) {
+		return;
+	}
+	node = __atomic_exchange_n(&slab->s_remote, NULL, __ATOMIC_ACQUIRE);
+	for (; node; node = next) {
+		// sn_rnextは回収後に再登録で上書きされるため、先に読み出す。
+		// 読み出しを再登録より前に順序付けるため、交換はacq_relで行う。
+		next = __atomic_load_n(&node->sn_rnext, __ATOMIC_RELAXED);
+		slot = __atomic_exchange_n(&node->sn_remote, NULL,
+					   __ATOMIC_ACQ_REL);
+		if (!slot) {
+			continue;
+		}
+		n = 0;
+		for (last = slot; ; last = *(void **)last) {
+			if (!__slab_is_lean(slab)) {
+				list_del(&((smem_header_t *)last)->h_list);
+			}
+			n++;
+			if (!*(void **)last) {
+				break;
+			}
+		}
+		*(void **)last = node->sn_free;
+		node->sn_free = slot;
+		__slab_node_put(node, n);
+	}
+}
+
+// slabから最大n個のメモリを一括で獲得する。
+// nodeごとに空きリストを一括で取り出し、再スケジュールはnodeごとに1回とする。
+// 獲得できた個数を返す。1個も獲得できない場合は-errnoを返す。
+// 呼び出し元でslabをロックしていること。
+static int
+__slab_cache_alloc_bulk(struct slab_cache *slab, void **out, int n,
+			const char *src, uint32_t line)
+{
+	struct slab_node *node;
+	uint32_t nid;
+	int cnt = 0;
+	int req;
+	int rc;
+
+	__slab_remote_reclaim(slab);
+	nid = __slab_numa_local(slab);
+	while (cnt < n) {
+		req = n - cnt;
+		// 最大バッファ数を超える場合は獲得させない。
+		if (slab->s_max_buf_cnt) {
+			if (slab->s_max_buf_cnt <= slab->s_buf_cnt) {
+				if (!cnt) {
+					slab->s_stat.c_limit_fail++;
+				}
+				return cnt ? cnt : -EINVAL;
+			}
+			if (slab->s_max_buf_cnt - slab->s_buf_cnt
+							 < (uint64_t)req) {
+				req = (int)(slab->s_max_buf_cnt
+						 - slab->s_buf_cnt);
+			}
+		}
+
+		node = __slab_node_get(slab, nid, &rc);
+		if (!node) {
+			if (!cnt) {
+				slab->s_stat.c_fail++;
+			}
+			return cnt ? cnt : rc;
+		}
+
+		rc = __slab_alloc_bulk(node, out + cnt, req, src, line);
+		slab->s_buf_cnt += rc;
+		slab->s_stat.c_alloc += rc;
+		if (slab->s_buf_cnt > slab->s_stat.c_buf_peak) {
+			slab->s_stat.c_buf_peak = slab->s_buf_cnt;
+		}
+		cnt += rc;
+		// もしslabの獲得により優先度に変化が発生した時は、
+		// nodeを入れなおす。
+		__slab_resched(node);
+	}
+	return cnt;
+}
+
+// slabからメモリを獲得する。
+// 空きがない場合は新しいslabを獲得する。
+// 呼び出し元でslabをロックしていること。
+static void*
+__slab_cache_alloc(struct slab_cache *slab,
+		   const char *src, uint32_t line)
+{
+	void *buf;
+	int rc;
+
+	rc = __slab_cache_alloc_bulk(slab, &buf, 1, src, line);
+	if (rc < 0) {
+		return (void*)(intptr_t)rc;
+	}
+	return buf;
+}
+
+// 同一nodeに属するn個のメモリを一括でnodeへ返却する。
+// カウンタの集計と再スケジュールはまとめて1回とする。
+// 呼び出し元でslabをロックしていること。
+static void
+__slab_cache_free_run(struct slab_node *node, void **bufs, int n)
+{
+	struct slab_cache *slab = node->sn_slab;
+	void *slot;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		slot = __slab_b2s(slab, bufs[i]);
+		if (!__slab_is_lean(slab)) {
+			list_del(&((smem_header_t *)slot)->h_list);
+		}
+		__slab_poison(slab, slot);
+		// 空きリストは要素の先頭でつなぐ。
+		// ヘッダ付きの場合はh_magicが上書きされ、二重開放を検出できる。
+		// (マガジンに保持中の要素は__slab_mag_freeで書き換える)
+		*(void **)slot = node->sn_free;
+		node->sn_free = slot;
+	}
+	__slab_node_put(node, n);
+}
+
+// n個のメモリを一括でslabへ返却する。
+// 連続して同一nodeに属するメモリをまとめてnodeへ返却する。
+// バッファの検査とデストラクタは呼び出し元で実行済みであること。
+// 呼び出し元でslabをロックしていること。
+static void
+__slab_cache_free_bulk(struct slab_cache *slab, void **bufs, int n)
+{
+	struct slab_node *node;
+	int start = 0;
+	int i;
+
+	for (i = 1; i <= n; i++) {
+		node = __slab_b2n(slab, bufs[start]);
+		if (i < n && __slab_b2n(slab, bufs[i]) == node) {
+			continue;
+		}
+		__slab_cache_free_run(node, &bufs[start], i - start);
+		start = i;
+	}
+}
+
+// slabへn個のバッファを返却する。
+// ロックを取得できない場合は待たずにリモート開放リストへつなぐ。
+static void
+__slab_free_run_any(struct slab_cache *slab, void **bufs, int n)
+{
+	struct slab_node *node;
+	int start = 0;
+	int i;
+
+	if (__slab_trylock(slab)) {
+		__slab_cache_free_bulk(slab, bufs, n);
+		__slab_remote_reclaim(slab);
+		__slab_unlock(slab);
+		return;
+	}
+	for (i = 1; i <= n; i++) {
+		node = __slab_b2n(slab, bufs[start]);
+		if (i < n && __slab_b2n(slab, bufs[i]) == node) {
+			continue;
+		}
+		__slab_remote_free_run(node, &bufs[start], i - start);
+		start = i;
+	}
+}
+
+// 上限までの空きがsize未満かを判定する。
+static inline int
+__slab_budget_short(size_t size)
+{
+	size_t budget = __atomic_load_n(&__slab_budget, __ATOMIC_RELAXED);
+
+	return budget &&
+	       __atomic_load_n(&__slab_usage, __ATOMIC_RELAXED) + size > budget;
+}
+
+static int
+__slab_budget_shrink(struct slab_cache *slab, void *arg)
+{
+	slab_shrink(slab);
+	return !__slab_budget_short(*(size_t *)arg);
+}
+
+// 上限によりnodeを獲得できなかった場合に、メモリを回収する。
+// 保持している空きnodeを先に開放し、不足する場合はshrinkerを呼び出す。
+// slabのnodeを獲得できるようになった場合は1を返し、呼び出し元は再試行する。
+// 呼び出し元でslabをロックしていないこと。
+static int
+__slab_budget_reclaim(struct slab_cache *slab)
+{
+	struct slab_shrinker *sh;
+	struct list_head *pos;
+	size_t need = slab->s_node_size;
+	size_t usage;
+
+	if (!__slab_budget_short(need) || __slab_in_reclaim) {
+		// 上限以外の理由による失敗。
+		return 0;
+	}
+	__slab_in_reclaim = 1;
+
+	// 獲得するslab、登録したslabの順に空きnodeを開放する。
+	slab_shrink(slab);
+	if (__slab_budget_short(need)) {
+		slab_foreach(__slab_budget_shrink, &need);
+	}
+
+	pthread_mutex_lock(&__slab_shrinker_lock);
+	list_for_each(pos, &__slab_shrinker_list) {
+		if (!__slab_budget_short(need)) {
+			break;
+		}
+		sh = list_entry(pos, struct slab_shrinker, sh_list);
+		usage = __atomic_load_n(&__slab_usage, __ATOMIC_RELAXED);
+		sh->sh_scan(sh, usage + need
+			    - __atomic_load_n(&__slab_budget, __ATOMIC_RELAXED));
+		// 開放した要素で空いたnodeが保持されている場合に備える。
+		if (__slab_budget_short(need)) {
+			slab_foreach(__slab_budget_shrink, &need);
+		}
+	}
+	pthread_mutex_unlock(&__slab_shrinker_lock);
+
+	__slab_in_reclaim = 0;
+	return !__slab_budget_short(need);
+}
+
+// マガジンのカウンタを加算する。
+// 所有スレッドのみが更新するため、slab_statsから読めるようにストアのみ
+// アトミックに行う。
+static inline void
+__slab_mag_count(uint64_t *cnt, uint64_t n)
+{
+	__atomic_store_n(cnt, *cnt + n, __ATOMIC_RELAXED);
+}
+
+// マガジン表のマガジンをすべて返却し、破棄する。
+static void
+__slab_mag_release(struct slab_mag_table *tbl)
+{
+	struct slab_magazine *mag;
+	struct slab_cache *slab;
+	uint32_t id;
+
+	for (id = 0; id < tbl->t_cnt; id++) {
+		mag = tbl->t_mags[id];
+		if (!mag) {
+			continue;
+		}
+		// slab_destroyで切り離されたマガジンは破棄のみ行う。
+		slab = __atomic_load_n(&mag->m_slab, __ATOMIC_ACQUIRE);
+		if (slab) {
+			__slab_lock(slab);
+			__slab_cache_free_bulk(slab, mag->m_buf, mag->m_cnt);
+			// カウンタをslabへ引き継ぐ。
+			slab->s_stat.c_mag_alloc += mag->m_alloc;
+			slab->s_stat.c_mag_free += mag->m_free;
+			slab->s_stat.c_mag_in += mag->m_in;
+			slab->s_stat.c_mag_out += mag->m_out + mag->m_cnt;
+			list_del(&mag->m_list);
+			__slab_unlock(slab);
+		}
+		free(mag);
+	}
+	free(tbl);
+}
+
+// スレッド終了時にマガジンを返却する。
+static void
+__slab_mag_destructor(void *arg)
+{
+	__slab_mags = NULL;
+	__slab_mag_release((struct slab_mag_table *)arg);
+}
+
+static void
+__slab_mag_key_init(void)
+{
+	pthread_key_create(&__slab_mag_key, __slab_mag_destructor);
+}
+
+// マガジン識別子を返却する。
+// 記録できない場合は再利用しない。(マガジン表が大きくなるのみ)
+static void
+__slab_mag_id_put(uint32_t id)
+{
+	uint32_t *ids;
+	uint32_t size;
+
+	pthread_mutex_lock(&__slab_mag_id_lock);
+	if (__slab_mag_id_free_cnt == __slab_mag_id_free_size) {
+		size = __slab_mag_id_free_size ? __slab_mag_id_free_size * 2 : 16;
+		ids = (uint32_t *)realloc(__slab_mag_id_free,
+					  sizeof(*ids) * size);
+		if (!ids) {
+			pthread_mutex_unlock(&__slab_mag_id_lock);
+			return;
+		}
+		__slab_mag_id_free = ids;
+		__slab_mag_id_free_size = size;
+	}
+	__slab_mag_id_free[__slab_mag_id_free_cnt++] = id;
+	pthread_mutex_unlock(&__slab_mag_id_lock);
+}
+
+// slabのマガジン識別子を取得する。未割当の場合は割り当てる。
+// マガジン表を小さく保つため、返却された識別子を優先して使用する。
+static uint32_t
+__slab_mag_id(struct slab_cache *slab)
+{
+	uint32_t id = __atomic_load_n(&slab->s_mag_id, __ATOMIC_RELAXED);
+	uint32_t old = 0;
+
+	if (id) {
+		return id;
+	}
+	pthread_mutex_lock(&__slab_mag_id_lock);
+	if (__slab_mag_id_free_cnt) {
+		id = __slab_mag_id_free[--__slab_mag_id_free_cnt];
+	} else {
+		id = __slab_mag_id_next++;
+	}
+	pthread_mutex_unlock(&__slab_mag_id_lock);
+	if (!__atomic_compare_exchange_n(&slab->s_mag_id, &old, id, 0,
+					 __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		// 他スレッドが割り当てた。
+		__slab_mag_id_put(id);
+		id = old;
+	}
+	return id;
+}
+
+// 呼び出したスレッドのslab用マガジンを取得する。
+// 存在しない場合は作成する。
+static struct slab_magazine *
+__slab_mag_get(struct slab_cache *slab)
+{
+	struct slab_mag_table *tbl = __slab_mags;
+	struct slab_magazine *mag;
+	uint32_t id = __slab_mag_id(slab);
+	uint32_t cnt;
+
+	if (tbl && id < tbl->t_cnt) {
+		mag = tbl->t_mags[id];
+		if (mag && mag->m_slab == slab) {
+			return mag;
+		}
+	}
+
+	// マガジン表を拡張する。
+	if (!tbl || id >= tbl->t_cnt) {
+		cnt = tbl ? tbl->t_cnt : 16;
+		while (cnt <= id) {
+			cnt *= 2;
+		}
+		tbl = (struct slab_mag_table *)
+			realloc(tbl, sizeof(*tbl)
+				     + sizeof(tbl->t_mags[0]) * cnt);
+		if (!tbl) {
+			return NULL;
+		}
+		if (!__slab_mags) {
+			tbl->t_cnt = 0;
+		}
+		memset(&tbl->t_mags[tbl->t_cnt], 0,
+		       sizeof(tbl->t_mags[0]) * (cnt - tbl->t_cnt));
+		tbl->t_cnt = cnt;
+		pthread_once(&__slab_mag_once, __slab_mag_key_init);
+		pthread_setspecific(__slab_mag_key, tbl);
+		__slab_mags = tbl;
+	}
+
+	mag = tbl->t_mags[id];
+	if (!mag || mag->m_size != slab->s_mag_size) {
+		free(mag);
+		mag = (struct slab_magazine *)
+			malloc(sizeof(*mag)
+			       + sizeof(mag->m_buf[0]) * slab->s_mag_size);
+		tbl->t_mags[id] = mag;
+		if (!mag) {
+			return NULL;
+		}
+		mag->m_size = slab->s_mag_size;
+	}
+	mag->m_slab = slab;
+	mag->m_cnt = 0;
+	mag->m_alloc = 0;
+	mag->m_free = 0;
+	mag->m_in = 0;
+	mag->m_out = 0;
+	__slab_lock(slab);
+	if (!slab->s_mags.next) {
+		init_list_head(&slab->s_mags);
+	}
+	list_add_tail(&mag->m_list, &slab->s_mags);
+	__slab_unlock(slab);
+	return mag;
+}
+
+// マガジンを半分まで補充する。
+// マガジンに保持する要素は獲得箇所を持たない。(slab_profileで除外する)
+static int
+__slab_mag_fill(struct slab_magazine *mag)
+{
+	struct slab_cache *slab = mag->m_slab;
+	uint32_t target = (mag->m_size + 1) / 2;
+	int rc;
+	int i;
+
+	__slab_lock(slab);
+	rc = __slab_cache_alloc_bulk(slab, &mag->m_buf[mag->m_cnt],
+				     target - mag->m_cnt, NULL, 0);
+	__slab_unlock(slab);
+	if (rc < 0) {
+		return rc;
+	}
+	if (!__slab_is_lean(slab)) {
+		for (i = 0; i < rc; i++) {
+			__slab_b2h(mag->m_buf[mag->m_cnt + i])->h_magic
+							 = _SLAB_MAGIC_MAG;
+		}
+	}
+	mag->m_cnt += rc;
+	__slab_mag_count(&mag->m_in, rc);
+	return 0;
+}
+
+// マガジンを半分まで返却する。
+static void
+__slab_mag_drain(struct slab_magazine *mag)
+{
+	struct slab_cache *slab = mag->m_slab;
+	uint32_t target = mag->m_size / 2;
+
+	// 古いものから返却し、キャッシュに残っている可能性が高いものを残す。
+	__slab_free_run_any(slab, mag->m_buf, mag->m_cnt - target);
+	__slab_mag_count(&mag->m_out, mag->m_cnt - target);
+	memmove(&mag->m_buf[0], &mag->m_buf[mag->m_cnt - target],
+		sizeof(mag->m_buf[0]) * target);
+	mag->m_cnt = target;
+}
+
+// マガジンからメモリを獲得する。
+static void*
+__slab_mag_alloc(struct slab_cache *slab, const char *src, uint32_t line)
+{
+	struct slab_magazine *mag;
+	smem_header_t *h;
+	smem_footer_t *f;
+	void *buf;
+	int rc;
+
+	mag = __slab_mag_get(slab);
+	if (!mag) {
+		return (void*)-ENOMEM;
+	}
+	if (!mag->m_cnt) {
+		rc = __slab_mag_fill(mag);
+		if (rc == -ENOMEM && __slab_budget_reclaim(slab)) {
+			rc = __slab_mag_fill(mag);
+		}
+		if (rc) {
+			return (void*)(intptr_t)rc;
+		}
+	}
+
+	buf = mag->m_buf[--mag->m_cnt];
+	__slab_mag_count(&mag->m_alloc, 1);
+	if (!__slab_is_lean(slab)) {
+		h = __slab_b2h(buf);
+		h->h_magic = _SLAB_MAGIC;
+		__slab_ref_init(slab, h);
+		f = __slab_h2f(slab, h);
+		f->f_src = src;
+		f->f_line = line;
+	}
+	__slab_construct(slab, buf);
+	return buf;
+}
+
+// マガジンへメモリを返却する。
+static void
+__slab_mag_free(struct slab_cache *slab, void *buf)
+{
+	struct slab_magazine *mag;
+
+	mag = __slab_mag_get(slab);
+	if (!mag) {
+		// マガジンを作成できない場合は直接返却する。
+		__slab_lock(slab);
+		__slab_cache_free_bulk(slab, &buf, 1);
+		__slab_unlock(slab);
+		return;
+	}
+	if (mag->m_cnt == mag->m_size) {
+		__slab_mag_drain(mag);
+	}
+	// 二重開放を検出できるように、開放済みとしてマークする。
+	if (!__slab_is_lean(slab)) {
+		__slab_b2h(buf)->h_magic = _SLAB_MAGIC_MAG;
+		__slab_h2f(slab, __slab_b2h(buf))->f_src = NULL;
+	}
+	mag->m_buf[mag->m_cnt++] = buf;
+	__slab_mag_count(&mag->m_free, 1);
+}
+
+// 検査済みのメモリをslabへ返却する。
+static void
+__slab_free_checked(struct slab_cache *slab, struct slab_node *node,
+		    void *buf)
+{
+	__slab_destruct(slab, buf);
+
+	if (slab->s_mag_size) {
+		__slab_mag_free(slab, buf);
+		return;
+	}
+
+	if (!__slab_trylock(slab)) {
+		__slab_remote_free_run(node, &buf, 1);
+		return;
+	}
+	__slab_cache_free_run(node, &buf, 1);
+	__slab_remote_reclaim(slab);
+	__slab_unlock(slab);
+}
+
+// n個のメモリを一括でslabへ返却する。
+// slabがNULLの場合はヘッダから求める。
+static int
+__slab_free_bulk(struct slab_cache *slab, void **bufs, int n)
+{
+	struct slab_cache *locked = NULL;
+	struct slab_cache *s;
+	struct slab_node *node;
+	int start = 0;
+	int rc = 0;
+	int i;
+
+	if (!bufs || n < 0) {
+		return -EINVAL;
+	}
+
+	// 不正なバッファを取り除きながらデストラクタを実行する。
+	for (i = 0; i < n; i++) {
+		node = __slab_check(slab, bufs[i]);
+		if (!node) {
+			// 不正アクセス。
+			rc = -EFAULT;
+			continue;
+		}
+		__slab_destruct(node->sn_slab, bufs[i]);
+		bufs[start++] = bufs[i];
+	}
+	n = start;
+
+	// 同一slabに属する連続した範囲ごとにロックを取得して返却する。
+	start = 0;
+	for (i = 1; i <= n; i++) {
+		s = slab ? slab : __slab_b2h(bufs[start])->h_node->sn_slab;
+		if (i < n &&
+		    (slab || __slab_b2h(bufs[i])->h_node->sn_slab == s)) {
+			continue;
+		}
+		if (locked != s) {
+			if (locked) {
+				__slab_unlock(locked);
+			}
+			__slab_lock(s);
+			locked = s;
+		}
+		__slab_cache_free_bulk(s, &bufs[start], i - start);
+		start = i;
+	}
+	if (locked) {
+		__slab_unlock(locked);
+	}
+	return rc;
+}
+
+void*
+_slab_alloc(struct slab_cache *slab,
+		   const char *src, uint32_t line)
+{
+	void *buf;
+
+	if (slab->s_flags & SLAB_F_BIASED) {
+		__slab_ref_drain();
+	}
+	if (slab->s_mag_size) {
+		return __slab_mag_alloc(slab, src, line);
+	}
+
+	__slab_lock(slab);
+	buf = __slab_cache_alloc(slab, src, line);
+	__slab_unlock(slab);
+	if (buf == (void*)-ENOMEM && __slab_budget_reclaim(slab)) {
+		__slab_lock(slab);
+		buf = __slab_cache_alloc(slab, src, line);
+		__slab_unlock(slab);
+	}
+	if (!__slab_is_err(buf)) {
+		__slab_construct(slab, buf);
+	}
+	return buf;
+}
+
+int
+slab_free(void *buf)
+{
+	struct slab_node *node;
+
+	node = __slab_check(NULL, buf);
+	if (!node) {
+		// 不正アクセス。
+		return -EFAULT;
+	}
+	__slab_free_checked(node->sn_slab, node, buf);
+	return 0;
+}
+
+int
+slab_cache_free(struct slab_cache *slab, void *buf)
+{
+	struct slab_node *node;
+
+	node = __slab_check(slab, buf);
+	if (!node) {
+		// 不正アクセス。
+		return -EFAULT;
+	}
+	__slab_free_checked(slab, node, buf);
+	return 0;
+}
+
+int
+_slab_alloc_bulk(struct slab_cache *slab, void **out, int n,
+		 const char *src, uint32_t line)
+{
+	int cnt;
+	int i;
+
+	if (!out || n <= 0) {
+		return -EINVAL;
+	}
+	if (slab->s_flags & SLAB_F_BIASED) {
+		__slab_ref_drain();
+	}
+
+	__slab_lock(slab);
+	cnt = __slab_cache_alloc_bulk(slab, out, n, src, line);
+	__slab_unlock(slab);
+	if (cnt == -ENOMEM && __slab_budget_reclaim(slab)) {
+		__slab_lock(slab);
+		cnt = __slab_cache_alloc_bulk(slab, out, n, src, line);
+		__slab_unlock(slab);
+	}
+	for (i = 0; i < cnt; i++) {
+		__slab_construct(slab, out[i]);
+	}
+	return cnt;
+}
+
+int
+slab_free_bulk(void **bufs, int n)
+{
+	return __slab_free_bulk(NULL, bufs, n);
+}
+
+int
+slab_cache_free_bulk(struct slab_cache *slab, void **bufs, int n)
+{
+	return __slab_free_bulk(slab, bufs, n);
+}
+
+int
+slab_shrink(struct slab_cache *slab)
+{
+	struct slab_pool *pool;
+	struct slab_node *node;
+	uint32_t nid;
+	int cnt = 0;
+
+	__slab_lock(slab);
+	__slab_remote_reclaim(slab);
+	for (nid = 0; nid < (slab->s_numa ? SLAB_NUMA_MAX : 1); nid++) {
+		pool = __slab_pool(slab, nid);
+		while (pool->p_bin_map & (1U << SLAB_PRIO)) {
+			node = list_first_entry(&pool->p_bins[SLAB_PRIO],
+						struct slab_node, sn_list);
+			__slab_node_free(slab, node);
+			cnt++;
+		}
+	}
+	__slab_unlock(slab);
+	return cnt;
+}
+
+struct slab_cache *
+slab_create(const char *name, size_t size, size_t align,
+	    size_t node_size, uint64_t max_cnt, uint32_t flags)
+{
+	struct slab_cache *slab;
+	size_t len;
+
+	if (!name || !size || (align & (align - 1)) || align > UINT32_MAX) {
+		return NULL;
+	}
+
+	// 名前はslab_cacheの直後に複製する。
+	len = strlen(name) + 1;
+	slab = (struct slab_cache *)malloc(sizeof(*slab) + len);
+	if (!slab) {
+		return NULL;
+	}
+	INIT_SLAB(slab, size, node_size ? node_size : SLAB_DEFAULT_SZ,
+		  max_cnt);
+	slab->s_name = (const char *)memcpy(slab + 1, name, len);
+	slab->s_flags = (flags & ~SLAB_F_CREATED) | SLAB_F_CREATED;
+	slab->s_align = (uint32_t)align;
+	slab_register(slab);
+	return slab;
+}
+
+// 使用中のバッファのデストラクタを実行する。
+// マガジンに保持中の要素は開放時に実行済みのため除く。
+// SLAB_F_CTOR_ONCEの場合は、nodeの開放時に構築済みのすべての要素の
+// デストラクタを実行するため、dtorが0なら使用中のバッファを未構築とする。
+static void
+__slab_destroy_dtor(struct slab_cache *slab, struct slab_node *node, int dtor)
+{
+	struct list_head *pos;
+	smem_header_t *h;
+	smem_footer_t *f;
+
+	list_for_each(pos, &node->sn_alist) {
+		h = list_entry(pos, smem_header_t, h_list);
+		f = __slab_h2f(slab, h);
+		if (!f->f_src) {
+			continue;
+		}
+		if (__slab_is_ctor_once(slab)) {
+			if (!dtor) {
+				f->f_ctor = 0;
+			}
+		} else if (dtor) {
+			slab->s_destructor(__slab_h2b(h), slab->s_size);
+		}
+	}
+}
+
+int
+slab_destroy(struct slab_cache *slab, uint32_t flags)
+{
+	struct slab_magazine *mag;
+	struct slab_pool *pool;
+	struct slab_node *node;
+	uint64_t cached = 0;
+	uint64_t leaked;
+	uint32_t mag_id;
+	uint32_t nid;
+	uint32_t bin;
+
+	if (!slab) {
+		return -EINVAL;
+	}
+	slab_unregister(slab);
+
+	__slab_lock(slab);
+	// マガジンをslabから切り離す。保持中の要素はnodeとともに破棄する。
+	// 切り離したマガジンはスレッド終了時に破棄される。
+	while (slab->s_mags.next && slab->s_mags.next != &slab->s_mags) {
+		mag = list_entry(slab->s_mags.next, struct slab_magazine,
+				 m_list);
+		cached += mag->m_cnt;
+		mag->m_cnt = 0;
+		__atomic_store_n(&mag->m_slab, NULL, __ATOMIC_RELEASE);
+		list_del(&mag->m_list);
+	}
+	// 切り離したマガジンはm_slabが一致しないため、識別子は他のslabで
+	// 再利用できる。破棄後に使用する場合は再度割り当てる。
+	mag_id = slab->s_mag_id;
+	slab->s_mag_id = 0;
+	__slab_remote_reclaim(slab);
+	leaked = slab->s_buf_cnt - cached;
+
+	for (nid = 0; nid < (slab->s_numa ? SLAB_NUMA_MAX : 1); nid++) {
+		pool = __slab_pool(slab, nid);
+		for (bin = 0; bin <= SLAB_PRIO; bin++) {
+			while (pool->p_bin_map & (1U << bin)) {
+				node = list_first_entry(&pool->p_bins[bin],
+							struct slab_node,
+							sn_list);
+				if (slab->s_destructor &&
+				    !__slab_is_lean(slab)) {
+					__slab_destroy_dtor(slab, node,
+						flags & SLAB_DESTROY_DTOR);
+				}
+				__slab_node_free(slab, node);
+			}
+		}
+		pool->p_empty_cnt = 0;
+	}
+	slab->s_buf_cnt = 0;
+	slab->s_verify = 0;
+	free(slab->s_numa);
+	slab->s_numa = NULL;
+	slab->s_numa_policy = SLAB_NUMA_OFF;
+	__slab_unlock(slab);
+	if (mag_id) {
+		__slab_mag_id_put(mag_id);
+	}
+
+	if (slab->s_flags & SLAB_F_CREATED) {
+		free(slab);
+	}
+	return (int)leaked;
+}
+
+int
+slab_set_numa(struct slab_cache *slab, uint32_t policy)
+{
+	struct slab_pool *pools;
+	int rc = 0;
+
+	if (policy > SLAB_NUMA_STRICT) {
+		return -EINVAL;
+	}
+	__slab_lock(slab);
+	if (slab->s_node_cnt) {
+		// 使用中のnodeはpoolを移動できない。
+		rc = -EBUSY;
+	} else if (policy == SLAB_NUMA_OFF) {
+		pools = slab->s_numa;
+		slab->s_numa = NULL;
+		free(pools);
+	} else if (!slab->s_numa) {
+		// NUMAノード0はs_poolを使用する。
+		pools = (struct slab_pool *)
+			calloc(SLAB_NUMA_MAX - 1, sizeof(*pools));
+		if (pools) {
+			slab->s_numa = pools;
+		} else {
+			rc = -ENOMEM;
+		}
+	}
+	if (!rc) {
+		slab->s_numa_policy = policy;
+	}
+	__slab_unlock(slab);
+	return rc;
+}
+
+void
+slab_set_numa_node(int nid)
+{
+	__slab_numa_node = nid;
+}
+
+void
+slab_set_budget(size_t bytes)
+{
+	__atomic_store_n(&__slab_budget, bytes, __ATOMIC_RELAXED);
+}
+
+size_t
+slab_usage(void)
+{
+	return __atomic_load_n(&__slab_usage, __ATOMIC_RELAXED);
+}
+
+void
+slab_shrinker_register(struct slab_shrinker *sh)
+{
+	pthread_mutex_lock(&__slab_shrinker_lock);
+	list_add_tail(&sh->sh_list, &__slab_shrinker_list);
+	pthread_mutex_unlock(&__slab_shrinker_lock);
+}
+
+void
+slab_shrinker_unregister(struct slab_shrinker *sh)
+{
+	pthread_mutex_lock(&__slab_shrinker_lock);
+	list_del(&sh->sh_list);
+	pthread_mutex_unlock(&__slab_shrinker_lock);
+}
+
+int
+slab_set_align(struct slab_cache *slab, uint32_t align)
+{
+	int rc = 0;
+
+	if (align & (align - 1)) {
+		return -EINVAL;
+	}
+	__slab_lock(slab);
+	if (slab->s_node_cnt) {
+		// 作成済みのnodeの配置は変更できない。
+		rc = -EBUSY;
+	} else {
+		slab->s_align = align;
+	}
+	__slab_unlock(slab);
+	return rc;
+}
+
+int
+slab_set_magazine(struct slab_cache *slab, uint32_t size)
+{
+	if (size > SLAB_MAGAZINE_MAX) {
+		return -EINVAL;
+	}
+	if (size) {
+		__slab_mag_id(slab);
+	}
+	slab->s_mag_size = size;
+	return 0;
+}
+
+void
+slab_magazine_flush(void)
+{
+	struct slab_mag_table *tbl = __slab_mags;
+
+	if (!tbl) {
+		return;
+	}
+	__slab_mags = NULL;
+	pthread_setspecific(__slab_mag_key, NULL);
+	__slab_mag_release(tbl);
+}
+
+// 参照カウントを操作できるバッファのヘッダを取得する。
+static inline smem_header_t*
+__slab_ref_hdr(void *buf)
+{
+	smem_header_t *h;
+
+	if (!buf) {
+		return NULL;
+	}
+	h = __slab_b2h(buf);
+	if (h->h_magic != _SLAB_MAGIC || !h->h_node) {
+		return NULL;
+	}
+	return h;
+}
+
+// バイアスモードで、呼び出したスレッドが所有スレッドであるかを判定する。
+// h_sharedのMERGEDは所有スレッドのみが設定するため、所有スレッドからは
+// 常に最新の値が見える。
+static inline int
+__slab_ref_is_owner(smem_header_t *h)
+{
+	return h->h_owner && h->h_owner == __slab_tid &&
+	       !(__atomic_load_n(&h->h_shared, __ATOMIC_RELAXED)
+							 & _SLAB_REF_MERGED);
+}
+
+// アトミックな参照カウントを加算する。
+static inline int
+__slab_ref_inc(uint32_t *cnt)
+{
+	uint32_t old;
+
+	old = __atomic_load_n(cnt, __ATOMIC_RELAXED);
+	do {
+		if ((old & _SLAB_REFCNT_MAX) == _SLAB_REFCNT_MAX) {
+			return -EOVERFLOW;
+		}
+	} while (!__atomic_compare_exchange_n(cnt, &old, old + 1, 1,
+					      __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
+	return (int)((old + 1) & _SLAB_REFCNT_MAX);
+}
+
+int
+slab_get(void *buf)
+{
+	smem_header_t *h;
+
+	h = __slab_ref_hdr(buf);
+	if (!h) {
+		// 不正アクセス。
+		return -EFAULT;
+	}
+
+	// 参照を持つスレッドからのみ呼び出されるため、加算に順序の保証は
+	// 必要ない。
+	if (!h->h_owner) {
+		return __slab_ref_inc(&h->h_refcnt);
+	}
+	if (__slab_ref_is_owner(h)) {
+		if (h->h_refcnt == _SLAB_REFCNT_MAX) {
+			return -EOVERFLOW;
+		}
+		return (int)++h->h_refcnt;
+	}
+	return __slab_ref_inc(&h->h_shared);
+}
+
+int
+slab_get_refcnt(void *buf)
+{
+	smem_header_t *h;
+	uint32_t shared;
+
+	h = __slab_ref_hdr(buf);
+	if (!h) {
+		// 不正アクセス。
+		return -EFAULT;
+	}
+
+	if (!h->h_owner) {
+		return (int)__atomic_load_n(&h->h_refcnt, __ATOMIC_RELAXED);
+	}
+	// バイアスモードでは所有スレッド以外からは概算値となる。
+	if (__slab_ref_is_owner(h)) {
+		__slab_ref_drain();
+	}
+	shared = __atomic_load_n(&h->h_shared, __ATOMIC_RELAXED);
+	if (shared & _SLAB_REF_MERGED) {
+		return (int)(shared & _SLAB_REFCNT_MAX);
+	}
+	return (int)(__atomic_load_n(&h->h_refcnt, __ATOMIC_RELAXED)
+							 + shared);
+}
+
+// 他スレッドから所有スレッドの参照を返却する。
+// 所有スレッドが動作している場合は所有スレッドのキューへ渡し、0を返す。
+// 終了している場合は所有スレッドのカウントは変化しないため、他スレッドの
+// カウントへ統合する。
+static int
+__slab_ref_handoff(smem_header_t *h, void *buf)
+{
+	struct slab_ref_queue *q;
+	struct list_head *pos;
+	uint32_t old;
+	uint32_t cnt;
+	uint32_t nv;
+	void **bufs;
+
+	pthread_mutex_lock(&__slab_ref_lock);
+	list_for_each(pos, &__slab_ref_list) {
+		q = list_entry(pos, struct slab_ref_queue, q_list);
+		if (q->q_tid != h->h_owner) {
+			continue;
+		}
+		if (q->q_cnt == q->q_size) {
+			nv = q->q_size ? q->q_size * 2 : 16;
+			bufs = (void **)realloc(q->q_bufs, sizeof(*bufs) * nv);
+			if (!bufs) {
+				pthread_mutex_unlock(&__slab_ref_lock);
+				return -ENOMEM;
+			}
+			q->q_bufs = bufs;
+			q->q_size = nv;
+		}
+		q->q_bufs[q->q_cnt] = buf;
+		__atomic_store_n(&q->q_cnt, q->q_cnt + 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&__slab_ref_lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&__slab_ref_lock);
+
+	// 所有スレッドのカウントの最終値は__slab_ref_lockで参照できる。
+	old = __atomic_load_n(&h->h_shared, __ATOMIC_RELAXED);
+	do {
+		if (old & _SLAB_REF_MERGED) {
+			if (!(old & _SLAB_REFCNT_MAX)) {
+				return -EINVAL;
+			}
+			nv = old - 1;
+			cnt = nv & _SLAB_REFCNT_MAX;
+		} else {
+			cnt = h->h_refcnt - 1 + (old & _SLAB_REFCNT_MAX);
+			nv = cnt | _SLAB_REF_MERGED;
+		}
+	} while (!__atomic_compare_exchange_n(&h->h_shared, &old, nv, 1,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+	if (!cnt) {
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		slab_free(buf);
+	}
+	return (int)cnt;
+}
+
+int
+slab_put(void *buf)
+{
+	smem_header_t *h;
+	uint32_t old;
+	uint32_t cnt;
+
+	h = __slab_ref_hdr(buf);
+	if (!h) {
+		// 不正アクセス。
+		return -EFAULT;
 	}
 
-	mb();
-	h->h_refcnt--;
-	if (!h->h_refcnt) {
+	if (!h->h_owner) {
+		// 開放するスレッドが他スレッドの書き込みを参照できるように、
+		// 減算はrelease、開放の前にacquireを行う。
+		cnt = __atomic_sub_fetch(&h->h_refcnt, 1, __ATOMIC_RELEASE);
+	} else if (__slab_ref_is_owner(h)) {
+		// 保持している参照があるため、他スレッドの返却を先に
+		// 減算してもbufは開放されない。
+		__slab_ref_drain();
+		return __slab_ref_put_owner(h, buf);
+	} else {
+		old = __atomic_load_n(&h->h_shared, __ATOMIC_RELAXED);
+		do {
+			if (old == _SLAB_REF_MERGED) {
+				// 参照を持たないスレッドからの開放。
+				return -EINVAL;
+			}
+			if (!(old & _SLAB_REFCNT_MAX)) {
+				// 所有スレッドの参照を受け渡されている。
+				return __slab_ref_handoff(h, buf);
+			}
+		} while (!__atomic_compare_exchange_n(&h->h_shared, &old,
+						      old - 1, 1,
+						      __ATOMIC_RELEASE,
+						      __ATOMIC_RELAXED));
+		cnt = old - 1;
+		if (cnt != _SLAB_REF_MERGED) {
+			return (int)(cnt & _SLAB_REFCNT_MAX);
+		}
+		cnt = 0;
+	}
+	if (!cnt) {
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
 		slab_free(buf);
 	}
-	return h->h_refcnt;
+	return (int)cnt;
+}
+
+int
+slab_stats(struct slab_cache *slab, struct slab_stats *st)
+{
+	struct slab_magazine *mag;
+	struct slab_pool *pool;
+	struct list_head *pos;
+	uint64_t mag_alloc;
+	uint64_t mag_free;
+	uint64_t mag_in;
+	uint64_t mag_out;
+	uintptr_t first;
+	uint32_t nid;
+	uint32_t bin;
+
+	if (!slab || !st) {
+		return -EINVAL;
+	}
+	memset(st, 0, sizeof(*st));
+	st->st_name = slab->s_name;
+	st->st_size = slab->s_size;
+	st->st_node_size = slab->s_node_size;
+	// nodeがs_node_size境界に配置された場合の要素数
+	st->st_node_objs = __slab_node_layout(slab, 0, 0, &first);
+
+	__slab_lock(slab);
+	mag_alloc = slab->s_stat.c_mag_alloc;
+	mag_free = slab->s_stat.c_mag_free;
+	mag_in = slab->s_stat.c_mag_in;
+	mag_out = slab->s_stat.c_mag_out;
+	if (slab->s_mags.next) {
+		list_for_each(pos, &slab->s_mags) {
+			mag = list_entry(pos, struct slab_magazine, m_list);
+			mag_alloc += __atomic_load_n(&mag->m_alloc,
+						     __ATOMIC_RELAXED);
+			mag_free += __atomic_load_n(&mag->m_free,
+						    __ATOMIC_RELAXED);
+			mag_in += __atomic_load_n(&mag->m_in,
+						  __ATOMIC_RELAXED);
+			mag_out += __atomic_load_n(&mag->m_out,
+						   __ATOMIC_RELAXED);
+		}
+	}
+	// マガジンとslabの間の移動は利用者の獲得、開放に含めない。
+	st->st_alloc = slab->s_stat.c_alloc - mag_in + mag_alloc;
+	st->st_free = slab->s_stat.c_free - mag_out + mag_free;
+	st->st_mag_cnt = mag_in - mag_alloc + mag_free - mag_out;
+	st->st_node_alloc = slab->s_stat.c_node_alloc;
+	st->st_node_free = slab->s_stat.c_node_free;
+	st->st_node_cnt = slab->s_node_cnt;
+	st->st_buf_cnt = slab->s_buf_cnt;
+	st->st_buf_peak = slab->s_stat.c_buf_peak;
+	st->st_limit_fail = slab->s_stat.c_limit_fail;
+	st->st_alloc_fail = slab->s_stat.c_fail;
+	for (nid = 0; nid < (slab->s_numa ? SLAB_NUMA_MAX : 1); nid++) {
+		pool = __slab_pool(slab, nid);
+		for (bin = 0; bin <= SLAB_PRIO; bin++) {
+			if (!(pool->p_bin_map & (1U << bin))) {
+				continue;
+			}
+			list_for_each(pos, &pool->p_bins[bin]) {
+				st->st_bins[bin]++;
+			}
+		}
+	}
+	__slab_unlock(slab);
+
+	st->st_live_bytes = (st->st_buf_cnt - st->st_mag_cnt) * st->st_size;
+	st->st_node_bytes = st->st_node_cnt * st->st_node_size;
+	return 0;
+}
+
+// 獲得箇所の表のハッシュ値を求める。
+static inline uint32_t
+__slab_site_hash(const char *src, uint32_t line)
+{
+	uint64_t key = (uint64_t)(uintptr_t)src ^ ((uint64_t)line << 32);
+
+	key *= 0x9E3779B97F4A7C15ULL;
+	return (uint32_t)(key >> 32);
+}
+
+// バイト数の多い順に並べる。
+static int
+__slab_site_cmp(const void *a, const void *b)
+{
+	const struct slab_site *sa = (const struct slab_site *)a;
+	const struct slab_site *sb = (const struct slab_site *)b;
+
+	if (sa->ss_bytes != sb->ss_bytes) {
+		return sa->ss_bytes < sb->ss_bytes ? 1 : -1;
+	}
+	return sa->ss_cnt < sb->ss_cnt ? 1 : sa->ss_cnt > sb->ss_cnt ? -1 : 0;
+}
+
+// 獲得箇所の表からsrc、lineの要素を取得する。ない場合は追加する。
+// 表が一杯の場合はNULLを返す。
+static struct slab_site*
+__slab_site_get(struct slab_site *sites, uint32_t n,
+		const char *src, uint32_t line)
+{
+	uint32_t i = __slab_site_hash(src, line) % n;
+	uint32_t cnt;
+
+	for (cnt = 0; cnt < n; cnt++, i = (i + 1) % n) {
+		if (!sites[i].ss_src) {
+			sites[i].ss_src = src;
+			sites[i].ss_line = line;
+			return &sites[i];
+		}
+		if (sites[i].ss_src == src && sites[i].ss_line == line) {
+			return &sites[i];
+		}
+	}
+	return NULL;
+}
+
+int
+slab_profile(struct slab_cache *slab, struct slab_site *sites, int n)
+{
+	struct slab_site *site;
+	struct slab_pool *pool;
+	struct slab_node *node;
+	struct list_head *npos;
+	struct list_head *pos;
+	smem_header_t *h;
+	smem_footer_t *f;
+	uint32_t nid;
+	uint32_t bin;
+	int cnt = 0;
+	int i;
+
+	if (!slab || !sites || n <= 0) {
+		return -EINVAL;
+	}
+	if (__slab_is_lean(slab)) {
+		// 獲得箇所を記録していない。
+		return -ENOTSUP;
+	}
+	memset(sites, 0, sizeof(*sites) * n);
+
+	// sitesを(f_src, f_line)をキーとするオープンアドレスの表として集計する。
+	// 他スレッドが開放したリモート開放リストの要素は先に回収する。
+	// 途中でロックを解放するとnodeがビン間を移動し、重複や漏れが生じる
+	// ため、走査の間はロックを保持する。(stop-the-world)
+	__slab_lock(slab);
+	__slab_remote_reclaim(slab);
+	for (nid = 0; nid < (slab->s_numa ? SLAB_NUMA_MAX : 1); nid++) {
+		pool = __slab_pool(slab, nid);
+		for (bin = 0; bin < SLAB_PRIO; bin++) {
+			if (!(pool->p_bin_map & (1U << bin))) {
+				continue;
+			}
+			list_for_each(npos, &pool->p_bins[bin]) {
+				node = list_entry(npos, struct slab_node,
+						  sn_list);
+				list_for_each(pos, &node->sn_alist) {
+					h = list_entry(pos, smem_header_t,
+						       h_list);
+					f = __slab_h2f(slab, h);
+					if (!f->f_src) {
+						// マガジンに保持中
+						continue;
+					}
+					site = __slab_site_get(sites, n,
+							       f->f_src,
+							       f->f_line);
+					if (!site) {
+						__slab_unlock(slab);
+						return -ENOSPC;
+					}
+					site->ss_cnt++;
+					site->ss_bytes += slab->s_size;
+				}
+			}
+		}
+	}
+	__slab_unlock(slab);
+
+	// 使用している要素を先頭へ詰めて並べる。
+	for (i = 0; i < n; i++) {
+		if (sites[i].ss_src) {
+			sites[cnt++] = sites[i];
+		}
+	}
+	qsort(sites, cnt, sizeof(*sites), __slab_site_cmp);
+	return cnt;
+}
+
+// 検査で破壊を検出したことを記録する。
+static inline void
+__slab_verify_bad(struct slab_verify *v, uint32_t *cnt, void *addr)
+{
+	if (!v->v_bad_hdr && !v->v_bad_ftr &&
+	    !v->v_bad_list && !v->v_bad_poison) {
+		v->v_bad = addr;
+	}
+	(*cnt)++;
+}
+
+// 要素がnodeの切り出し済みの範囲内、要素の境界にあるかを判定する。
+static inline int
+__slab_verify_slot(struct slab_node *node, void *slot, size_t stride)
+{
+	char *base = node->sn_base;
+
+	return (char *)slot >= base && (char *)slot < node->sn_bump &&
+	       !(((char *)slot - base) % stride);
+}
+
+// nodeを検査し、検査した要素数を返す。
+// 呼び出し元でslabをロックしていること。
+static uint32_t
+__slab_verify_node(struct slab_cache *slab, struct slab_node *node,
+		   struct slab_verify *v)
+{
+	size_t stride = __slab_stride(slab);
+	struct list_head *pos;
+	smem_header_t *h;
+	uint32_t free_cnt;
+	uint32_t cnt = 0;
+	size_t len;
+	size_t i;
+	char *start;
+	void *slot;
+
+	// 獲得済みの要素(マガジンに保持中の要素を含む)のヘッダ、フッタ。
+	// リストが壊れている場合に備え、nodeの要素数を上限として走査する。
+	if (!__slab_is_lean(slab)) {
+		for (pos = node->sn_alist.next; pos != &node->sn_alist;
+		     pos = pos->next) {
+			h = list_entry(pos, smem_header_t, h_list);
+			if (cnt >= node->sn_max_cnt ||
+			    !__slab_verify_slot(node, h, stride)) {
+				__slab_verify_bad(v, &v->v_bad_list, h);
+				break;
+			}
+			cnt++;
+			if ((h->h_magic != _SLAB_MAGIC &&
+			     h->h_magic != _SLAB_MAGIC_MAG) || h->h_node != node) {
+				__slab_verify_bad(v, &v->v_bad_hdr, h);
+			}
+			if (__slab_h2f(slab, h)->f_magic != _SLAB_MAGIC) {
+				__slab_verify_bad(v, &v->v_bad_ftr,
+						  __slab_h2b(h));
+			}
+		}
+		if (pos == &node->sn_alist && cnt != node->sn_alloc_cnt) {
+			__slab_verify_bad(v, &v->v_bad_list, node);
+		}
+	}
+
+	// 空きリストの要素。
+	// 空き要素の数はnodeの要素数から獲得済み、未切り出しの数を除いた数。
+	free_cnt = node->sn_max_cnt - node->sn_alloc_cnt
+		 - (uint32_t)((node->sn_bump_end - node->sn_bump) / stride);
+	for (slot = node->sn_free; slot; slot = *(void **)slot) {
+		if (!free_cnt || !__slab_verify_slot(node, slot, stride)) {
+			__slab_verify_bad(v, &v->v_bad_list, slot);
+			return cnt;
+		}
+		free_cnt--;
+		cnt++;
+		if (!__slab_is_lean(slab) &&
+		    __slab_h2f(slab, (smem_header_t *)slot)->f_magic
+							 != _SLAB_MAGIC) {
+			__slab_verify_bad(v, &v->v_bad_ftr, slot);
+		}
+		if (!(slab->s_flags & SLAB_F_POISON)) {
+			continue;
+		}
+		len = __slab_poison_range(slab, slot, &start);
+		for (i = 0; i < len; i++) {
+			if ((unsigned char)start[i] != SLAB_POISON) {
+				__slab_verify_bad(v, &v->v_bad_poison,
+						  start + i);
+				break;
+			}
+		}
+	}
+	if (free_cnt) {
+		__slab_verify_bad(v, &v->v_bad_list, node);
+	}
+	return cnt;
+}
+
+int
+slab_verify(struct slab_cache *slab, uint32_t budget, struct slab_verify *v)
+{
+	struct slab_verify tmp;
+	struct slab_pool *pool;
+	struct list_head *pos;
+	uint32_t skip;
+	uint32_t nid;
+	uint32_t bin;
+
+	if (!slab) {
+		return -EINVAL;
+	}
+	if (!v) {
+		v = &tmp;
+	}
+	memset(v, 0, sizeof(*v));
+
+	// 前回の続きのnodeから検査する。
+	// 呼び出しの間にnodeがビンを移動した場合、そのnodeは1周の中で
+	// 検査されないか2回検査されることがある。
+	__slab_lock(slab);
+	__slab_remote_reclaim(slab);
+	skip = slab->s_verify;
+	for (nid = 0; nid < (slab->s_numa ? SLAB_NUMA_MAX : 1); nid++) {
+		pool = __slab_pool(slab, nid);
+		for (bin = 0; bin <= SLAB_PRIO; bin++) {
+			if (!(pool->p_bin_map & (1U << bin))) {
+				continue;
+			}
+			list_for_each(pos, &pool->p_bins[bin]) {
+				if (skip) {
+					skip--;
+					continue;
+				}
+				if (budget && v->v_objs >= budget) {
+					goto out;
+				}
+				v->v_objs += __slab_verify_node(slab,
+					list_entry(pos, struct slab_node,
+						   sn_list), v);
+				v->v_nodes++;
+			}
+		}
+	}
+	v->v_done = 1;
+out:
+	slab->s_verify = v->v_done ? 0 : slab->s_verify + v->v_nodes;
+	__slab_unlock(slab);
+
+	if (v->v_bad_hdr || v->v_bad_ftr || v->v_bad_list || v->v_bad_poison) {
+		return -EFAULT;
+	}
+	return 0;
+}
+
+struct slab_cache *
+slab_find(const char *name)
+{
+	struct slab_cache *slab;
+	struct list_head *pos;
+
+	pthread_mutex_lock(&__slab_reg_lock);
+	list_for_each(pos, &__slab_reg_list) {
+		slab = list_entry(pos, struct slab_cache, s_reg);
+		if (slab->s_name && !strcmp(slab->s_name, name)) {
+			pthread_mutex_unlock(&__slab_reg_lock);
+			return slab;
+		}
+	}
+	pthread_mutex_unlock(&__slab_reg_lock);
+	return NULL;
+}
+
+int
+slab_register(struct slab_cache *slab)
+{
+	pthread_mutex_lock(&__slab_reg_lock);
+	if (slab->s_reg.next) {
+		pthread_mutex_unlock(&__slab_reg_lock);
+		return -EBUSY;
+	}
+	list_add_tail(&slab->s_reg, &__slab_reg_list);
+	pthread_mutex_unlock(&__slab_reg_lock);
+	return 0;
+}
+
+void
+slab_unregister(struct slab_cache *slab)
+{
+	pthread_mutex_lock(&__slab_reg_lock);
+	if (slab->s_reg.next) {
+		list_del(&slab->s_reg);
+		slab->s_reg.next = NULL;
+		slab->s_reg.prev = NULL;
+	}
+	pthread_mutex_unlock(&__slab_reg_lock);
+}
+
+int
+slab_foreach(int (*fn)(struct slab_cache *slab, void *arg), void *arg)
+{
+	struct list_head *pos;
+	int rc = 0;
+
+	pthread_mutex_lock(&__slab_reg_lock);
+	list_for_each(pos, &__slab_reg_list) {
+		rc = fn(list_entry(pos, struct slab_cache, s_reg), arg);
+		if (rc) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&__slab_reg_lock);
+	return rc;
+}
+
+// まとめにn個のバッファを格納できるようにする。
+static int
+__slab_epoch_reserve(struct slab_epoch_bucket *b, uint32_t n)
+{
+	struct slab_cache **slabs;
+	void **bufs;
+	uint32_t size;
+
+	if (n <= b->b_size) {
+		return 0;
+	}
+	size = b->b_size ? b->b_size : SLAB_EPOCH_BATCH;
+	while (size < n) {
+		size *= 2;
+	}
+	slabs = (struct slab_cache **)
+		realloc(b->b_slabs, sizeof(*slabs) * size);
+	if (!slabs) {
+		return -ENOMEM;
+	}
+	b->b_slabs = slabs;
+	bufs = (void **)realloc(b->b_bufs, sizeof(*bufs) * size);
+	if (!bufs) {
+		return -ENOMEM;
+	}
+	b->b_bufs = bufs;
+	b->b_size = size;
+	return 0;
+}
+
+// バッファをまとめに追加する。
+static int
+__slab_epoch_push(struct slab_epoch_bucket *b, struct slab_cache *slab,
+		  void *buf)
+{
+	if (__slab_epoch_reserve(b, b->b_cnt + 1)) {
+		return -ENOMEM;
+	}
+	b->b_slabs[b->b_cnt] = slab;
+	b->b_bufs[b->b_cnt] = buf;
+	b->b_cnt++;
+	return 0;
+}
+
+// まとめたバッファを同一slabの範囲ごとに一括でslabへ返却する。
+static void
+__slab_epoch_free(struct slab_epoch_bucket *b)
+{
+	uint32_t start = 0;
+	uint32_t i;
+
+	for (i = 1; i <= b->b_cnt; i++) {
+		if (i < b->b_cnt && b->b_slabs[i] == b->b_slabs[start]) {
+			continue;
+		}
+		__slab_free_bulk(b->b_slabs[start], &b->b_bufs[start],
+				 (int)(i - start));
+		start = i;
+	}
+	b->b_cnt = 0;
+}
+
+// 猶予期間が経過したまとめを返却する。返却を待っている数を返す。
+static uint32_t
+__slab_epoch_collect(struct slab_epoch_bucket *buckets, uint64_t epoch)
+{
+	uint32_t cnt = 0;
+	int i;
+
+	for (i = 0; i < SLAB_EPOCH_CNT; i++) {
+		if (buckets[i].b_cnt && buckets[i].b_epoch + 2 <= epoch) {
+			__slab_epoch_free(&buckets[i]);
+		}
+		cnt += buckets[i].b_cnt;
+	}
+	return cnt;
+}
+
+// 区間内のすべてのスレッドが現在のエポックにいる場合、エポックを進める。
+// 終了したスレッドから引き継いだバッファも返却する。
+// 現在のエポックを返す。
+static uint64_t
+__slab_epoch_advance(void)
+{
+	struct slab_epoch_rec *rec;
+	struct list_head *pos;
+	uint64_t epoch;
+	uint64_t e;
+
+	pthread_mutex_lock(&__slab_epoch_lock);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	epoch = __atomic_load_n(&__slab_epoch, __ATOMIC_SEQ_CST);
+	list_for_each(pos, &__slab_epoch_list) {
+		rec = list_entry(pos, struct slab_epoch_rec, r_list);
+		e = __atomic_load_n(&rec->r_epoch, __ATOMIC_SEQ_CST);
+		if ((e & 1) && (e >> 1) != epoch) {
+			goto out;
+		}
+	}
+	// 更新はロック中のみ行う。
+	epoch++;
+	__atomic_store_n(&__slab_epoch, epoch, __ATOMIC_SEQ_CST);
+out:
+	__slab_epoch_collect(__slab_epoch_orphan, epoch);
+	pthread_mutex_unlock(&__slab_epoch_lock);
+	return epoch;
+}
+
+// 終了したスレッドの記録を破棄する。返却を待っているバッファは引き継ぐ。
+static void
+__slab_epoch_destructor(void *arg)
+{
+	struct slab_epoch_rec *rec = (struct slab_epoch_rec *)arg;
+	struct slab_epoch_bucket *b;
+	struct slab_epoch_bucket *o;
+	int i;
+
+	__slab_epoch_self = NULL;
+	pthread_mutex_lock(&__slab_epoch_lock);
+	list_del(&rec->r_list);
+	for (i = 0; i < SLAB_EPOCH_CNT; i++) {
+		b = &rec->r_buckets[i];
+		o = &__slab_epoch_orphan[i];
+		if (!b->b_cnt || __slab_epoch_reserve(o, o->b_cnt + b->b_cnt)) {
+			continue;
+		}
+		// 同じ位置のまとめは新しい方のエポックで返却する。
+		if (!o->b_cnt || o->b_epoch < b->b_epoch) {
+			o->b_epoch = b->b_epoch;
+		}
+		memcpy(&o->b_slabs[o->b_cnt], b->b_slabs,
+		       sizeof(b->b_slabs[0]) * b->b_cnt);
+		memcpy(&o->b_bufs[o->b_cnt], b->b_bufs,
+		       sizeof(b->b_bufs[0]) * b->b_cnt);
+		o->b_cnt += b->b_cnt;
+		b->b_cnt = 0;
+	}
+	pthread_mutex_unlock(&__slab_epoch_lock);
+
+	// 引き継げなかったバッファは猶予期間を待って返却する。
+	while (__slab_epoch_collect(rec->r_buckets, __slab_epoch_advance())) {
+		sched_yield();
+	}
+	for (i = 0; i < SLAB_EPOCH_CNT; i++) {
+		free(rec->r_buckets[i].b_slabs);
+		free(rec->r_buckets[i].b_bufs);
+	}
+	free(rec);
+}
+
+static void
+__slab_epoch_key_init(void)
+{
+	pthread_key_create(&__slab_epoch_key, __slab_epoch_destructor);
+}
+
+// 呼び出したスレッドの記録を取得する。存在しない場合は作成する。
+static struct slab_epoch_rec *
+__slab_epoch_get(void)
+{
+	struct slab_epoch_rec *rec = __slab_epoch_self;
+
+	if (rec) {
+		return rec;
+	}
+	rec = (struct slab_epoch_rec *)calloc(1, sizeof(*rec));
+	if (!rec) {
+		return NULL;
+	}
+	pthread_once(&__slab_epoch_once, __slab_epoch_key_init);
+	pthread_setspecific(__slab_epoch_key, rec);
+	pthread_mutex_lock(&__slab_epoch_lock);
+	list_add_tail(&rec->r_list, &__slab_epoch_list);
+	pthread_mutex_unlock(&__slab_epoch_lock);
+	__slab_epoch_self = rec;
+	return rec;
+}
+
+int
+slab_epoch_enter(void)
+{
+	struct slab_epoch_rec *rec = __slab_epoch_get();
+	uint64_t epoch;
+
+	if (!rec) {
+		return -ENOMEM;
+	}
+	if (rec->r_nest++) {
+		return 0;
+	}
+	// 区間に入ったことを、以降の読み出しより先に公開する。
+	epoch = __atomic_load_n(&__slab_epoch, __ATOMIC_RELAXED);
+	__atomic_store_n(&rec->r_epoch, (epoch << 1) | 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return 0;
+}
+
+void
+slab_epoch_exit(void)
+{
+	struct slab_epoch_rec *rec = __slab_epoch_self;
+
+	// 区間に入っていない(slab_epoch_enterが失敗した場合を含む)。
+	if (!rec || !rec->r_nest) {
+		return;
+	}
+	if (!--rec->r_nest) {
+		__atomic_store_n(&rec->r_epoch, 0, __ATOMIC_RELEASE);
+	}
+}
+
+int
+slab_cache_free_deferred(struct slab_cache *slab, void *buf)
+{
+	struct slab_epoch_bucket *b;
+	struct slab_epoch_rec *rec;
+	struct slab_node *node;
+	uint64_t epoch;
+	int rc;
+
+	node = __slab_check(slab, buf);
+	if (!node) {
+		// 不正アクセス。
+		return -EFAULT;
+	}
+	rec = __slab_epoch_get();
+	if (!rec) {
+		return -ENOMEM;
+	}
+
+	// 取り外しの後に最新のエポックを読み出す。
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	epoch = __atomic_load_n(&__slab_epoch, __ATOMIC_SEQ_CST);
+	b = &rec->r_buckets[epoch % SLAB_EPOCH_CNT];
+	if (b->b_cnt && b->b_epoch != epoch) {
+		// 同じ位置のまとめはepoch - SLAB_EPOCH_CNT以前のため返却できる。
+		__slab_epoch_free(b);
+	}
+	b->b_epoch = epoch;
+	rc = __slab_epoch_push(b, node->sn_slab, buf);
+	if (rc) {
+		return rc;
+	}
+	if (++rec->r_retired >= SLAB_EPOCH_BATCH) {
+		rec->r_retired = 0;
+		__slab_epoch_collect(rec->r_buckets, __slab_epoch_advance());
+	}
+	return 0;
+}
+
+int
+slab_free_deferred(void *buf)
+{
+	return slab_cache_free_deferred(NULL, buf);
+}
+
+int
+slab_deferred_reclaim(void)
+{
+	struct slab_epoch_rec *rec = __slab_epoch_self;
+	uint64_t epoch;
+
+	epoch = __slab_epoch_advance();
+	if (!rec) {
+		return 0;
+	}
+	rec->r_retired = 0;
+	return (int)__slab_epoch_collect(rec->r_buckets, epoch);
+}
+
+int
+slab_deferred_barrier(void)
+{
+	struct slab_epoch_rec *rec = __slab_epoch_self;
+	uint32_t orphan;
+	int i;
+
+	if (rec && rec->r_nest) {
+		return -EBUSY;
+	}
+	for (;;) {
+		orphan = 0;
+		if (!slab_deferred_reclaim()) {
+			pthread_mutex_lock(&__slab_epoch_lock);
+			for (i = 0; i < SLAB_EPOCH_CNT; i++) {
+				orphan += __slab_epoch_orphan[i].b_cnt;
+			}
+			pthread_mutex_unlock(&__slab_epoch_lock);
+			if (!orphan) {
+				return 0;
+			}
+		}
+		sched_yield();
+	}
 }
@@ -0,0 +1,224 @@
+﻿/* --
+ *
+ * MIT License
+ * 
+ * Copyright (c) 2017 Abe Takafumi
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <libsharaku/pool/slab_dump.h>
+
+// 出力中の状態
+struct slab_dump_ctx {
+	FILE			*d_fp;
+	uint32_t		d_cnt;
+};
+
+static int
+__slab_dump_line(struct slab_cache *slab, void *arg)
+{
+	struct slab_dump_ctx *ctx = (struct slab_dump_ctx *)arg;
+	struct slab_stats st;
+
+	slab_stats(slab, &st);
+	fprintf(ctx->d_fp,
+		"%-24s %8zu %10" PRIu64 " %10" PRIu64 " %10" PRIu64
+		" %8" PRIu64 " %12" PRIu64 "\n",
+		st.st_name ? st.st_name : "-", st.st_size, st.st_node_objs,
+		st.st_buf_cnt - st.st_mag_cnt,
+		st.st_node_cnt * st.st_node_objs,
+		st.st_node_cnt, st.st_node_bytes);
+	ctx->d_cnt++;
+	return 0;
+}
+
+int
+slab_dump(FILE *fp)
+{
+	struct slab_dump_ctx ctx = { fp, 0 };
+
+	if (!fp) {
+		return -EINVAL;
+	}
+	fprintf(fp, "%-24s %8s %10s %10s %10s %8s %12s\n",
+		"# name", "objsize", "objpernode", "active", "total",
+		"nodes", "bytes");
+	slab_foreach(__slab_dump_line, &ctx);
+	return (int)ctx.d_cnt;
+}
+
+// JSONの文字列を出力する。
+static void
+__slab_dump_str(FILE *fp, const char *str)
+{
+	const unsigned char *p;
+
+	if (!str) {
+		fputs("null", fp);
+		return;
+	}
+	fputc('"', fp);
+	for (p = (const unsigned char *)str; *p; p++) {
+		if (*p == '"' || *p == '\\') {
+			fprintf(fp, "\\%c", *p);
+		} else if (*p < 0x20) {
+			fprintf(fp, "\\u%04x", *p);
+		} else {
+			fputc(*p, fp);
+		}
+	}
+	fputc('"', fp);
+}
+
+static int
+__slab_dump_json(struct slab_cache *slab, void *arg)
+{
+	struct slab_dump_ctx *ctx = (struct slab_dump_ctx *)arg;
+	FILE *fp = ctx->d_fp;
+	struct slab_stats st;
+	int i;
+
+	slab_stats(slab, &st);
+	fputs(ctx->d_cnt ? ",\n  {" : "\n  {", fp);
+	fputs("\"name\": ", fp);
+	__slab_dump_str(fp, st.st_name);
+	fprintf(fp, ", \"objsize\": %zu", st.st_size);
+	fprintf(fp, ", \"node_size\": %zu", st.st_node_size);
+	fprintf(fp, ", \"objpernode\": %" PRIu64, st.st_node_objs);
+	fprintf(fp, ", \"active\": %" PRIu64,
+		st.st_buf_cnt - st.st_mag_cnt);
+	fprintf(fp, ", \"total\": %" PRIu64,
+		st.st_node_cnt * st.st_node_objs);
+	fprintf(fp, ", \"nodes\": %" PRIu64, st.st_node_cnt);
+	fprintf(fp, ", \"bytes\": %" PRIu64, st.st_node_bytes);
+	fprintf(fp, ", \"live_bytes\": %" PRIu64, st.st_live_bytes);
+	fprintf(fp, ", \"alloc\": %" PRIu64, st.st_alloc);
+	fprintf(fp, ", \"free\": %" PRIu64, st.st_free);
+	fprintf(fp, ", \"node_alloc\": %" PRIu64, st.st_node_alloc);
+	fprintf(fp, ", \"node_free\": %" PRIu64, st.st_node_free);
+	fprintf(fp, ", \"buf_peak\": %" PRIu64, st.st_buf_peak);
+	fprintf(fp, ", \"magazine\": %" PRIu64, st.st_mag_cnt);
+	fprintf(fp, ", \"limit_fail\": %" PRIu64, st.st_limit_fail);
+	fprintf(fp, ", \"alloc_fail\": %" PRIu64, st.st_alloc_fail);
+	fputs(", \"bins\": [", fp);
+	for (i = 0; i <= SLAB_PRIO; i++) {
+		fprintf(fp, i ? ", %u" : "%u", st.st_bins[i]);
+	}
+	fputs("]}", fp);
+	ctx->d_cnt++;
+	return 0;
+}
+
+int
+slab_dump_json(FILE *fp)
+{
+	struct slab_dump_ctx ctx = { fp, 0 };
+
+	if (!fp) {
+		return -EINVAL;
+	}
+	fputc('[', fp);
+	slab_foreach(__slab_dump_json, &ctx);
+	fputs(ctx.d_cnt ? "\n]\n" : "]\n", fp);
+	return (int)ctx.d_cnt;
+}
+
+// 獲得箇所の表の初期の要素数
+#define SLAB_DUMP_SITES	64
+
+static int
+__slab_dump_profile(struct slab_cache *slab, void *arg)
+{
+	struct slab_dump_ctx *ctx = (struct slab_dump_ctx *)arg;
+	struct slab_site *sites = NULL;
+	struct slab_site *tmp;
+	int n = SLAB_DUMP_SITES;
+	int rc;
+	int i;
+
+	if (slab->s_flags & SLAB_F_LEAN) {
+		return 0;
+	}
+	// 表が不足する場合は拡張してやり直す。
+	do {
+		tmp = (struct slab_site *)realloc(sites, sizeof(*sites) * n);
+		if (!tmp) {
+			free(sites);
+			return -ENOMEM;
+		}
+		sites = tmp;
+		rc = slab_profile(slab, sites, n);
+		n *= 2;
+	} while (rc == -ENOSPC);
+
+	for (i = 0; i < rc; i++) {
+		fprintf(ctx->d_fp, "%10" PRIu64 " %12" PRIu64 " %-24s %s:%u\n",
+			sites[i].ss_cnt, sites[i].ss_bytes,
+			slab->s_name ? slab->s_name : "-",
+			sites[i].ss_src, sites[i].ss_line);
+		ctx->d_cnt++;
+	}
+	free(sites);
+	return rc < 0 ? rc : 0;
+}
+
+int
+slab_dump_leaks(struct slab_cache *slab, FILE *fp)
+{
+	struct slab_dump_ctx ctx = { fp, 0 };
+	struct slab_stats st;
+	int rc;
+
+	if (!slab || !fp) {
+		return -EINVAL;
+	}
+	slab_stats(slab, &st);
+	if (st.st_buf_cnt == st.st_mag_cnt) {
+		return 0;
+	}
+	fprintf(fp, "%s: %" PRIu64 " objects (%" PRIu64 " bytes) outstanding\n",
+		st.st_name ? st.st_name : "-",
+		st.st_buf_cnt - st.st_mag_cnt, st.st_live_bytes);
+	rc = __slab_dump_profile(slab, &ctx);
+	if (rc < 0) {
+		return rc;
+	}
+	return (int)(st.st_buf_cnt - st.st_mag_cnt);
+}
+
+int
+slab_profile_dump(FILE *fp)
+{
+	struct slab_dump_ctx ctx = { fp, 0 };
+	int rc;
+
+	if (!fp) {
+		return -EINVAL;
+	}
+	fprintf(fp, "%-10s %12s %-24s %s\n",
+		"# objs", "bytes", "name", "site");
+	rc = slab_foreach(__slab_dump_profile, &ctx);
+	return rc ? rc : (int)ctx.d_cnt;
+}
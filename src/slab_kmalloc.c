@@ -0,0 +1,193 @@
+﻿/* --
+ *
+ * MIT License
+ * 
+ * Copyright (c) 2017 Abe Takafumi
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <libsharaku/pool/slab_kmalloc.h>
+
+#define _SLAB_KMALLOC_SHIFT	4
+#define _SLAB_KMALLOC_PAGE_SZ	4096
+
+// サイズクラス
+static const size_t __slab_kmalloc_sizes[] = {
+	16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768,
+	1024, 1536, 2048, 3072, 4096, 6144, 8192,
+};
+#define _SLAB_KMALLOC_CLASSES	\
+	(sizeof(__slab_kmalloc_sizes) / sizeof(__slab_kmalloc_sizes[0]))
+
+// mmapで直接獲得した領域のヘッダ
+// l_nodeのsn_slabがNULLであることでslab_cacheの領域と区別する。
+struct slab_klarge {
+	struct slab_node	l_node;
+	size_t			l_size;		// 要求サイズ
+	size_t			l_len;		// mmapした長さ
+};
+#define _SLAB_KLARGE_HDR_SZ	\
+	((sizeof(struct slab_klarge) + 15) & ~(size_t)15)
+
+static pthread_once_t __slab_kmalloc_once = PTHREAD_ONCE_INIT;
+static struct slab_cache __slab_kcaches[_SLAB_KMALLOC_CLASSES];
+static char __slab_kmalloc_names[_SLAB_KMALLOC_CLASSES][16];
+
+// (size + 15) / 16からサイズクラスへの変換テーブル
+static uint8_t __slab_kmalloc_index[(SLAB_KMALLOC_MAX >> _SLAB_KMALLOC_SHIFT) + 1];
+
+static void
+__slab_kmalloc_init(void)
+{
+	struct slab_cache *slab;
+	uint32_t idx = 0;
+	uint32_t i;
+
+	for (i = 0; i <= (SLAB_KMALLOC_MAX >> _SLAB_KMALLOC_SHIFT); i++) {
+		while (__slab_kmalloc_sizes[idx] < (i << _SLAB_KMALLOC_SHIFT)) {
+			idx++;
+		}
+		__slab_kmalloc_index[i] = (uint8_t)idx;
+	}
+	for (i = 0; i < _SLAB_KMALLOC_CLASSES; i++) {
+		slab = &__slab_kcaches[i];
+		INIT_SLAB_SZ(slab, __slab_kmalloc_sizes[i],
+			     SLAB_KMALLOC_NODE_SZ);
+		slab_set_flags(slab, SLAB_F_LEAN);
+		slab_set_magazine(slab, SLAB_MAGAZINE_SZ);
+		snprintf(__slab_kmalloc_names[i],
+			 sizeof(__slab_kmalloc_names[i]), "kmalloc-%zu",
+			 __slab_kmalloc_sizes[i]);
+		slab_set_name(slab, __slab_kmalloc_names[i]);
+		slab_register(slab);
+	}
+}
+
+// 所属するnode(もしくは直接獲得した領域のヘッダ)を求める。
+static inline struct slab_node*
+__slab_kmalloc_node(void *buf)
+{
+	return (struct slab_node *)((uintptr_t)buf
+				    & ~((uintptr_t)SLAB_KMALLOC_NODE_SZ - 1));
+}
+
+// SLAB_KMALLOC_MAXを超えるサイズをmmapで獲得する。
+// ヘッダをnodeと同じ位置に置くため、SLAB_KMALLOC_NODE_SZ境界に配置する。
+static void*
+__slab_kmalloc_large(size_t size)
+{
+	struct slab_klarge *large;
+	uintptr_t base;
+	size_t head;
+	size_t len;
+	char *mem;
+
+	if (size > SIZE_MAX - _SLAB_KLARGE_HDR_SZ - SLAB_KMALLOC_NODE_SZ) {
+		return NULL;
+	}
+	len = (_SLAB_KLARGE_HDR_SZ + size + _SLAB_KMALLOC_PAGE_SZ - 1)
+					 & ~(size_t)(_SLAB_KMALLOC_PAGE_SZ - 1);
+	mem = (char *)mmap(NULL, len + SLAB_KMALLOC_NODE_SZ,
+			   PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == (char *)MAP_FAILED) {
+		return NULL;
+	}
+
+	// 境界に合わない前後の領域を返却する。
+	base = ((uintptr_t)mem + SLAB_KMALLOC_NODE_SZ - 1)
+				 & ~((uintptr_t)SLAB_KMALLOC_NODE_SZ - 1);
+	head = base - (uintptr_t)mem;
+	if (head) {
+		munmap(mem, head);
+	}
+	if (SLAB_KMALLOC_NODE_SZ - head) {
+		munmap((char *)base + len, SLAB_KMALLOC_NODE_SZ - head);
+	}
+
+	large = (struct slab_klarge *)base;
+	large->l_node.sn_slab = NULL;
+	large->l_size = size;
+	large->l_len = len;
+	return (char *)large + _SLAB_KLARGE_HDR_SZ;
+}
+
+void *
+slab_kmalloc(size_t size)
+{
+	void *buf;
+
+	if (size > SLAB_KMALLOC_MAX) {
+		return __slab_kmalloc_large(size);
+	}
+	pthread_once(&__slab_kmalloc_once, __slab_kmalloc_init);
+	buf = slab_alloc(&__slab_kcaches[__slab_kmalloc_index[
+			(size + (1 << _SLAB_KMALLOC_SHIFT) - 1)
+						 >> _SLAB_KMALLOC_SHIFT]]);
+	if ((uintptr_t)buf >= (uintptr_t)-4095) {
+		// エラー値はNULLで返す。
+		return NULL;
+	}
+	return buf;
+}
+
+int
+slab_kfree(void *buf)
+{
+	struct slab_klarge *large;
+	struct slab_node *node;
+
+	if (!buf) {
+		return 0;
+	}
+	node = __slab_kmalloc_node(buf);
+	if (node->sn_slab) {
+		return slab_cache_free(node->sn_slab, buf);
+	}
+	large = (struct slab_klarge *)node;
+	if ((char *)buf != (char *)large + _SLAB_KLARGE_HDR_SZ) {
+		// 不正アクセス。
+		return -EFAULT;
+	}
+	munmap(large, large->l_len);
+	return 0;
+}
+
+size_t
+slab_ksize(void *buf)
+{
+	struct slab_node *node;
+
+	if (!buf) {
+		return 0;
+	}
+	node = __slab_kmalloc_node(buf);
+	if (node->sn_slab) {
+		return node->sn_slab->s_size;
+	}
+	return ((struct slab_klarge *)node)->l_size;
+}
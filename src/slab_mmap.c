@@ -0,0 +1,250 @@
+﻿/* --
+ *
+ * MIT License
+ * 
+ * Copyright (c) 2017 Abe Takafumi
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <libsharaku/pool/slab_mmap.h>
+
+#define _SLAB_MMAP_PAGE_SHIFT	12
+#define _SLAB_MMAP_HUGE_SZ	(2UL << 20)
+#define _SLAB_MMAP_ORDER_MAX	48
+
+// 同一サイズの開放済み領域のスタック
+struct slab_mmap_stack {
+	void			**st_buf;
+	uint32_t		st_cnt;
+	uint32_t		st_size;
+};
+
+// 予約した仮想領域
+// 領域はa_bumpから順に切り出し、開放された領域はサイズごとのスタックで
+// 再利用する。開放時にサイズを求めるため、切り出した領域の先頭ページに
+// サイズ(log2)を記録しておく。
+struct slab_mmap_arena {
+	char			*a_base;
+	char			*a_bump;
+	char			*a_end;
+	uint8_t			*a_order;	// ページごとの領域サイズ(log2)
+	size_t			a_order_sz;
+	uint32_t		a_flags;
+	struct slab_mmap_stack	a_free[_SLAB_MMAP_ORDER_MAX];
+};
+
+static pthread_mutex_t __slab_mmap_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct slab_mmap_arena __slab_mmap;
+
+// sizeを格納できる2のべき乗の指数を求める。
+static inline uint32_t
+__slab_mmap_order(size_t size)
+{
+	uint32_t order = _SLAB_MMAP_PAGE_SHIFT;
+
+	while (((size_t)1 << order) < size) {
+		order++;
+	}
+	return order;
+}
+
+// 仮想領域を予約する。
+// 呼び出し元でロックしていること。
+static int
+__slab_mmap_reserve(size_t reserve, uint32_t flags)
+{
+	struct slab_mmap_arena *a = &__slab_mmap;
+	void *mem = MAP_FAILED;
+	uintptr_t base;
+	size_t head;
+	size_t len;
+
+	// ヒュージページ境界に合わせるため、境界1つ分を余分に予約する。
+	reserve = (reserve + _SLAB_MMAP_HUGE_SZ - 1) & ~(_SLAB_MMAP_HUGE_SZ - 1);
+	len = reserve + _SLAB_MMAP_HUGE_SZ;
+#ifdef MAP_HUGETLB
+	if (flags & SLAB_MMAP_HUGETLB) {
+		// MAP_NORESERVEを指定するとヒュージページが不足していても
+		// 予約に成功し、最初のアクセスでSIGBUSとなるため指定しない。
+		mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	}
+#endif
+	if (mem == MAP_FAILED) {
+		// ヒュージページが使用できない場合は通常のページで予約する。
+		flags &= ~SLAB_MMAP_HUGETLB;
+		mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	}
+	if (mem == MAP_FAILED) {
+		return -ENOMEM;
+	}
+
+	// 境界に合わない前後の領域を返却する。
+	base = ((uintptr_t)mem + _SLAB_MMAP_HUGE_SZ - 1)
+					 & ~(_SLAB_MMAP_HUGE_SZ - 1);
+	head = base - (uintptr_t)mem;
+	if (head) {
+		munmap(mem, head);
+	}
+	if (_SLAB_MMAP_HUGE_SZ - head) {
+		munmap((char *)base + reserve, _SLAB_MMAP_HUGE_SZ - head);
+	}
+#ifdef MADV_HUGEPAGE
+	if (flags & SLAB_MMAP_THP) {
+		madvise((void *)base, reserve, MADV_HUGEPAGE);
+	}
+#endif
+
+	a->a_order_sz = reserve >> _SLAB_MMAP_PAGE_SHIFT;
+	a->a_order = (uint8_t *)mmap(NULL, a->a_order_sz,
+				     PROT_READ | PROT_WRITE,
+				     MAP_PRIVATE | MAP_ANONYMOUS
+				     | MAP_NORESERVE, -1, 0);
+	if (a->a_order == MAP_FAILED) {
+		a->a_order = NULL;
+		munmap((void *)base, reserve);
+		return -ENOMEM;
+	}
+	a->a_base = (char *)base;
+	a->a_bump = a->a_base;
+	a->a_end = a->a_base + reserve;
+	a->a_flags = flags;
+	return 0;
+}
+
+int
+slab_mmap_init(size_t reserve, uint32_t flags)
+{
+	int rc;
+
+	pthread_mutex_lock(&__slab_mmap_lock);
+	if (__slab_mmap.a_base) {
+		rc = -EBUSY;
+	} else {
+		rc = __slab_mmap_reserve(reserve, flags);
+	}
+	pthread_mutex_unlock(&__slab_mmap_lock);
+	return rc;
+}
+
+void *
+slab_mmap_alloc(size_t align, size_t size)
+{
+	struct slab_mmap_arena *a = &__slab_mmap;
+	struct slab_mmap_stack *st;
+	uint32_t order;
+	size_t chunk;
+	char *mem = NULL;
+	char *p;
+
+	// 領域は自身のサイズ境界に配置する。
+	order = __slab_mmap_order(size > align ? size : align);
+	if (order >= _SLAB_MMAP_ORDER_MAX) {
+		return NULL;
+	}
+	chunk = (size_t)1 << order;
+
+	pthread_mutex_lock(&__slab_mmap_lock);
+	if (!a->a_base) {
+		__slab_mmap_reserve(SLAB_MMAP_RESERVE_DEF, 0);
+	}
+	st = &a->a_free[order];
+	if (st->st_cnt) {
+		mem = (char *)st->st_buf[--st->st_cnt];
+	} else if (a->a_base) {
+		p = (char *)(((uintptr_t)a->a_bump + chunk - 1)
+						 & ~((uintptr_t)chunk - 1));
+		if (p < a->a_end && chunk <= (size_t)(a->a_end - p)) {
+			a->a_order[(p - a->a_base) >> _SLAB_MMAP_PAGE_SHIFT]
+								 = order;
+			a->a_bump = p + chunk;
+			mem = p;
+		}
+	}
+	pthread_mutex_unlock(&__slab_mmap_lock);
+
+	if (!mem) {
+		// 予約した領域を使い切った。
+		mem = (char *)aligned_alloc(chunk, chunk);
+	}
+	return mem;
+}
+
+void
+slab_mmap_free(void *buf)
+{
+	struct slab_mmap_arena *a = &__slab_mmap;
+	struct slab_mmap_stack *st;
+	uint32_t order;
+	size_t chunk;
+	void **stack;
+	uint32_t size;
+	int advice;
+
+	if (!buf) {
+		return;
+	}
+	pthread_mutex_lock(&__slab_mmap_lock);
+	if ((char *)buf < a->a_base || (char *)buf >= a->a_end) {
+		pthread_mutex_unlock(&__slab_mmap_lock);
+		// フォールバックで獲得した領域。
+		free(buf);
+		return;
+	}
+	order = a->a_order[((char *)buf - a->a_base) >> _SLAB_MMAP_PAGE_SHIFT];
+	pthread_mutex_unlock(&__slab_mmap_lock);
+
+	// 物理メモリのみを返却し、仮想領域は再利用する。
+	// MAP_HUGETLBの領域はヒュージページ単位でのみ返却できる。
+	chunk = (size_t)1 << order;
+	if (!(a->a_flags & SLAB_MMAP_HUGETLB) ||
+	    !(chunk & (_SLAB_MMAP_HUGE_SZ - 1))) {
+		advice = MADV_DONTNEED;
+#ifdef MADV_FREE
+		if (a->a_flags & SLAB_MMAP_MADV_FREE) {
+			advice = MADV_FREE;
+		}
+#endif
+		madvise(buf, chunk, advice);
+	}
+
+	pthread_mutex_lock(&__slab_mmap_lock);
+	st = &a->a_free[order];
+	if (st->st_cnt == st->st_size) {
+		size = st->st_size ? st->st_size * 2 : 16;
+		stack = (void **)realloc(st->st_buf, sizeof(*stack) * size);
+		if (stack) {
+			st->st_buf = stack;
+			st->st_size = size;
+		}
+	}
+	// スタックを拡張できない場合、仮想領域は再利用されない。
+	if (st->st_cnt < st->st_size) {
+		st->st_buf[st->st_cnt++] = buf;
+	}
+	pthread_mutex_unlock(&__slab_mmap_lock);
+}
@@ -0,0 +1,431 @@
+﻿/* --
+ *
+ * MIT License
+ * 
+ * Copyright (c) 2017 Abe Takafumi
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <libsharaku/pool/slab.h>
+#include <libsharaku/pool/slab_kmalloc.h>
+#include <libsharaku/pool/obj_pool.hpp>
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <random>
+#include <thread>
+#include <vector>
+
+// slab、obj_poolとglibcのmalloc/freeを同じパターンで比較する。
+// 各パターンはバックエンド(獲得、開放の方法)をテンプレート引数で受け取る。
+// 結果にはns/op、スループット(items_per_second)と、計測後のRSSを出力する。
+#define BENCH_OBJ_SZ		64
+#define BENCH_BATCH		1024
+
+struct bench_obj {
+	char	b[BENCH_OBJ_SZ];
+};
+
+// 現在のRSSをKB単位で返す。
+static double
+bench_rss_kb(void)
+{
+	long pages = 0;
+	FILE *fp;
+
+	fp = fopen("/proc/self/statm", "r");
+	if (!fp) {
+		return 0;
+	}
+	if (fscanf(fp, "%*s %ld", &pages) != 1) {
+		pages = 0;
+	}
+	fclose(fp);
+	return (double)pages * (double)sysconf(_SC_PAGESIZE) / 1024;
+}
+
+static void
+bench_report(benchmark::State& state, int64_t items)
+{
+	state.SetItemsProcessed(items);
+	state.counters["rss_kb"] = bench_rss_kb();
+}
+
+// ---------------------------------------------------------------
+// バックエンド
+struct bench_malloc {
+	static void *alloc(void) {
+		return malloc(BENCH_OBJ_SZ);
+	}
+	static void free(void *buf) {
+		::free(buf);
+	}
+};
+
+// 空きnodeを1つ保持する。(保持しない場合はbench_slab_nokeep)
+struct bench_slab {
+	static struct slab_cache *cache(void) {
+		static struct slab_cache slab = SLAB_INIT_DEF(slab, BENCH_OBJ_SZ);
+		static int init = (slab_set_keep_empty(&slab, 1), 0);
+		(void)init;
+		return &slab;
+	}
+	static void *alloc(void) {
+		return slab_alloc(cache());
+	}
+	static void free(void *buf) {
+		slab_free(buf);
+	}
+};
+
+// 空きnodeを保持しない。nodeが空になるたびに開放する。
+struct bench_slab_nokeep {
+	static struct slab_cache *cache(void) {
+		static struct slab_cache slab = SLAB_INIT_DEF(slab, BENCH_OBJ_SZ);
+		return &slab;
+	}
+	static void *alloc(void) {
+		return slab_alloc(cache());
+	}
+	static void free(void *buf) {
+		slab_free(buf);
+	}
+};
+
+// leanとマガジンを使用する。
+struct bench_slab_lean {
+	static struct slab_cache *cache(void) {
+		static struct slab_cache slab = SLAB_INIT_DEF(slab, BENCH_OBJ_SZ);
+		static int init = (slab_set_flags(&slab, SLAB_F_LEAN),
+				   slab_set_keep_empty(&slab, 1),
+				   slab_set_magazine(&slab, SLAB_MAGAZINE_SZ));
+		(void)init;
+		return &slab;
+	}
+	static void *alloc(void) {
+		return slab_alloc(cache());
+	}
+	static void free(void *buf) {
+		slab_cache_free(cache(), buf);
+	}
+};
+
+struct bench_kmalloc {
+	static void *alloc(void) {
+		return slab_kmalloc(BENCH_OBJ_SZ);
+	}
+	static void free(void *buf) {
+		slab_kfree(buf);
+	}
+};
+
+struct bench_pool {
+	static obj_pool<bench_obj> *pool(void) {
+		static obj_pool<bench_obj> p;
+		static int init = (p.set_growth(BENCH_BATCH), 0);
+		(void)init;
+		return &p;
+	}
+	static void *alloc(void) {
+		return pool()->alloc();
+	}
+	static void free(void *buf) {
+		pool()->free((bench_obj *)buf);
+	}
+};
+
+struct bench_pool_mt {
+	static obj_pool<bench_obj, true> *pool(void) {
+		static obj_pool<bench_obj, true> p;
+		static int init = (p.set_growth(BENCH_BATCH), 0);
+		(void)init;
+		return &p;
+	}
+	static void *alloc(void) {
+		return pool()->alloc();
+	}
+	static void free(void *buf) {
+		pool()->free((bench_obj *)buf);
+	}
+};
+
+#define BENCH_BACKENDS(func)						\
+	BENCHMARK_TEMPLATE(func, bench_malloc);				\
+	BENCHMARK_TEMPLATE(func, bench_slab);				\
+	BENCHMARK_TEMPLATE(func, bench_slab_lean);			\
+	BENCHMARK_TEMPLATE(func, bench_kmalloc);			\
+	BENCHMARK_TEMPLATE(func, bench_pool);				\
+	BENCHMARK_TEMPLATE(func, bench_pool_mt)
+
+// ---------------------------------------------------------------
+// パターン
+
+// 1個を獲得してすぐに開放する。
+template<class A>
+static void
+BM_pingpong(benchmark::State& state)
+{
+	void *buf;
+
+	for (auto _ : state) {
+		buf = A::alloc();
+		benchmark::DoNotOptimize(buf);
+		A::free(buf);
+	}
+	bench_report(state, state.iterations());
+}
+BENCH_BACKENDS(BM_pingpong);
+
+// slabの1node分を獲得したまま、1個の獲得と開放を繰り返す。
+// slabでは獲得のたびに新しいnodeが必要となり、nodeの境界をまたぐ。
+// 空きnodeを保持しない場合は毎回nodeの獲得と初期化が発生する。
+// 他のバックエンドも同じ個数を獲得したままで計測する。
+//
+// 1node分は、新しいnodeが必要となるまでに獲得できる個数とする。
+// 空きの少ないnode(ビン0)からは獲得しないため、nodeの要素数より少ない。
+static size_t
+bench_node_objs(void)
+{
+	struct slab_cache slab;
+	std::vector<void*> bufs;
+
+	INIT_SLAB_DEF(&slab, BENCH_OBJ_SZ);
+	do {
+		bufs.push_back(slab_alloc(&slab));
+	} while (slab.s_node_cnt == 1);
+	slab_free_bulk(bufs.data(), (int)bufs.size());
+	slab_shrink(&slab);
+	return bufs.size() - 1;
+}
+
+template<class A>
+static void
+BM_oscillate(benchmark::State& state)
+{
+	std::vector<void*> bufs(bench_node_objs());
+	void *buf;
+
+	for (auto &b : bufs) {
+		b = A::alloc();
+	}
+	for (auto _ : state) {
+		buf = A::alloc();
+		benchmark::DoNotOptimize(buf);
+		A::free(buf);
+	}
+	for (auto b : bufs) {
+		A::free(b);
+	}
+	bench_report(state, state.iterations());
+}
+BENCH_BACKENDS(BM_oscillate);
+BENCHMARK_TEMPLATE(BM_oscillate, bench_slab_nokeep);
+
+// BENCH_BATCH個を獲得し、獲得と逆順(LIFO)に開放する。
+template<class A>
+static void
+BM_batch_lifo(benchmark::State& state)
+{
+	std::vector<void*> bufs(BENCH_BATCH);
+
+	for (auto _ : state) {
+		for (auto &b : bufs) {
+			b = A::alloc();
+		}
+		benchmark::DoNotOptimize(bufs.data());
+		for (size_t i = bufs.size(); i; i--) {
+			A::free(bufs[i - 1]);
+		}
+	}
+	bench_report(state, state.iterations() * BENCH_BATCH);
+}
+BENCH_BACKENDS(BM_batch_lifo);
+
+// BENCH_BATCH個を獲得し、獲得と同じ順(FIFO)に開放する。
+template<class A>
+static void
+BM_batch_fifo(benchmark::State& state)
+{
+	std::vector<void*> bufs(BENCH_BATCH);
+
+	for (auto _ : state) {
+		for (auto &b : bufs) {
+			b = A::alloc();
+		}
+		benchmark::DoNotOptimize(bufs.data());
+		for (auto b : bufs) {
+			A::free(b);
+		}
+	}
+	bench_report(state, state.iterations() * BENCH_BATCH);
+}
+BENCH_BACKENDS(BM_batch_fifo);
+
+// BENCH_BATCH個を獲得し、ランダムな順に開放する。
+template<class A>
+static void
+BM_batch_random(benchmark::State& state)
+{
+	std::vector<void*> bufs(BENCH_BATCH);
+	std::vector<uint32_t> order(BENCH_BATCH);
+	std::mt19937 rng(1);
+
+	for (uint32_t i = 0; i < BENCH_BATCH; i++) {
+		order[i] = i;
+	}
+	std::shuffle(order.begin(), order.end(), rng);
+	for (auto _ : state) {
+		for (auto &b : bufs) {
+			b = A::alloc();
+		}
+		benchmark::DoNotOptimize(bufs.data());
+		for (auto i : order) {
+			A::free(bufs[i]);
+		}
+	}
+	bench_report(state, state.iterations() * BENCH_BATCH);
+}
+BENCH_BACKENDS(BM_batch_random);
+
+// 獲得したスレッドとは別のスレッドで開放する。
+// 計測スレッドが獲得し、リングで渡したバッファを消費スレッドが開放する。
+#define BENCH_RING_SZ	4096
+
+struct bench_ring {
+	void		*r_buf[BENCH_RING_SZ];
+	uint64_t	r_head alignas(64);
+	uint64_t	r_tail alignas(64);
+};
+
+template<class A>
+static void
+BM_producer_consumer(benchmark::State& state)
+{
+	static bench_ring ring;
+	uint64_t head;
+	uint64_t tail;
+
+	ring.r_head = ring.r_tail = 0;
+	std::thread consumer([]() {
+		uint64_t tail = 0;
+		void *buf;
+
+		for (;;) {
+			while (__atomic_load_n(&ring.r_head, __ATOMIC_ACQUIRE)
+								 == tail) {
+			}
+			buf = ring.r_buf[tail % BENCH_RING_SZ];
+			__atomic_store_n(&ring.r_tail, ++tail,
+					 __ATOMIC_RELEASE);
+			if (!buf) {
+				break;
+			}
+			A::free(buf);
+		}
+	});
+
+	head = 0;
+	for (auto _ : state) {
+		do {
+			tail = __atomic_load_n(&ring.r_tail, __ATOMIC_ACQUIRE);
+		} while (head - tail == BENCH_RING_SZ);
+		ring.r_buf[head % BENCH_RING_SZ] = A::alloc();
+		__atomic_store_n(&ring.r_head, ++head, __ATOMIC_RELEASE);
+	}
+	// NULLで終了を通知する。
+	while (head - __atomic_load_n(&ring.r_tail, __ATOMIC_ACQUIRE)
+							 == BENCH_RING_SZ) {
+	}
+	ring.r_buf[head % BENCH_RING_SZ] = NULL;
+	__atomic_store_n(&ring.r_head, head + 1, __ATOMIC_RELEASE);
+	consumer.join();
+	bench_report(state, state.iterations());
+}
+BENCHMARK_TEMPLATE(BM_producer_consumer, bench_malloc)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_producer_consumer, bench_slab)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_producer_consumer, bench_slab_lean)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_producer_consumer, bench_kmalloc)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_producer_consumer, bench_pool_mt)->UseRealTime();
+
+// 16〜2048バイトのサイズが混在する獲得、開放。
+// 生存中のバッファをランダムに入れ替える。
+#define BENCH_MIX_LIVE	4096
+
+static std::vector<uint32_t>
+bench_mix_sizes(void)
+{
+	std::vector<uint32_t> sizes(BENCH_MIX_LIVE * 4);
+	std::mt19937 rng(2);
+	// 小さいサイズほど多くなるように、2のべき乗の指数を一様にとる。
+	std::uniform_int_distribution<uint32_t> order(4, 10);
+	std::uniform_int_distribution<uint32_t> frac(0, 15);
+
+	for (auto &s : sizes) {
+		uint32_t o = order(rng);
+		s = (1U << o) + ((1U << o) / 16) * frac(rng);
+	}
+	return sizes;
+}
+
+static void
+bench_mix(benchmark::State& state, void *(*alloc)(size_t),
+	  void (*free_)(void *))
+{
+	std::vector<uint32_t> sizes = bench_mix_sizes();
+	std::vector<void*> live(BENCH_MIX_LIVE);
+	size_t i = 0;
+
+	for (auto &b : live) {
+		b = alloc(sizes[i++ % sizes.size()]);
+	}
+	for (auto _ : state) {
+		void *&b = live[(i * 7919) % BENCH_MIX_LIVE];
+
+		free_(b);
+		b = alloc(sizes[i++ % sizes.size()]);
+	}
+	bench_report(state, state.iterations());
+	for (auto b : live) {
+		free_(b);
+	}
+}
+
+static void
+bench_kfree(void *buf)
+{
+	slab_kfree(buf);
+}
+
+static void
+BM_mixed_malloc(benchmark::State& state)
+{
+	bench_mix(state, malloc, free);
+}
+BENCHMARK(BM_mixed_malloc);
+
+static void
+BM_mixed_kmalloc(benchmark::State& state)
+{
+	bench_mix(state, slab_kmalloc, bench_kfree);
+}
+BENCHMARK(BM_mixed_kmalloc);
@@ -0,0 +1,229 @@
+﻿/* --
+ *
+ * MIT License
+ * 
+ * Copyright (c) 2017 Abe Takafumi
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#include <stdlib.h>
+#include <libsharaku/pool/slab.h>
+#include <libsharaku/pool/slab_mmap.h>
+#include <benchmark/benchmark.h>
+#include <vector>
+
+// スレッド数を変えてalloc/freeのスループットを計測する。
+// 1回の反復でSLAB_BENCH_BATCH個を獲得し、すべて開放する。
+#define SLAB_BENCH_BATCH	64
+
+static struct slab_cache bench_locked = SLAB_INIT_DEF(bench_locked, 64);
+static struct slab_cache bench_magazine = SLAB_INIT_DEF(bench_magazine, 64);
+static int bench_magazine_init =
+	slab_set_magazine(&bench_magazine, SLAB_MAGAZINE_SZ);
+
+static void
+slab_bench_batch(benchmark::State& state, struct slab_cache *slab)
+{
+	void *bufs[SLAB_BENCH_BATCH];
+	int i;
+
+	for (auto _ : state) {
+		for (i = 0; i < SLAB_BENCH_BATCH; i++) {
+			bufs[i] = slab_alloc(slab);
+		}
+		benchmark::DoNotOptimize(bufs);
+		for (i = 0; i < SLAB_BENCH_BATCH; i++) {
+			slab_free(bufs[i]);
+		}
+	}
+	state.SetItemsProcessed(state.iterations() * SLAB_BENCH_BATCH);
+}
+
+// マガジンなし。alloc/freeごとにslabのロックを取得する。
+static void
+BM_slab_locked(benchmark::State& state)
+{
+	slab_bench_batch(state, &bench_locked);
+}
+BENCHMARK(BM_slab_locked)->ThreadRange(1, 16)->UseRealTime();
+
+// マガジンあり。補充、返却時のみロックを取得する。
+static void
+BM_slab_magazine(benchmark::State& state)
+{
+	slab_bench_batch(state, &bench_magazine);
+}
+BENCHMARK(BM_slab_magazine)->ThreadRange(1, 16)->UseRealTime();
+
+// 1個ずつ獲得、開放する場合と一括で獲得、開放する場合を比較する。
+// node自体の獲得、開放を計測に含めないよう、1個を獲得したままにしておく。
+static void
+BM_slab_single(benchmark::State& state)
+{
+	static struct slab_cache slab = SLAB_INIT_DEF(slab, 64);
+	std::vector<void*> bufs(state.range(0));
+	void *pin = slab_alloc(&slab);
+
+	for (auto _ : state) {
+		for (auto &b : bufs) {
+			b = slab_alloc(&slab);
+		}
+		benchmark::DoNotOptimize(bufs.data());
+		for (auto b : bufs) {
+			slab_free(b);
+		}
+	}
+	slab_free(pin);
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_slab_single)->RangeMultiplier(2)->Range(32, 256);
+
+static void
+BM_slab_bulk(benchmark::State& state)
+{
+	static struct slab_cache slab = SLAB_INIT_DEF(slab, 64);
+	std::vector<void*> bufs(state.range(0));
+	void *pin = slab_alloc(&slab);
+
+	for (auto _ : state) {
+		slab_alloc_bulk(&slab, bufs.data(), (int)bufs.size());
+		benchmark::DoNotOptimize(bufs.data());
+		slab_free_bulk(bufs.data(), (int)bufs.size());
+	}
+	slab_free(pin);
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_slab_bulk)->RangeMultiplier(2)->Range(32, 256);
+
+// nodeの再登録コストを計測する。
+// 小さなnodeに分散した生存オブジェクトに対して獲得と開放を不規則に混在させ、
+// nodeの密度が頻繁に変わる状態で獲得nodeの選択と再登録にかかる時間を計測する。
+// 獲得、開放はslab_alloc/slab_freeのみを使用する。
+static std::vector<uint32_t>
+bench_events(void)
+{
+	std::vector<uint32_t> ev(65536);
+	uint32_t x = 2463534242U;
+
+	for (auto &e : ev) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		e = x;
+	}
+	return ev;
+}
+
+static void
+BM_slab_resched(benchmark::State& state)
+{
+	static struct slab_cache slab =
+		SLAB_INIT_SZ(slab, 64, SLAB_NODE_SZ_MIN);
+	std::vector<void*> live;
+	std::vector<uint32_t> ev = bench_events();
+	size_t max = state.range(0);
+	size_t i = 0;
+	size_t k;
+
+	// 上限の半分まで獲得しておき、以降は獲得と開放を半々に発生させる。
+	live.reserve(max);
+	while (live.size() < max / 2) {
+		live.push_back(slab_alloc(&slab));
+	}
+	for (auto _ : state) {
+		uint32_t e = ev[i++ & (ev.size() - 1)];
+
+		if ((e & 1) && live.size() < max) {
+			live.push_back(slab_alloc(&slab));
+		} else if (!live.empty()) {
+			k = (e >> 1) % live.size();
+			slab_free(live[k]);
+			live[k] = live.back();
+			live.pop_back();
+		}
+	}
+	for (auto b : live) {
+		slab_free(b);
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_slab_resched)->Arg(10000)->Arg(100000);
+
+// 多数のnodeにまたがる生存オブジェクトをランダムに入れ替える。
+static void
+slab_bench_churn(benchmark::State& state, struct slab_cache *slab)
+{
+	std::vector<void*> live(state.range(0));
+	std::vector<uint32_t> ev = bench_events();
+	size_t i = 0;
+
+	for (auto &b : live) {
+		b = slab_alloc(slab);
+	}
+	for (auto _ : state) {
+		void *&b = live[ev[i++ & (ev.size() - 1)] % live.size()];
+
+		slab_cache_free(slab, b);
+		b = slab_alloc(slab);
+	}
+	slab_cache_free_bulk(slab, live.data(), (int)live.size());
+	state.SetItemsProcessed(state.iterations());
+}
+
+static void
+BM_slab_churn(benchmark::State& state)
+{
+	static struct slab_cache slab = SLAB_INIT_DEF(slab, 64);
+
+	slab_bench_churn(state, &slab);
+}
+BENCHMARK(BM_slab_churn)->Arg(100000)->Arg(1000000);
+
+// nodeをmmapで予約した領域(THP)から獲得する。
+static void
+BM_slab_churn_mmap(benchmark::State& state)
+{
+	static struct slab_cache slab = SLAB_INIT_DEF(slab, 64);
+
+	slab_mmap_init(SLAB_MMAP_RESERVE_DEF, SLAB_MMAP_THP);
+	slab_set_mem_mmap(&slab);
+	slab_bench_churn(state, &slab);
+}
+BENCHMARK(BM_slab_churn_mmap)->Arg(100000)->Arg(1000000);
+
+// 単一スレッドでのslab_get/slab_putをアトミックとバイアスモードで比較する。
+static void
+BM_slab_getput(benchmark::State& state)
+{
+	struct slab_cache slab;
+	void *buf;
+
+	INIT_SLAB_DEF(&slab, 64);
+	slab_set_flags(&slab, (uint32_t)state.range(0));
+	buf = slab_alloc(&slab);
+	for (auto _ : state) {
+		slab_get(buf);
+		slab_put(buf);
+	}
+	slab_put(buf);
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_slab_getput)->Arg(0)->Arg(SLAB_F_BIASED);
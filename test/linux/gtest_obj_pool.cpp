@@ -0,0 +1,277 @@
+﻿/* --
+ *
+ * MIT License
+ * 
+ * Copyright (c) 2017 Abe Takafumi
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#include <stdlib.h>
+#include <libsharaku/pool/obj_pool.hpp>
+#include <gtest/gtest.h>
+#include <errno.h>
+#include <thread>
+#include <vector>
+#include <set>
+#include <string>
+#include <memory>
+
+struct test_obj {
+	list_head_t	list;
+	int		val;
+};
+
+TEST(obj_pool, initialize) {
+	obj_pool<test_obj> pool(4);
+	test_obj *objs[4];
+
+	ASSERT_EQ(pool.capacity(), 4);
+	for (int i = 0; i < 4; i++) {
+		objs[i] = pool.alloc();
+		ASSERT_NE(objs[i], (test_obj*)NULL);
+	}
+	// 拡張しない場合は空になるとNULLを返す。
+	ASSERT_EQ(pool.alloc(), (test_obj*)NULL);
+	for (int i = 0; i < 4; i++) {
+		pool.free(objs[i]);
+	}
+	ASSERT_NE(pool.alloc(), (test_obj*)NULL);
+}
+
+TEST(obj_pool, initialize_addr) {
+	static test_obj buf[4];
+	obj_pool<test_obj> *pool = new obj_pool<test_obj>(4, buf);
+	test_obj *obj;
+
+	obj = pool->alloc();
+	ASSERT_GE(obj, &buf[0]);
+	ASSERT_LE(obj, &buf[3]);
+	// 指定した領域は開放されない。
+	delete pool;
+}
+
+TEST(obj_pool, set_growth) {
+	obj_pool<test_obj> pool;
+	std::set<test_obj*> objs;
+	test_obj *obj;
+
+	pool.set_growth(16, 40);
+	for (int i = 0; i < 40; i++) {
+		obj = pool.alloc();
+		ASSERT_NE(obj, (test_obj*)NULL);
+		obj->val = i;
+		objs.insert(obj);
+	}
+	ASSERT_EQ(objs.size(), 40);
+	ASSERT_EQ(pool.capacity(), 40);
+	// 上限に達した場合はNULLを返す。
+	ASSERT_EQ(pool.alloc(), (test_obj*)NULL);
+
+	for (test_obj *o : objs) {
+		pool.free(o);
+	}
+	ASSERT_NE(pool.alloc(), (test_obj*)NULL);
+	ASSERT_EQ(pool.capacity(), 40);
+}
+
+TEST(obj_pool, set_growth_unlimited) {
+	obj_pool<test_obj> pool(8);
+
+	pool.set_growth(8);
+	for (int i = 0; i < 1000; i++) {
+		ASSERT_NE(pool.alloc(), (test_obj*)NULL);
+	}
+	ASSERT_EQ(pool.capacity(), 1000);
+}
+
+TEST(obj_pool, multithread) {
+	obj_pool<test_obj, true> pool;
+	std::vector<std::thread> threads;
+
+	pool.set_growth(64);
+	for (int i = 0; i < 8; i++) {
+		threads.emplace_back([&pool, i]() {
+			std::vector<test_obj*> objs;
+			for (int r = 0; r < 100; r++) {
+				for (int j = 0; j < 100; j++) {
+					test_obj *obj = pool.alloc();
+					ASSERT_NE(obj, (test_obj*)NULL);
+					obj->val = i;
+					objs.push_back(obj);
+				}
+				for (test_obj *obj : objs) {
+					ASSERT_EQ(obj->val, i);
+					pool.free(obj);
+				}
+				objs.clear();
+			}
+		});
+	}
+	for (auto &th : threads) {
+		th.join();
+	}
+	// 同時に使用される最大数程度までしか拡張されない。
+	ASSERT_LE(pool.capacity(), 8 * (100 + OBJ_POOL_LOCAL_MAX) + 64);
+}
+
+TEST(obj_pool, multithread_handoff) {
+	obj_pool<test_obj, true> pool;
+	std::vector<test_obj*> objs;
+
+	pool.set_growth(16, 64);
+	for (int i = 0; i < 64; i++) {
+		objs.push_back(pool.alloc());
+	}
+	ASSERT_EQ(pool.alloc(), (test_obj*)NULL);
+
+	// 他スレッドで開放したオブジェクトはスレッドの終了時に返却される。
+	std::thread([&pool, &objs]() {
+		for (test_obj *obj : objs) {
+			pool.free(obj);
+		}
+	}).join();
+	for (int i = 0; i < 64; i++) {
+		ASSERT_NE(pool.alloc(), (test_obj*)NULL);
+	}
+	ASSERT_EQ(pool.alloc(), (test_obj*)NULL);
+}
+
+TEST(obj_pool, multithread_reuse_id) {
+	static test_obj buf[4];
+
+	// 破棄したpoolのidは再利用し、スレッドに残ったスタックは使用しない。
+	for (int i = 0; i < 100; i++) {
+		{
+			obj_pool<test_obj, true> other(4);
+			other.free(other.alloc());
+		}
+		obj_pool<test_obj, true> pool(4, buf);
+		test_obj *objs[4];
+
+		for (int j = 0; j < 4; j++) {
+			objs[j] = pool.alloc();
+			ASSERT_GE(objs[j], &buf[0]);
+			ASSERT_LE(objs[j], &buf[3]);
+		}
+		ASSERT_EQ(pool.alloc(), (test_obj*)NULL);
+		for (int j = 0; j < 4; j++) {
+			pool.free(objs[j]);
+		}
+	}
+}
+
+struct test_counted {
+	static int	ctor;
+	static int	dtor;
+	std::string	name;
+	std::unique_ptr<int> val;
+
+	test_counted(const std::string &n, std::unique_ptr<int> v)
+	    : name(n), val(std::move(v)) {
+		ctor++;
+	}
+	~test_counted() {
+		dtor++;
+	}
+};
+int test_counted::ctor;
+int test_counted::dtor;
+
+TEST(obj_pool, emplace) {
+	obj_pool<test_counted> pool(2);
+	test_counted *obj;
+
+	test_counted::ctor = test_counted::dtor = 0;
+	obj = pool.emplace("abc", std::unique_ptr<int>(new int(5)));
+	ASSERT_NE(obj, (test_counted*)NULL);
+	ASSERT_EQ(obj->name, "abc");
+	ASSERT_EQ(*obj->val, 5);
+	ASSERT_EQ(test_counted::ctor, 1);
+	pool.destroy(obj);
+	ASSERT_EQ(test_counted::dtor, 1);
+	pool.destroy(NULL);
+	ASSERT_EQ(test_counted::dtor, 1);
+}
+
+struct alignas(64) test_aligned {
+	float	v[16];
+};
+
+TEST(obj_pool, alignment) {
+	obj_pool<test_aligned> pool(3);
+	obj_pool<test_aligned, true> pool_mt;
+
+	pool.set_growth(5);
+	pool_mt.set_growth(5);
+	for (int i = 0; i < 20; i++) {
+		ASSERT_EQ((uintptr_t)pool.emplace() % 64, 0);
+		ASSERT_EQ((uintptr_t)pool_mt.emplace() % 64, 0);
+	}
+}
+
+TEST(obj_pool, small_type) {
+	obj_pool<char> pool;
+	std::set<char*> objs;
+	char *obj;
+
+	// list_head_tより小さい型もpoolで管理できる。
+	pool.set_growth(8);
+	for (int i = 0; i < 32; i++) {
+		obj = pool.emplace((char)i);
+		ASSERT_EQ(*obj, (char)i);
+		objs.insert(obj);
+	}
+	ASSERT_EQ(objs.size(), 32);
+	for (char *o : objs) {
+		pool.destroy(o);
+	}
+}
+
+TEST(obj_pool, pool_ptr) {
+	obj_pool<test_counted> pool(2);
+	test_counted *raw;
+
+	test_counted::ctor = test_counted::dtor = 0;
+	{
+		pool_ptr<test_counted> p1 = pool.make("a", nullptr);
+		pool_ptr<test_counted> p2 = pool.make("b", nullptr);
+		pool_ptr<test_counted> p3 = pool.make("c", nullptr);
+		ASSERT_TRUE(p1);
+		ASSERT_TRUE(p2);
+		ASSERT_FALSE(p3);
+		ASSERT_EQ(p1->name, "a");
+		ASSERT_EQ((*p2).name, "b");
+
+		// 移動で所有が移る。
+		p3 = std::move(p1);
+		ASSERT_FALSE(p1);
+		ASSERT_EQ(p3->name, "a");
+		ASSERT_EQ(test_counted::dtor, 0);
+
+		p2.reset();
+		ASSERT_EQ(test_counted::dtor, 1);
+		raw = p3.release();
+	}
+	ASSERT_EQ(test_counted::dtor, 1);
+	pool.destroy(raw);
+	ASSERT_EQ(test_counted::ctor, 2);
+	ASSERT_EQ(test_counted::dtor, 2);
+}
@@ -25,17 +25,28 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <libsharaku/pool/slab.h>
 #include <gtest/gtest.h>
 #include <errno.h>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <vector>
+
+// バッファから境界に配置されたnodeを求める。
+static struct slab_node *
+test_b2n(void *buf, size_t node_size)
+{
+	return (struct slab_node *)((uintptr_t)buf & ~(uintptr_t)(node_size - 1));
+}
 
 TEST(slab, SLAB_INIT) {
 	struct slab_cache slab = SLAB_INIT(slab, sizeof(int), 1048576, 101);
 
-	ASSERT_EQ(slab.s_list.node_list.next, &slab.s_list.node_list);
-	ASSERT_EQ(slab.s_list.node_list.prev, &slab.s_list.node_list);
-	ASSERT_EQ(slab.s_flist.node_list.next, &slab.s_flist.node_list);
-	ASSERT_EQ(slab.s_flist.node_list.prev, &slab.s_flist.node_list);
+	ASSERT_EQ(slab.s_pool.p_bin_map, 0);
 	ASSERT_EQ(slab.s_node_cnt, 0);
 	ASSERT_EQ(slab.s_size, sizeof(int));
 	ASSERT_EQ(slab.s_node_size, 1048576);
@@ -46,10 +57,7 @@ TEST(slab, SLAB_INIT) {
 TEST(slab, SLAB_INIT_SZ) {
 	struct slab_cache slab = SLAB_INIT_SZ(slab, sizeof(int), 1048576);
 
-	ASSERT_EQ(slab.s_list.node_list.next, &slab.s_list.node_list);
-	ASSERT_EQ(slab.s_list.node_list.prev, &slab.s_list.node_list);
-	ASSERT_EQ(slab.s_flist.node_list.next, &slab.s_flist.node_list);
-	ASSERT_EQ(slab.s_flist.node_list.prev, &slab.s_flist.node_list);
+	ASSERT_EQ(slab.s_pool.p_bin_map, 0);
 	ASSERT_EQ(slab.s_node_cnt, 0);
 	ASSERT_EQ(slab.s_size, sizeof(int));
 	ASSERT_EQ(slab.s_node_size, 1048576);
@@ -60,10 +68,7 @@ TEST(slab, SLAB_INIT_SZ) {
 TEST(slab, SLAB_INIT_DEF) {
 	struct slab_cache slab = SLAB_INIT_DEF(slab, sizeof(int));
 
-	ASSERT_EQ(slab.s_list.node_list.next, &slab.s_list.node_list);
-	ASSERT_EQ(slab.s_list.node_list.prev, &slab.s_list.node_list);
-	ASSERT_EQ(slab.s_flist.node_list.next, &slab.s_flist.node_list);
-	ASSERT_EQ(slab.s_flist.node_list.prev, &slab.s_flist.node_list);
+	ASSERT_EQ(slab.s_pool.p_bin_map, 0);
 	ASSERT_EQ(slab.s_node_cnt, 0);
 	ASSERT_EQ(slab.s_size, sizeof(int));
 	ASSERT_EQ(slab.s_node_size, 1048576);
@@ -75,10 +80,7 @@ TEST(slab, INIT_SLAB) {
 	struct slab_cache slab;
 	INIT_SLAB(&slab, sizeof(int), 1048576, 101);
 
-	ASSERT_EQ(slab.s_list.node_list.next, &slab.s_list.node_list);
-	ASSERT_EQ(slab.s_list.node_list.prev, &slab.s_list.node_list);
-	ASSERT_EQ(slab.s_flist.node_list.next, &slab.s_flist.node_list);
-	ASSERT_EQ(slab.s_flist.node_list.prev, &slab.s_flist.node_list);
+	ASSERT_EQ(slab.s_pool.p_bin_map, 0);
 	ASSERT_EQ(slab.s_node_cnt, 0);
 	ASSERT_EQ(slab.s_size, sizeof(int));
 	ASSERT_EQ(slab.s_node_size, 1048576);
@@ -90,10 +92,7 @@ TEST(slab, INIT_SLAB_SZ) {
 	struct slab_cache slab;
 	INIT_SLAB_SZ(&slab, sizeof(int), 1048576);
 
-	ASSERT_EQ(slab.s_list.node_list.next, &slab.s_list.node_list);
-	ASSERT_EQ(slab.s_list.node_list.prev, &slab.s_list.node_list);
-	ASSERT_EQ(slab.s_flist.node_list.next, &slab.s_flist.node_list);
-	ASSERT_EQ(slab.s_flist.node_list.prev, &slab.s_flist.node_list);
+	ASSERT_EQ(slab.s_pool.p_bin_map, 0);
 	ASSERT_EQ(slab.s_node_cnt, 0);
 	ASSERT_EQ(slab.s_size, sizeof(int));
 	ASSERT_EQ(slab.s_node_size, 1048576);
@@ -105,10 +104,7 @@ TEST(slab, INIT_SLAB_DEF) {
 	struct slab_cache slab;
 	INIT_SLAB_DEF(&slab, sizeof(int));
 
-	ASSERT_EQ(slab.s_list.node_list.next, &slab.s_list.node_list);
-	ASSERT_EQ(slab.s_list.node_list.prev, &slab.s_list.node_list);
-	ASSERT_EQ(slab.s_flist.node_list.next, &slab.s_flist.node_list);
-	ASSERT_EQ(slab.s_flist.node_list.prev, &slab.s_flist.node_list);
+	ASSERT_EQ(slab.s_pool.p_bin_map, 0);
 	ASSERT_EQ(slab.s_node_cnt, 0);
 	ASSERT_EQ(slab.s_size, sizeof(int));
 	ASSERT_EQ(slab.s_node_size, 1048576);
@@ -173,10 +169,1471 @@ TEST(slab, slab_alloc) {
 	}
 }
 
+TEST(slab, slab_alloc_bulk) {
+	struct slab_cache slab;
+	void *slab_bufer[256];
+	int i;
+	int rc;
+
+	INIT_SLAB(&slab, 256, 1048576, 200);
+	rc = slab_alloc_bulk(&slab, slab_bufer, 128);
+	ASSERT_EQ(rc, 128);
+	ASSERT_EQ(slab.s_buf_cnt, 128);
+	for (i = 0; i < 128; i++) {
+		ASSERT_EQ(slab_get_refcnt(slab_bufer[i]), 1);
+	}
+
+	// 最大バッファ数を超える分は獲得されない。
+	rc = slab_alloc_bulk(&slab, &slab_bufer[128], 128);
+	ASSERT_EQ(rc, 72);
+	rc = slab_alloc_bulk(&slab, &slab_bufer[200], 1);
+	ASSERT_EQ(rc, -EINVAL);
+
+	for (i = 0; i < 200; i++) {
+		ASSERT_EQ(slab_free(slab_bufer[i]), 0);
+	}
+	ASSERT_EQ(slab.s_buf_cnt, 0);
+	ASSERT_EQ(slab.s_node_cnt, 0);
+}
+
+TEST(slab, slab_alloc_bulk_multinode) {
+	struct slab_cache slab;
+	std::vector<void*> bufs(1000);
+	int rc;
+
+	// 1nodeに収まらない個数を獲得する。
+	INIT_SLAB_SZ(&slab, 256, SLAB_NODE_SZ_MIN);
+	rc = slab_alloc_bulk(&slab, bufs.data(), 1000);
+	ASSERT_EQ(rc, 1000);
+	ASSERT_GT(slab.s_node_cnt, 1);
+	ASSERT_EQ(slab.s_buf_cnt, 1000);
+
+	rc = slab_free_bulk(bufs.data(), 1000);
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(slab.s_buf_cnt, 0);
+	ASSERT_EQ(slab.s_node_cnt, 0);
+}
+
+TEST(slab, slab_free_bulk) {
+	struct slab_cache slab1;
+	struct slab_cache slab2;
+	void *slab_bufer[128];
+	int i;
+	int rc;
+
+	INIT_SLAB_DEF(&slab1, 64);
+	INIT_SLAB_DEF(&slab2, 128);
+	for (i = 0; i < 128; i++) {
+		slab_bufer[i] = slab_alloc((i & 4) ? &slab1 : &slab2);
+	}
+	rc = slab_free_bulk(slab_bufer, 128);
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(slab1.s_buf_cnt, 0);
+	ASSERT_EQ(slab2.s_buf_cnt, 0);
+	ASSERT_EQ(slab1.s_node_cnt, 0);
+	ASSERT_EQ(slab2.s_node_cnt, 0);
+
+	// 不正なバッファが含まれる場合は、それ以外を開放する。
+	rc = slab_alloc_bulk(&slab1, slab_bufer, 3);
+	ASSERT_EQ(rc, 3);
+	slab_bufer[3] = NULL;
+	rc = slab_free_bulk(slab_bufer, 4);
+	ASSERT_EQ(rc, -EFAULT);
+	ASSERT_EQ(slab1.s_buf_cnt, 0);
+}
+
+TEST(slab, slab_free_double) {
+	struct slab_cache slab;
+	void *buf;
+	void *pin;
+
+	INIT_SLAB_DEF(&slab, 64);
+	pin = slab_alloc(&slab);
+	buf = slab_alloc(&slab);
+	ASSERT_EQ(slab_free(buf), 0);
+	ASSERT_EQ(slab_free(buf), -EFAULT);
+	ASSERT_EQ(slab_free(NULL), -EFAULT);
+	ASSERT_EQ(slab_free(pin), 0);
+
+	// マガジンに保持中の要素も二重開放を検出する。
+	ASSERT_EQ(slab_set_magazine(&slab, 8), 0);
+	buf = slab_alloc(&slab);
+	ASSERT_EQ(slab_free(buf), 0);
+	ASSERT_EQ(slab_free(buf), -EFAULT);
+	ASSERT_EQ(slab_get(buf), -EFAULT);
+	ASSERT_EQ(slab_alloc(&slab), buf);
+	ASSERT_EQ(slab_get(buf), 2);
+	ASSERT_EQ(slab_put(buf), 1);
+	ASSERT_EQ(slab_free(buf), 0);
+	slab_magazine_flush();
+	ASSERT_EQ(slab.s_node_cnt, 0);
+}
+
+TEST(slab, SLAB_F_LEAN) {
+	struct slab_cache slab;
+	struct slab_node *node;
+	std::vector<void*> bufs(100000);
+	size_t i;
+
+	INIT_SLAB_DEF(&slab, 32);
+	slab_set_flags(&slab, SLAB_F_LEAN);
+	for (auto &b : bufs) {
+		b = slab_alloc(&slab);
+		ASSERT_NE((int64_t)b, -ENOMEM);
+		memset(b, 0xa5, 32);
+	}
+
+	// nodeはs_node_size境界に配置され、ヘッダ、フッタを持たない。
+	node = test_b2n(bufs[0], SLAB_DEFAULT_SZ);
+	ASSERT_EQ(node->sn_slab, &slab);
+	ASSERT_EQ(node->sn_max_cnt, (SLAB_DEFAULT_SZ - sizeof(struct slab_node)) / 32);
+	ASSERT_EQ((char*)bufs[1] - (char*)bufs[0], 32);
+	ASSERT_EQ(slab.s_node_cnt, (100000 + node->sn_max_cnt - 1) / node->sn_max_cnt);
+
+	for (i = 0; i < bufs.size(); i += 2) {
+		ASSERT_EQ(slab_cache_free(&slab, bufs[i]), 0);
+	}
+	for (i = 1; i < bufs.size(); i += 2) {
+		bufs[i / 2] = bufs[i];
+	}
+	ASSERT_EQ(slab_cache_free_bulk(&slab, bufs.data(), 50000), 0);
+	ASSERT_EQ(slab.s_buf_cnt, 0);
+	ASSERT_EQ(slab.s_node_cnt, 0);
+}
+
+TEST(slab, SLAB_F_LEAN_invalid) {
+	struct slab_cache slab1;
+	struct slab_cache slab2;
+	void *buf;
+
+	// nodeサイズが2のべき乗でない場合は利用できない。
+	INIT_SLAB_SZ(&slab1, 32, 3 * SLAB_NODE_SZ_MIN);
+	slab_set_flags(&slab1, SLAB_F_LEAN);
+	buf = slab_alloc(&slab1);
+	ASSERT_EQ((int64_t)buf, -EINVAL);
+
+	// 異なるslabへの開放は検出される。
+	INIT_SLAB_DEF(&slab1, 32);
+	INIT_SLAB_DEF(&slab2, 32);
+	slab_set_flags(&slab1, SLAB_F_LEAN);
+	slab_set_flags(&slab2, SLAB_F_LEAN);
+	buf = slab_alloc(&slab1);
+	ASSERT_EQ(slab_cache_free(&slab2, buf), -EFAULT);
+	ASSERT_EQ(slab_cache_free(&slab1, buf), 0);
+}
+
+TEST(slab, SLAB_F_LEAN_magazine) {
+	static struct slab_cache slab = SLAB_INIT_DEF(slab, 16);
+	std::vector<std::thread> threads;
+	int t;
+
+	slab_set_flags(&slab, SLAB_F_LEAN);
+	ASSERT_EQ(slab_set_magazine(&slab, SLAB_MAGAZINE_SZ), 0);
+	for (t = 0; t < 4; t++) {
+		threads.push_back(std::thread([]() {
+			void *bufs[256];
+			int loop;
+			int i;
+
+			for (loop = 0; loop < 1000; loop++) {
+				for (i = 0; i < 256; i++) {
+					bufs[i] = slab_alloc(&slab);
+				}
+				for (i = 0; i < 256; i++) {
+					ASSERT_EQ(slab_cache_free(&slab, bufs[i]), 0);
+				}
+			}
+		}));
+	}
+	for (auto &th : threads) {
+		th.join();
+	}
+	ASSERT_EQ(slab.s_buf_cnt, 0);
+	ASSERT_EQ(slab.s_node_cnt, 0);
+}
+
+static int test_aligned_cnt;
+
+static void *
+test_mem_alloc_aligned(size_t align, size_t size)
+{
+	void *mem;
+
+	test_aligned_cnt++;
+	if (posix_memalign(&mem, align, size)) {
+		return NULL;
+	}
+	return mem;
+}
+
+TEST(slab, slab_set_mem_allocator_aligned) {
+	struct slab_cache slab;
+	void *bufs[16];
+	int i;
+
+	// nodeはs_node_size境界に配置される。
+	INIT_SLAB_SZ(&slab, 64, 65536);
+	test_aligned_cnt = 0;
+	slab_set_mem_allocator_aligned(&slab, test_mem_alloc_aligned, free);
+	for (i = 0; i < 16; i++) {
+		bufs[i] = slab_alloc(&slab);
+		ASSERT_EQ(((uintptr_t)bufs[i] & ~(uintptr_t)65535),
+			  ((uintptr_t)bufs[0] & ~(uintptr_t)65535));
+	}
+	ASSERT_EQ(test_aligned_cnt, 1);
+	ASSERT_EQ(test_b2n(bufs[0], 65536)->sn_slab, &slab);
+	for (i = 0; i < 8; i++) {
+		ASSERT_EQ(slab_cache_free(&slab, bufs[i]), 0);
+	}
+	for (i = 8; i < 16; i++) {
+		ASSERT_EQ(slab_free(bufs[i]), 0);
+	}
+	ASSERT_EQ(slab.s_node_cnt, 0);
+
+	// 境界指定のない獲得関数ではleanのslabは利用できない。
+	INIT_SLAB_DEF(&slab, 64);
+	slab_set_flags(&slab, SLAB_F_LEAN);
+	slab_set_mem_allocator(&slab, malloc, free);
+	ASSERT_EQ((int64_t)slab_alloc(&slab), -EINVAL);
+
+	// ヘッダ付きであれば境界に配置されなくても利用できる。
+	slab_set_flags(&slab, 0);
+	bufs[0] = slab_alloc(&slab);
+	ASSERT_EQ(slab_cache_free(&slab, bufs[0]), 0);
+}
+
+TEST(slab, slab_bins) {
+	struct slab_cache slab;
+	std::vector<void*> bufs_a;
+	std::vector<void*> bufs_b;
+	struct slab_node *node_a;
+	struct slab_node *node_b;
+	size_t i;
+	void *buf;
+
+	// 2nodeが獲得対象外(full)になるまで獲得する。
+	INIT_SLAB_SZ(&slab, 64, SLAB_NODE_SZ_MIN);
+	buf = slab_alloc(&slab);
+	node_a = test_b2n(buf, SLAB_NODE_SZ_MIN);
+	node_b = NULL;
+	for (;;) {
+		if (test_b2n(buf, SLAB_NODE_SZ_MIN) == node_a) {
+			bufs_a.push_back(buf);
+		} else if (!node_b || test_b2n(buf, SLAB_NODE_SZ_MIN) == node_b) {
+			node_b = test_b2n(buf, SLAB_NODE_SZ_MIN);
+			bufs_b.push_back(buf);
+		} else {
+			ASSERT_EQ(slab_free(buf), 0);
+			break;
+		}
+		buf = slab_alloc(&slab);
+	}
+	ASSERT_EQ(slab.s_node_cnt, 2);
+	ASSERT_EQ(slab.s_pool.p_bin_map, 1U);
+	ASSERT_EQ(node_a->sn_bin, 0);
+	ASSERT_EQ(node_b->sn_bin, 0);
+
+	// node_aを半分、node_bを3割開放すると、密度の濃いnode_bから獲得される。
+	for (i = 0; i < bufs_a.size() / 2; i++) {
+		ASSERT_EQ(slab_free(bufs_a[i]), 0);
+	}
+	for (i = 0; i < bufs_b.size() * 3 / 10; i++) {
+		ASSERT_EQ(slab_free(bufs_b[i]), 0);
+	}
+	ASSERT_LT(node_b->sn_bin, node_a->sn_bin);
+	buf = slab_alloc(&slab);
+	ASSERT_EQ(test_b2n(buf, SLAB_NODE_SZ_MIN), node_b);
+	ASSERT_EQ(slab_free(buf), 0);
+
+	for (i = bufs_a.size() / 2; i < bufs_a.size(); i++) {
+		ASSERT_EQ(slab_free(bufs_a[i]), 0);
+	}
+	for (i = bufs_b.size() * 3 / 10; i < bufs_b.size(); i++) {
+		ASSERT_EQ(slab_free(bufs_b[i]), 0);
+	}
+	ASSERT_EQ(slab.s_node_cnt, 0);
+	ASSERT_EQ(slab.s_pool.p_bin_map, 0);
+}
+
+TEST(slab, slab_set_keep_empty) {
+	struct slab_cache slab;
+	std::vector<void*> bufs(1000);
+	void *buf;
+
+	INIT_SLAB_SZ(&slab, 64, SLAB_NODE_SZ_MIN);
+	slab_set_keep_empty(&slab, 2);
+
+	// 空きnodeは開放されずに保持される。
+	buf = slab_alloc(&slab);
+	ASSERT_EQ(slab_free(buf), 0);
+	ASSERT_EQ(slab.s_node_cnt, 1);
+	ASSERT_EQ(slab.s_pool.p_empty_cnt, 1);
+	ASSERT_EQ(slab_alloc(&slab), buf);
+	ASSERT_EQ(slab.s_pool.p_empty_cnt, 0);
+	ASSERT_EQ(slab_free(buf), 0);
+
+	// 保持数を超える空きnodeは開放される。
+	ASSERT_EQ(slab_alloc_bulk(&slab, bufs.data(), 1000), 1000);
+	ASSERT_GT(slab.s_node_cnt, 2);
+	ASSERT_EQ(slab.s_pool.p_empty_cnt, 0);
+	ASSERT_EQ(slab_free_bulk(bufs.data(), 1000), 0);
+	ASSERT_EQ(slab.s_node_cnt, 2);
+	ASSERT_EQ(slab.s_pool.p_empty_cnt, 2);
+
+	ASSERT_EQ(slab_shrink(&slab), 2);
+	ASSERT_EQ(slab.s_node_cnt, 0);
+	ASSERT_EQ(slab.s_pool.p_empty_cnt, 0);
+	ASSERT_EQ(slab.s_pool.p_bin_map, 0);
+	ASSERT_EQ(slab_shrink(&slab), 0);
+}
+
+TEST(slab, slab_node_lazy_carve) {
+	struct slab_cache slab;
+	struct slab_node *node;
+	void *bufs[4];
+	void *buf;
+
+	INIT_SLAB_DEF(&slab, 64);
+	slab_set_flags(&slab, SLAB_F_LEAN);
+	slab_set_keep_empty(&slab, 1);
+
+	// 作成直後のnodeは未使用領域から切り出す。
+	bufs[0] = slab_alloc(&slab);
+	node = test_b2n(bufs[0], SLAB_DEFAULT_SZ);
+	ASSERT_EQ(bufs[0], (void*)(node + 1));
+	ASSERT_EQ(node->sn_free, (void*)NULL);
+	ASSERT_EQ(node->sn_bump, (char*)bufs[0] + 64);
+	bufs[1] = slab_alloc(&slab);
+	bufs[2] = slab_alloc(&slab);
+	ASSERT_EQ((char*)bufs[2] - (char*)bufs[1], 64);
+
+	// 開放済みの要素が未使用領域より優先される。
+	ASSERT_EQ(slab_cache_free(&slab, bufs[1]), 0);
+	bufs[3] = node->sn_bump;
+	buf = slab_alloc(&slab);
+	ASSERT_EQ(buf, bufs[1]);
+	buf = slab_alloc(&slab);
+	ASSERT_EQ(buf, bufs[3]);
+
+	ASSERT_EQ(slab_cache_free(&slab, bufs[0]), 0);
+	ASSERT_EQ(slab_cache_free(&slab, bufs[1]), 0);
+	ASSERT_EQ(slab_cache_free(&slab, bufs[2]), 0);
+	ASSERT_EQ(slab_cache_free(&slab, bufs[3]), 0);
+	ASSERT_EQ(slab_shrink(&slab), 1);
+}
+
+TEST(slab, slab_set_numa) {
+	struct slab_cache slab;
+	struct slab_node *node0;
+	struct slab_node *node1;
+	void *buf0;
+	void *buf1;
+
+	INIT_SLAB_SZ(&slab, 64, SLAB_NODE_SZ_MIN);
+	ASSERT_EQ(slab_set_numa(&slab, SLAB_NUMA_STRICT + 1), -EINVAL);
+	ASSERT_EQ(slab_set_numa(&slab, SLAB_NUMA_PREFER), 0);
+	ASSERT_NE(slab.s_numa, (struct slab_pool *)NULL);
+
+	// NUMAノードごとにnodeが作成される。
+	slab_set_numa_node(0);
+	buf0 = slab_alloc(&slab);
+	slab_set_numa_node(1);
+	buf1 = slab_alloc(&slab);
+	node0 = test_b2n(buf0, SLAB_NODE_SZ_MIN);
+	node1 = test_b2n(buf1, SLAB_NODE_SZ_MIN);
+	ASSERT_NE(node0, node1);
+	ASSERT_EQ(node0->sn_nid, 0);
+	ASSERT_EQ(node1->sn_nid, 1);
+	ASSERT_EQ(node0->sn_pool, &slab.s_pool);
+	ASSERT_EQ(node1->sn_pool, &slab.s_numa[0]);
+	ASSERT_EQ(slab.s_node_cnt, 2);
+
+	// 使用中のnodeがある場合は変更できない。
+	ASSERT_EQ(slab_set_numa(&slab, SLAB_NUMA_OFF), -EBUSY);
+	ASSERT_EQ(slab_free(buf0), 0);
+	ASSERT_EQ(slab_free(buf1), 0);
+	ASSERT_EQ(slab.s_node_cnt, 0);
+
+	// SLAB_NUMA_REMOTEでは他のNUMAノードのnodeを使用する。
+	ASSERT_EQ(slab_set_numa(&slab, SLAB_NUMA_REMOTE), 0);
+	slab_set_numa_node(0);
+	buf0 = slab_alloc(&slab);
+	slab_set_numa_node(1);
+	buf1 = slab_alloc(&slab);
+	ASSERT_EQ(test_b2n(buf0, SLAB_NODE_SZ_MIN),
+		  test_b2n(buf1, SLAB_NODE_SZ_MIN));
+	ASSERT_EQ(slab.s_node_cnt, 1);
+	ASSERT_EQ(slab_free(buf0), 0);
+	ASSERT_EQ(slab_free(buf1), 0);
+
+	ASSERT_EQ(slab_set_numa(&slab, SLAB_NUMA_OFF), 0);
+	ASSERT_EQ(slab.s_numa, (struct slab_pool *)NULL);
+	slab_set_numa_node(-1);
+}
+
+TEST(slab, slab_set_numa_keep_empty) {
+	struct slab_cache slab;
+	void *buf0;
+	void *buf1;
+
+	INIT_SLAB_SZ(&slab, 64, SLAB_NODE_SZ_MIN);
+	ASSERT_EQ(slab_set_numa(&slab, SLAB_NUMA_STRICT), 0);
+	slab_set_keep_empty(&slab, 1);
+
+	// 空きnodeはNUMAノードごとに保持される。
+	slab_set_numa_node(0);
+	buf0 = slab_alloc(&slab);
+	slab_set_numa_node(1);
+	buf1 = slab_alloc(&slab);
+	ASSERT_EQ(slab_free(buf0), 0);
+	ASSERT_EQ(slab_free(buf1), 0);
+	ASSERT_EQ(slab.s_node_cnt, 2);
+	ASSERT_EQ(slab.s_pool.p_empty_cnt, 1);
+	ASSERT_EQ(slab.s_numa[0].p_empty_cnt, 1);
+
+	ASSERT_EQ(slab_shrink(&slab), 2);
+	ASSERT_EQ(slab.s_node_cnt, 0);
+	ASSERT_EQ(slab_set_numa(&slab, SLAB_NUMA_OFF), 0);
+	slab_set_numa_node(-1);
+}
+
+TEST(slab, slab_get_multithread) {
+	struct slab_cache slab;
+	std::vector<std::thread> threads;
+	void *buf;
+
+	INIT_SLAB_DEF(&slab, 64);
+	buf = slab_alloc(&slab);
+
+	// 複数スレッドからの加算、減算で参照カウントが失われない。
+	for (int i = 0; i < 4; i++) {
+		threads.emplace_back([buf]() {
+			for (int j = 0; j < 100000; j++) {
+				ASSERT_GT(slab_get(buf), 1);
+				ASSERT_GT(slab_put(buf), 0);
+			}
+		});
+	}
+	for (auto &th : threads) {
+		th.join();
+	}
+	ASSERT_EQ(slab_get_refcnt(buf), 1);
+	ASSERT_EQ(slab_put(buf), 0);
+	ASSERT_EQ(slab.s_node_cnt, 0);
+}
+
+TEST(slab, slab_get_biased) {
+	struct slab_cache slab;
+	std::vector<std::thread> threads;
+	void *buf;
+
+	INIT_SLAB_DEF(&slab, 64);
+	slab_set_flags(&slab, SLAB_F_BIASED);
+
+	// 所有スレッドのみの場合
+	buf = slab_alloc(&slab);
+	ASSERT_EQ(slab_get(buf), 2);
+	ASSERT_EQ(slab_get_refcnt(buf), 2);
+	ASSERT_EQ(slab_put(buf), 1);
+	ASSERT_EQ(slab_put(buf), 0);
+	ASSERT_EQ(slab.s_node_cnt, 0);
+
+	// 他スレッドが参照を持ったまま所有スレッドが開放する。
+	buf = slab_alloc(&slab);
+	for (int i = 0; i < 4; i++) {
+		ASSERT_EQ(slab_get(buf), i + 2);
+	}
+	// 所有スレッドの参照を他スレッドで開放すると所有スレッドが減算する。
+	std::thread([buf]() {
+		ASSERT_EQ(slab_put(buf), 0);
+	}).join();
+	ASSERT_EQ(slab_get_refcnt(buf), 4);
+	ASSERT_EQ(slab_get(buf), 5);
+	for (int i = 0; i < 4; i++) {
+		threads.emplace_back([buf]() {
+			for (int j = 0; j < 10000; j++) {
+				ASSERT_GT(slab_get(buf), 0);
+				ASSERT_GE(slab_put(buf), 0);
+			}
+		});
+	}
+	for (auto &th : threads) {
+		th.join();
+	}
+	threads.clear();
+	ASSERT_EQ(slab_get_refcnt(buf), 5);
+
+	// 他スレッドへ参照を渡し、所有スレッドの参照をすべて開放する。
+	for (int i = 0; i < 4; i++) {
+		threads.emplace_back([buf]() {
+			ASSERT_GT(slab_get(buf), 0);
+		});
+	}
+	for (auto &th : threads) {
+		th.join();
+	}
+	threads.clear();
+	for (int i = 0; i < 5; i++) {
+		ASSERT_EQ(slab_put(buf), i < 4 ? 4 - i : 4);
+	}
+	ASSERT_EQ(slab.s_node_cnt, 1);
+	for (int i = 0; i < 4; i++) {
+		threads.emplace_back([buf]() {
+			ASSERT_GE(slab_put(buf), 0);
+		});
+	}
+	for (auto &th : threads) {
+		th.join();
+	}
+	ASSERT_EQ(slab.s_node_cnt, 0);
+}
+
+TEST(slab, slab_put_handoff) {
+	struct slab_cache slab;
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::vector<void*> queue;
+	bool done = false;
+	void *buf;
+
+	INIT_SLAB_DEF(&slab, 64);
+	slab_set_flags(&slab, SLAB_F_BIASED);
+
+	// 所有スレッドが獲得し、他スレッドが開放する。
+	std::thread consumer([&]() {
+		std::unique_lock<std::mutex> lk(mtx);
+		for (;;) {
+			cv.wait(lk, [&]() { return done || !queue.empty(); });
+			if (queue.empty()) {
+				break;
+			}
+			void *b = queue.back();
+			queue.pop_back();
+			lk.unlock();
+			ASSERT_EQ(slab_put(b), 0);
+			lk.lock();
+		}
+	});
+	std::thread producer([&]() {
+		for (int i = 0; i < 10000; i++) {
+			void *b = slab_alloc(&slab);
+			ASSERT_NE(b, nullptr);
+			std::lock_guard<std::mutex> lk(mtx);
+			queue.push_back(b);
+			cv.notify_one();
+		}
+	});
+	producer.join();
+	{
+		std::lock_guard<std::mutex> lk(mtx);
+		done = true;
+		cv.notify_one();
+	}
+	consumer.join();
+	// 所有スレッドの終了後に開放したものは、その場で統合して開放する。
+	slab_shrink(&slab);
+	ASSERT_EQ(slab.s_node_cnt, 0);
+
+	// 所有スレッドが終了した後に残りの参照を開放する。
+	std::thread([&]() {
+		buf = slab_alloc(&slab);
+		ASSERT_EQ(slab_get(buf), 2);
+	}).join();
+	ASSERT_EQ(slab_put(buf), 1);
+	ASSERT_EQ(slab.s_node_cnt, 1);
+	ASSERT_EQ(slab_put(buf), 0);
+	ASSERT_EQ(slab.s_node_cnt, 0);
+}
+
+TEST(slab, slab_free_remote) {
+	struct slab_cache slab;
+	struct slab_node *node;
+	std::vector<void*> bufs(4);
+	void *buf;
+
+	INIT_SLAB_SZ(&slab, 64, SLAB_NODE_SZ_MIN);
+	ASSERT_EQ(slab_alloc_bulk(&slab, bufs.data(), 4), 4);
+	node = test_b2n(bufs[0], SLAB_NODE_SZ_MIN);
+
+	// ロック中の開放はリモート開放リストへつながれる。
+	slab.s_lock = 1;
+	ASSERT_EQ(slab_free(bufs[0]), 0);
+	ASSERT_EQ(slab_free(bufs[1]), 0);
+	slab.s_lock = 0;
+	ASSERT_NE(node->sn_remote, (void*)NULL);
+	ASSERT_EQ(slab.s_remote, node);
+	ASSERT_EQ(node->sn_alloc_cnt, 4);
+	// リモート開放済みのバッファも二重開放を検出できる。
+	ASSERT_EQ(slab_free(bufs[0]), -EFAULT);
+
+	// 次の獲得で回収され、再利用される。
+	buf = slab_alloc(&slab);
+	ASSERT_EQ(node->sn_remote, (void*)NULL);
+	ASSERT_EQ(slab.s_remote, (struct slab_node *)NULL);
+	ASSERT_EQ(node->sn_alloc_cnt, 3);
+	ASSERT_EQ(buf, bufs[1]);
+
+	// すべてリモート開放された場合、回収時にnodeを開放する。
+	slab.s_lock = 1;
+	ASSERT_EQ(slab_free(buf), 0);
+	ASSERT_EQ(slab_free(bufs[2]), 0);
+	ASSERT_EQ(slab_free(bufs[3]), 0);
+	slab.s_lock = 0;
+	ASSERT_EQ(slab.s_node_cnt, 1);
+	ASSERT_EQ(slab_shrink(&slab), 0);
+	ASSERT_EQ(slab.s_node_cnt, 0);
+}
+
+TEST(slab, slab_free_remote_multithread) {
+	struct slab_cache slab;
+	std::vector<std::thread> threads;
+	std::vector<void*> bufs(40000);
+
+	INIT_SLAB_DEF(&slab, 64);
+	ASSERT_EQ(slab_alloc_bulk(&slab, bufs.data(), 40000), 40000);
+
+	// 獲得スレッドと並行して複数スレッドから開放する。
+	for (int i = 0; i < 4; i++) {
+		threads.emplace_back([&bufs, i]() {
+			for (int j = i; j < 40000; j += 4) {
+				ASSERT_EQ(slab_free(bufs[j]), 0);
+			}
+		});
+	}
+	for (int j = 0; j < 10000; j++) {
+		ASSERT_EQ(slab_free(slab_alloc(&slab)), 0);
+	}
+	for (auto &th : threads) {
+		th.join();
+	}
+	slab_shrink(&slab);
+	ASSERT_EQ(slab.s_buf_cnt, 0);
+	ASSERT_EQ(slab.s_node_cnt, 0);
+}
+
+TEST(slab, slab_stats) {
+	struct slab_cache slab;
+	struct slab_stats st;
+	std::vector<void*> bufs(100);
+	std::vector<void*> more(100);
+
+	INIT_SLAB(&slab, 64, SLAB_NODE_SZ_MIN, 150);
+	ASSERT_EQ(slab_stats(&slab, &st), 0);
+	ASSERT_STREQ(st.st_name, "&slab");
+	ASSERT_EQ(st.st_alloc, 0);
+	ASSERT_EQ(st.st_node_cnt, 0);
+
+	ASSERT_EQ(slab_alloc_bulk(&slab, bufs.data(), 100), 100);
+	ASSERT_EQ(slab_free_bulk(bufs.data(), 50), 0);
+	ASSERT_EQ(slab_stats(&slab, &st), 0);
+	ASSERT_EQ(st.st_size, 64);
+	ASSERT_EQ(st.st_node_size, SLAB_NODE_SZ_MIN);
+	ASSERT_EQ(st.st_alloc, 100);
+	ASSERT_EQ(st.st_free, 50);
+	ASSERT_EQ(st.st_buf_cnt, 50);
+	ASSERT_EQ(st.st_buf_peak, 100);
+	ASSERT_EQ(st.st_node_alloc, st.st_node_cnt + st.st_node_free);
+	ASSERT_EQ(st.st_live_bytes, 50 * 64);
+	ASSERT_EQ(st.st_node_bytes, st.st_node_cnt * SLAB_NODE_SZ_MIN);
+	uint32_t nodes = 0;
+	for (int i = 0; i <= SLAB_PRIO; i++) {
+		nodes += st.st_bins[i];
+	}
+	ASSERT_EQ(nodes, st.st_node_cnt);
+
+	// s_max_buf_cntによる獲得失敗を数える。
+	ASSERT_EQ(slab_alloc_bulk(&slab, more.data(), 100), 100);
+	ASSERT_EQ((int64_t)slab_alloc(&slab), -EINVAL);
+	ASSERT_EQ(slab_stats(&slab, &st), 0);
+	ASSERT_EQ(st.st_limit_fail, 1);
+	ASSERT_EQ(st.st_buf_peak, 150);
+
+	ASSERT_EQ(slab_free_bulk(bufs.data() + 50, 50), 0);
+	ASSERT_EQ(slab_free_bulk(more.data(), 100), 0);
+	ASSERT_EQ(slab_stats(&slab, &st), 0);
+	ASSERT_EQ(st.st_buf_cnt, 0);
+	ASSERT_EQ(slab.s_node_cnt, 0);
+}
+
+TEST(slab, slab_stats_magazine) {
+	struct slab_cache slab;
+	struct slab_stats st;
+	void *buf;
+
+	INIT_SLAB_DEF(&slab, 64);
+	slab_set_magazine(&slab, 8);
+	for (int i = 0; i < 100; i++) {
+		buf = slab_alloc(&slab);
+		ASSERT_EQ(slab_free(buf), 0);
+	}
+	ASSERT_EQ(slab_stats(&slab, &st), 0);
+	ASSERT_EQ(st.st_alloc, 100);
+	ASSERT_EQ(st.st_free, 100);
+	ASSERT_EQ(st.st_mag_cnt, st.st_buf_cnt);
+	ASSERT_EQ(st.st_live_bytes, 0);
+
+	// 他スレッドの獲得、開放も集計する。(終了したスレッドの分を含む)
+	std::thread([&slab]() {
+		void *bufs[20];
+		for (auto &b : bufs) {
+			b = slab_alloc(&slab);
+		}
+		for (auto b : bufs) {
+			slab_free(b);
+		}
+	}).join();
+	ASSERT_EQ(slab_stats(&slab, &st), 0);
+	ASSERT_EQ(st.st_alloc, 120);
+	ASSERT_EQ(st.st_free, 120);
+	slab_magazine_flush();
+	ASSERT_EQ(slab_stats(&slab, &st), 0);
+	ASSERT_EQ(st.st_alloc, 120);
+	ASSERT_EQ(st.st_free, 120);
+	ASSERT_EQ(st.st_mag_cnt, 0);
+	ASSERT_EQ(st.st_buf_cnt, 0);
+}
+
+static int
+test_foreach(struct slab_cache *slab, void *arg)
+{
+	std::vector<struct slab_cache*> *list
+		 = (std::vector<struct slab_cache*> *)arg;
+	list->push_back(slab);
+	return 0;
+}
+
+TEST(slab, slab_register) {
+	static struct slab_cache slab1 = SLAB_INIT_DEF(slab1, 64);
+	static struct slab_cache slab2 = SLAB_INIT_DEF(slab2, 128);
+	std::vector<struct slab_cache*> list;
+
+	ASSERT_STREQ(slab1.s_name, "slab1");
+	ASSERT_EQ(slab_register(&slab1), 0);
+	ASSERT_EQ(slab_register(&slab1), -EBUSY);
+	ASSERT_EQ(slab_register(&slab2), 0);
+	ASSERT_EQ(slab_foreach(test_foreach, &list), 0);
+	ASSERT_NE(std::find(list.begin(), list.end(), &slab1), list.end());
+	ASSERT_NE(std::find(list.begin(), list.end(), &slab2), list.end());
+
+	slab_unregister(&slab1);
+	slab_unregister(&slab2);
+	list.clear();
+	ASSERT_EQ(slab_foreach(test_foreach, &list), 0);
+	ASSERT_EQ(std::find(list.begin(), list.end(), &slab1), list.end());
+}
+
+TEST(slab, slab_profile) {
+	struct slab_cache slab;
+	struct slab_site sites[4];
+	void *bufs1[3];
+	void *bufs2[5];
+	int line1;
+	int line2;
+
+	INIT_SLAB(&slab, 64, SLAB_NODE_SZ_MIN, 0);
+	ASSERT_EQ(slab_profile(&slab, sites, 4), 0);
+
+	line1 = __LINE__; ASSERT_EQ(slab_alloc_bulk(&slab, bufs1, 3), 3);
+	for (auto &b : bufs2) {
+		line2 = __LINE__; b = slab_alloc(&slab);
+	}
+	ASSERT_EQ(slab_free(bufs1[0]), 0);
+	ASSERT_EQ(slab_profile(&slab, sites, 4), 2);
+	ASSERT_STREQ(sites[0].ss_src, __FILE__);
+	ASSERT_EQ(sites[0].ss_line, line2);
+	ASSERT_EQ(sites[0].ss_cnt, 5);
+	ASSERT_EQ(sites[0].ss_bytes, 5 * 64);
+	ASSERT_EQ(sites[1].ss_line, line1);
+	ASSERT_EQ(sites[1].ss_cnt, 2);
+	ASSERT_EQ(sites[1].ss_bytes, 2 * 64);
+
+	// 表が不足する。
+	ASSERT_EQ(slab_profile(&slab, sites, 1), -ENOSPC);
+	ASSERT_EQ(slab_profile(&slab, sites, 0), -EINVAL);
+
+	ASSERT_EQ(slab_free_bulk(&bufs1[1], 2), 0);
+	ASSERT_EQ(slab_free_bulk(bufs2, 5), 0);
+	ASSERT_EQ(slab_profile(&slab, sites, 4), 0);
+
+	// leanのslabは獲得箇所を持たない。
+	INIT_SLAB(&slab, 64, SLAB_NODE_SZ_MIN, 0);
+	slab_set_flags(&slab, SLAB_F_LEAN);
+	ASSERT_EQ(slab_profile(&slab, sites, 4), -ENOTSUP);
+}
+
+TEST(slab, slab_profile_magazine) {
+	struct slab_cache slab;
+	struct slab_site sites[4];
+	void *bufs[4];
+	void *buf;
+	int line;
+
+	// マガジンに保持中の要素、他スレッドが開放した要素は集計しない。
+	INIT_SLAB_DEF(&slab, 64);
+	slab_set_magazine(&slab, 16);
+	for (auto &b : bufs) {
+		line = __LINE__; b = slab_alloc(&slab);
+	}
+	buf = slab_alloc(&slab);
+	ASSERT_EQ(slab_free(buf), 0);
+	std::thread([&bufs]() {
+		ASSERT_EQ(slab_free(bufs[3]), 0);
+		slab_magazine_flush();
+	}).join();
+	ASSERT_EQ(slab_profile(&slab, sites, 4), 1);
+	ASSERT_EQ(sites[0].ss_line, line);
+	ASSERT_EQ(sites[0].ss_cnt, 3);
+
+	ASSERT_EQ(slab_free_bulk(bufs, 3), 0);
+	slab_magazine_flush();
+	ASSERT_EQ(slab_profile(&slab, sites, 4), 0);
+}
+
+// slab.cのsmem_header_t、smem_footer_tのサイズ
+#define TEST_HDR_SZ	40
+#define TEST_FTR_SZ	16
+
+TEST(slab, slab_verify) {
+	struct slab_cache slab;
+	struct slab_verify v;
+	std::vector<void*> bufs(100);
+	char ftr[TEST_FTR_SZ];
+	void *saved;
+	int calls;
+
+	INIT_SLAB(&slab, 64, SLAB_NODE_SZ_MIN, 0);
+	slab_set_flags(&slab, SLAB_F_POISON);
+	slab_set_keep_empty(&slab, 4);
+	ASSERT_EQ(slab_verify(&slab, 0, &v), 0);
+	ASSERT_EQ(v.v_done, 1);
+	ASSERT_EQ(v.v_nodes, 0);
+
+	ASSERT_EQ(slab_alloc_bulk(&slab, bufs.data(), 100), 100);
+	ASSERT_EQ(slab_free_bulk(bufs.data(), 50), 0);
+	ASSERT_EQ(slab_verify(&slab, 0, &v), 0);
+	ASSERT_EQ(v.v_done, 1);
+	ASSERT_EQ(v.v_nodes, slab.s_node_cnt);
+	ASSERT_EQ(v.v_objs, 100);
+
+	// 少しずつ検査し、1周で全要素を検査する。
+	uint64_t objs = 0;
+	for (calls = 1; ; calls++) {
+		ASSERT_EQ(slab_verify(&slab, 10, &v), 0);
+		objs += v.v_objs;
+		if (v.v_done) {
+			break;
+		}
+	}
+	ASSERT_GT(calls, 1);
+	ASSERT_EQ(objs, 100);
+
+	// 開放後の書き込みを検出する。
+	((char *)bufs[10])[5] = 0;
+	ASSERT_EQ(slab_verify(&slab, 0, &v), -EFAULT);
+	ASSERT_EQ(v.v_bad_poison, 1);
+	ASSERT_EQ(v.v_bad, (char *)bufs[10] + 5);
+	((char *)bufs[10])[5] = SLAB_POISON;
+
+	// オーバーランを検出する。
+	memcpy(ftr, (char *)bufs[60] + 64, TEST_FTR_SZ);
+	memset((char *)bufs[60] + 64, 0, TEST_FTR_SZ);
+	ASSERT_EQ(slab_verify(&slab, 0, &v), -EFAULT);
+	ASSERT_EQ(v.v_bad_ftr, 1);
+	ASSERT_EQ(v.v_bad, bufs[60]);
+	memcpy((char *)bufs[60] + 64, ftr, TEST_FTR_SZ);
+
+	// 空きリストの破壊を検出する。
+	saved = *(void **)((char *)bufs[20] - TEST_HDR_SZ);
+	*(void **)((char *)bufs[20] - TEST_HDR_SZ) = &v;
+	ASSERT_EQ(slab_verify(&slab, 0, &v), -EFAULT);
+	ASSERT_GE(v.v_bad_list, 1);
+	*(void **)((char *)bufs[20] - TEST_HDR_SZ) = saved;
+
+	ASSERT_EQ(slab_verify(&slab, 0, NULL), 0);
+	ASSERT_EQ(slab_free_bulk(bufs.data() + 50, 50), 0);
+	ASSERT_EQ(slab_verify(&slab, 0, &v), 0);
+	slab_shrink(&slab);
+}
+
+TEST(slab, slab_verify_lean) {
+	struct slab_cache slab;
+	struct slab_verify v;
+	void *bufs[10];
+
+	INIT_SLAB(&slab, 32, SLAB_NODE_SZ_MIN, 0);
+	slab_set_flags(&slab, SLAB_F_LEAN | SLAB_F_POISON);
+	ASSERT_EQ(slab_alloc_bulk(&slab, bufs, 10), 10);
+	for (auto b : bufs) {
+		memset(b, 0, 32);
+	}
+	ASSERT_EQ(slab_cache_free_bulk(&slab, bufs, 5), 0);
+	ASSERT_EQ(slab_verify(&slab, 0, &v), 0);
+	ASSERT_EQ(v.v_objs, 5);
+
+	((char *)bufs[2])[31] = 0;
+	ASSERT_EQ(slab_verify(&slab, 0, &v), -EFAULT);
+	ASSERT_EQ(v.v_bad_poison, 1);
+	((char *)bufs[2])[31] = SLAB_POISON;
+
+	ASSERT_EQ(slab_cache_free_bulk(&slab, bufs + 5, 5), 0);
+	ASSERT_EQ(slab_verify(&slab, 0, &v), 0);
+}
+
+static int test_dtor_cnt;
+
+static void
+test_dtor(void *buf, size_t size)
+{
+	test_dtor_cnt++;
+}
+
+TEST(slab, slab_create) {
+	struct slab_cache *slab;
+	char name[16] = "created";
+	void *bufs[10];
+
+	slab = slab_create(name, 13, 8, SLAB_NODE_SZ_MIN, 0, 0);
+	ASSERT_NE(slab, (struct slab_cache *)NULL);
+	memset(name, 0, sizeof(name));
+	ASSERT_STREQ(slab->s_name, "created");
+	ASSERT_EQ(slab_find("created"), slab);
+	ASSERT_EQ(slab->s_size, 13);
+	ASSERT_EQ(slab->s_align, 8);
+	ASSERT_EQ(slab->s_node_size, SLAB_NODE_SZ_MIN);
+
+	// slab_set_flagsはslab_createで作成したことを消さない。
+	slab_set_flags(slab, SLAB_F_POISON);
+	ASSERT_EQ(slab->s_flags, SLAB_F_POISON | SLAB_F_CREATED);
+
+	for (auto &b : bufs) {
+		b = slab_alloc(slab);
+		ASSERT_EQ((uintptr_t)b & 7, 0);
+	}
+	ASSERT_EQ(slab_free_bulk(bufs, 10), 0);
+	ASSERT_EQ(slab_destroy(slab, 0), 0);
+	ASSERT_EQ(slab_find("created"), (struct slab_cache *)NULL);
+
+	ASSERT_EQ(slab_create("bad", 16, 3, 0, 0, 0), (struct slab_cache *)NULL);
+	ASSERT_EQ(slab_create("bad", 0, 0, 0, 0, 0), (struct slab_cache *)NULL);
+	slab = slab_create("default", 16, 0, 0, 0, 0);
+	ASSERT_EQ(slab->s_node_size, SLAB_DEFAULT_SZ);
+	ASSERT_EQ(slab_destroy(slab, 0), 0);
+}
+
+TEST(slab, slab_destroy) {
+	struct slab_cache *slab;
+	void *bufs[100];
+
+	// 開放されていないバッファの数を返し、デストラクタを実行する。
+	slab = slab_create("leaky", 64, 0, SLAB_NODE_SZ_MIN, 0, 0);
+	slab_set_destructor(slab, test_dtor);
+	ASSERT_EQ(slab_alloc_bulk(slab, bufs, 100), 100);
+	ASSERT_EQ(slab_free_bulk(bufs, 40), 0);
+	test_dtor_cnt = 0;
+	ASSERT_EQ(slab_destroy(slab, SLAB_DESTROY_DTOR), 60);
+	ASSERT_EQ(test_dtor_cnt, 60);
+
+	// 指定しない場合はデストラクタを実行しない。
+	slab = slab_create("leaky", 64, 0, SLAB_NODE_SZ_MIN, 0, SLAB_F_LEAN);
+	slab_set_destructor(slab, test_dtor);
+	ASSERT_EQ(slab_alloc_bulk(slab, bufs, 10), 10);
+	test_dtor_cnt = 0;
+	ASSERT_EQ(slab_destroy(slab, 0), 10);
+	ASSERT_EQ(test_dtor_cnt, 0);
+}
+
+TEST(slab, slab_destroy_magazine) {
+	struct slab_cache slab;
+	struct slab_stats st;
+	bool held = false;
+	bool destroyed = false;
+	std::mutex mtx;
+	std::condition_variable cv;
+	void *buf;
+
+	// 他スレッドのマガジンに要素が残ったまま破棄する。
+	INIT_SLAB_DEF(&slab, 64);
+	slab_set_magazine(&slab, 16);
+	slab_register(&slab);
+	std::thread th([&]() {
+		void *b = slab_alloc(&slab);
+		slab_free(b);
+		std::unique_lock<std::mutex> lk(mtx);
+		held = true;
+		cv.notify_all();
+		cv.wait(lk, [&] { return destroyed; });
+	});
+	{
+		std::unique_lock<std::mutex> lk(mtx);
+		cv.wait(lk, [&] { return held; });
+	}
+	buf = slab_alloc(&slab);
+	ASSERT_NE(buf, (void *)NULL);
+	ASSERT_EQ(slab_destroy(&slab, 0), 1);
+	ASSERT_EQ(slab_find("&slab"), (struct slab_cache *)NULL);
+	ASSERT_EQ(slab.s_node_cnt, 0);
+	{
+		std::unique_lock<std::mutex> lk(mtx);
+		destroyed = true;
+		cv.notify_all();
+	}
+	th.join();
+
+	// 破棄後に再度利用できる。
+	buf = slab_alloc(&slab);
+	ASSERT_NE(buf, (void *)NULL);
+	ASSERT_EQ(slab_free(buf), 0);
+	slab_magazine_flush();
+	ASSERT_EQ(slab_stats(&slab, &st), 0);
+	ASSERT_EQ(st.st_buf_cnt, 0);
+	ASSERT_EQ(slab_destroy(&slab, 0), 0);
+}
+
+TEST(slab, slab_destroy_mag_id) {
+	struct slab_cache *slab;
+	uint32_t id;
+	void *buf;
+
+	// 破棄したslabのマガジン識別子は再利用する。
+	for (int i = 0; i < 100; i++) {
+		slab = slab_create("mag_id", 64, 0, SLAB_NODE_SZ_MIN, 0, 0);
+		ASSERT_EQ(slab_set_magazine(slab, 8), 0);
+		if (!i) {
+			id = slab->s_mag_id;
+		}
+		ASSERT_EQ(slab->s_mag_id, id);
+		buf = slab_alloc(slab);
+		ASSERT_EQ(slab_free(buf), 0);
+		ASSERT_EQ(slab_destroy(slab, 0), 0);
+	}
+}
+
+static int test_ctor_cnt;
+
+static void
+test_ctor(void *buf, size_t size)
+{
+	test_ctor_cnt++;
+	memset(buf, 0xA5, size);
+}
+
+TEST(slab, slab_ctor_once) {
+	struct slab_cache slab;
+	void *bufs[10];
+
+	INIT_SLAB(&slab, 64, SLAB_NODE_SZ_MIN, 0);
+	slab_set_flags(&slab, SLAB_F_CTOR_ONCE);
+	slab_set_constructor(&slab, test_ctor);
+	slab_set_destructor(&slab, test_dtor);
+	slab_set_keep_empty(&slab, 1);
+	test_ctor_cnt = 0;
+	test_dtor_cnt = 0;
+
+	// 再利用した要素は構築済みのまま返す。
+	for (int loop = 0; loop < 3; loop++) {
+		ASSERT_EQ(slab_alloc_bulk(&slab, bufs, 10), 10);
+		for (auto b : bufs) {
+			ASSERT_EQ(((unsigned char *)b)[0], 0xA5);
+			ASSERT_EQ(((unsigned char *)b)[63], 0xA5);
+		}
+		ASSERT_EQ(slab_free_bulk(bufs, 10), 0);
+	}
+	ASSERT_EQ(test_ctor_cnt, 10);
+	ASSERT_EQ(test_dtor_cnt, 0);
+
+	// 1個ずつ獲得した場合も同様。
+	for (auto &b : bufs) {
+		b = slab_alloc(&slab);
+	}
+	ASSERT_EQ(test_ctor_cnt, 10);
+	for (auto b : bufs) {
+		ASSERT_EQ(slab_free(b), 0);
+	}
+
+	// nodeの開放時に構築済みの要素のデストラクタを実行する。
+	ASSERT_EQ(slab_shrink(&slab), 1);
+	ASSERT_EQ(test_dtor_cnt, 10);
+}
+
+TEST(slab, slab_ctor_once_magazine) {
+	struct slab_cache *slab;
+	void *bufs[20];
+
+	slab = slab_create("ctor_once", 64, 0, SLAB_NODE_SZ_MIN, 0,
+			   SLAB_F_CTOR_ONCE);
+	slab_set_constructor(slab, test_ctor);
+	slab_set_destructor(slab, test_dtor);
+	slab_set_magazine(slab, 8);
+	test_ctor_cnt = 0;
+	test_dtor_cnt = 0;
+	for (int loop = 0; loop < 3; loop++) {
+		for (auto &b : bufs) {
+			b = slab_alloc(slab);
+		}
+		for (auto b : bufs) {
+			ASSERT_EQ(slab_free(b), 0);
+		}
+	}
+	ASSERT_EQ(test_ctor_cnt, 20);
+	ASSERT_EQ(test_dtor_cnt, 0);
+
+	// 使用中のバッファはSLAB_DESTROY_DTORを指定しない限り
+	// デストラクタを実行しない。
+	for (int i = 0; i < 5; i++) {
+		bufs[i] = slab_alloc(slab);
+	}
+	ASSERT_EQ(slab_destroy(slab, 0), 5);
+	ASSERT_EQ(test_dtor_cnt, test_ctor_cnt - 5);
+	slab_magazine_flush();
+}
+
+TEST(slab, slab_ctor_once_invalid) {
+	struct slab_cache slab;
+
+	INIT_SLAB(&slab, 64, SLAB_NODE_SZ_MIN, 0);
+	slab_set_flags(&slab, SLAB_F_CTOR_ONCE | SLAB_F_POISON);
+	ASSERT_EQ((int64_t)slab_alloc(&slab), -EINVAL);
+	slab_set_flags(&slab, SLAB_F_CTOR_ONCE | SLAB_F_LEAN);
+	ASSERT_EQ((int64_t)slab_alloc(&slab), -EINVAL);
+}
+
+TEST(slab, slab_set_align) {
+	struct slab_cache slab;
+	struct slab_stats st;
+	std::vector<void*> bufs(100);
+	std::vector<uintptr_t> firsts;
+
+	INIT_SLAB(&slab, 100, SLAB_NODE_SZ_MIN, 0);
+	ASSERT_EQ(slab_set_align(&slab, 3), -EINVAL);
+	ASSERT_EQ(slab_set_align(&slab, 64), 0);
+	ASSERT_EQ(slab_stats(&slab, &st), 0);
+	ASSERT_EQ(st.st_node_objs, 20);
+
+	ASSERT_EQ(slab_alloc_bulk(&slab, bufs.data(), 100), 100);
+	ASSERT_EQ(slab_set_align(&slab, 128), -EBUSY);
+	for (auto b : bufs) {
+		ASSERT_EQ((uintptr_t)b & 63, 0);
+	}
+
+	// nodeごとに先頭のバッファの位置をずらす。
+	// 要素の間隔は192、nodeの余りは104のため、色は2つ。
+	for (size_t i = 0; i < bufs.size(); i += 20) {
+		firsts.push_back((uintptr_t)bufs[i] & (SLAB_NODE_SZ_MIN - 1));
+	}
+	ASSERT_EQ(firsts[0], 192);
+	ASSERT_EQ(firsts[1], 256);
+	ASSERT_EQ(firsts[2], 192);
+	ASSERT_EQ(slab_free_bulk(bufs.data(), 100), 0);
+
+	// leanのslab
+	INIT_SLAB(&slab, 24, SLAB_NODE_SZ_MIN, 0);
+	slab_set_flags(&slab, SLAB_F_LEAN);
+	ASSERT_EQ(slab_set_align(&slab, 32), 0);
+	ASSERT_EQ(slab_alloc_bulk(&slab, bufs.data(), 100), 100);
+	for (auto b : bufs) {
+		ASSERT_EQ((uintptr_t)b & 31, 0);
+	}
+	ASSERT_EQ((char *)bufs[1] - (char *)bufs[0], 32);
+	ASSERT_EQ(slab_cache_free_bulk(&slab, bufs.data(), 100), 0);
+
+	// 境界を指定しない場合も、ヘッダ、フッタはポインタ境界に配置する。
+	INIT_SLAB(&slab, 4, SLAB_NODE_SZ_MIN, 0);
+	ASSERT_EQ(slab_alloc_bulk(&slab, bufs.data(), 10), 10);
+	for (int i = 0; i < 10; i++) {
+		ASSERT_EQ((uintptr_t)bufs[i] & (sizeof(void *) - 1), 0);
+	}
+	ASSERT_EQ((char *)bufs[1] - (char *)bufs[0], 64);
+	ASSERT_EQ(slab_free_bulk(bufs.data(), 10), 0);
+
+	// ページ境界
+	INIT_SLAB(&slab, 4000, SLAB_DEFAULT_SZ, 0);
+	ASSERT_EQ(slab_set_align(&slab, 4096), 0);
+	ASSERT_EQ(slab_alloc_bulk(&slab, bufs.data(), 10), 10);
+	for (int i = 0; i < 10; i++) {
+		ASSERT_EQ((uintptr_t)bufs[i] & 4095, 0);
+	}
+	ASSERT_EQ(slab_free_bulk(bufs.data(), 10), 0);
+}
+
+// 保持しているバッファを開放するshrinker
+struct test_shrinker {
+	struct slab_shrinker	sh;
+	std::vector<void*>	bufs;
+	int			calls;
+};
+
+static size_t
+test_shrink(struct slab_shrinker *sh, size_t bytes)
+{
+	struct test_shrinker *t = (struct test_shrinker *)sh->sh_arg;
+	size_t cnt = 0;
+
+	t->calls++;
+	// 1node分(SLAB_NODE_SZ_MIN / 1024)ずつ開放する。
+	while (!t->bufs.empty() && cnt < 4) {
+		slab_free(t->bufs.back());
+		t->bufs.pop_back();
+		cnt++;
+	}
+	return cnt;
+}
+
+TEST(slab, slab_set_budget) {
+	struct slab_cache slab;
+	struct slab_cache keep;
+	struct test_shrinker t;
+	void *buf;
+	// 失敗しても上限を元に戻す。
+	struct reset {
+		~reset() { slab_set_budget(0); }
+	} reset;
+
+	// 1nodeに3要素、上限は4node分。
+	INIT_SLAB(&slab, 1024, SLAB_NODE_SZ_MIN, 0);
+	INIT_SLAB(&keep, 64, SLAB_NODE_SZ_MIN, 0);
+	slab_set_keep_empty(&keep, 2);
+	slab_register(&keep);
+	slab_set_budget(slab_usage() + 4 * SLAB_NODE_SZ_MIN);
+
+	// 保持している空きnodeを先に開放する。
+	std::vector<void*> kbufs(60);
+	ASSERT_EQ(slab_alloc_bulk(&keep, kbufs.data(), 60), 60);
+	ASSERT_EQ(keep.s_node_cnt, 2);
+	ASSERT_EQ(slab_free_bulk(kbufs.data(), 60), 0);
+	ASSERT_EQ(keep.s_node_cnt, 2);
+	for (int i = 0; i < 12; i++) {
+		buf = slab_alloc(&slab);
+		ASSERT_FALSE((intptr_t)buf < 0 && (intptr_t)buf > -4096) << i;
+		t.bufs.push_back(buf);
+	}
+	ASSERT_EQ(keep.s_node_cnt, 0);
+	ASSERT_EQ(slab.s_node_cnt, 4);
+	ASSERT_EQ((int64_t)slab_alloc(&slab), -ENOMEM);
+
+	// shrinkerで開放して獲得する。
+	t.sh.sh_scan = test_shrink;
+	t.sh.sh_arg = &t;
+	t.calls = 0;
+	slab_shrinker_register(&t.sh);
+	buf = slab_alloc(&slab);
+	ASSERT_FALSE((intptr_t)buf < 0 && (intptr_t)buf > -4096);
+	ASSERT_EQ(t.calls, 1);
+	ASSERT_EQ(t.bufs.size(), 8);
+	ASSERT_LE(slab.s_node_cnt, 4);
+	t.bufs.push_back(buf);
+
+	slab_shrinker_unregister(&t.sh);
+	ASSERT_EQ(slab_free_bulk(t.bufs.data(), t.bufs.size()), 0);
+	slab_unregister(&keep);
+	ASSERT_EQ(slab.s_node_cnt, 0);
+}
+
+TEST(slab, slab_free_deferred) {
+	struct slab_cache slab;
+	struct slab_stats st;
+	bool entered = false;
+	bool leave = false;
+	std::mutex mtx;
+	std::condition_variable cv;
+	void *buf;
+
+	INIT_SLAB_DEF(&slab, 64);
+	slab_set_destructor(&slab, test_dtor);
+	test_dtor_cnt = 0;
+	ASSERT_EQ(slab_free_deferred(NULL), -EFAULT);
+
+	// 区間内のスレッドがいる間は返却しない。
+	std::thread reader([&]() {
+		ASSERT_EQ(slab_epoch_enter(), 0);
+		std::unique_lock<std::mutex> lk(mtx);
+		entered = true;
+		cv.notify_all();
+		cv.wait(lk, [&] { return leave; });
+		slab_epoch_exit();
+	});
+	{
+		std::unique_lock<std::mutex> lk(mtx);
+		cv.wait(lk, [&] { return entered; });
+	}
+	buf = slab_alloc(&slab);
+	ASSERT_EQ(slab_free_deferred(buf), 0);
+	for (int i = 0; i < 10; i++) {
+		ASSERT_EQ(slab_deferred_reclaim(), 1);
+	}
+	ASSERT_EQ(test_dtor_cnt, 0);
+	ASSERT_EQ(slab_stats(&slab, &st), 0);
+	ASSERT_EQ(st.st_buf_cnt, 1);
+
+	{
+		std::unique_lock<std::mutex> lk(mtx);
+		leave = true;
+		cv.notify_all();
+	}
+	reader.join();
+	ASSERT_EQ(slab_deferred_barrier(), 0);
+	ASSERT_EQ(test_dtor_cnt, 1);
+	ASSERT_EQ(slab_stats(&slab, &st), 0);
+	ASSERT_EQ(st.st_buf_cnt, 0);
+
+	// 入れ子の区間内ではbarrierを待てない。
+	ASSERT_EQ(slab_epoch_enter(), 0);
+	ASSERT_EQ(slab_epoch_enter(), 0);
+	slab_epoch_exit();
+	ASSERT_EQ(slab_deferred_barrier(), -EBUSY);
+	slab_epoch_exit();
+	ASSERT_EQ(slab_deferred_barrier(), 0);
+
+	// 区間外でのslab_epoch_exitは無視する。
+	slab_epoch_exit();
+	ASSERT_EQ(slab_epoch_enter(), 0);
+	ASSERT_EQ(slab_deferred_barrier(), -EBUSY);
+	slab_epoch_exit();
+	ASSERT_EQ(slab_deferred_barrier(), 0);
+	std::thread([]() {
+		slab_epoch_exit();
+	}).join();
+}
+
+TEST(slab, slab_free_deferred_multithread) {
+	struct slab_cache slab;
+	struct slab_stats st;
+	std::atomic<uint64_t *> shared;
+	std::atomic<bool> stop(false);
+	std::atomic<uint64_t> bad(0);
+	std::vector<std::thread> readers;
+	uint64_t *obj;
+
+	// 開放したバッファはSLAB_POISONで埋まるため、読み出し側が開放済みの
+	// バッファを参照すると検出できる。
+	INIT_SLAB(&slab, 64, SLAB_NODE_SZ_MIN, 0);
+	slab_set_flags(&slab, SLAB_F_POISON);
+	obj = (uint64_t *)slab_alloc(&slab);
+	*obj = 0x1234;
+	shared.store(obj);
+	for (int t = 0; t < 4; t++) {
+		readers.emplace_back([&]() {
+			while (!stop.load(std::memory_order_relaxed)) {
+				slab_epoch_enter();
+				uint64_t *p = shared.load(std::memory_order_acquire);
+				for (int i = 0; i < 8; i++) {
+					if (__atomic_load_n(p, __ATOMIC_RELAXED)
+								 != 0x1234) {
+						bad++;
+					}
+				}
+				slab_epoch_exit();
+			}
+		});
+	}
+	for (int i = 0; i < 20000; i++) {
+		obj = (uint64_t *)slab_alloc(&slab);
+		*obj = 0x1234;
+		ASSERT_EQ(slab_free_deferred(shared.exchange(obj)), 0);
+	}
+	stop = true;
+	for (auto &th : readers) {
+		th.join();
+	}
+	ASSERT_EQ(bad, 0);
+
+	// 終了したスレッドが遅延開放したバッファも返却する。
+	std::thread([&]() {
+		ASSERT_EQ(slab_free_deferred(shared.exchange(NULL)), 0);
+	}).join();
+	ASSERT_EQ(slab_deferred_barrier(), 0);
+	ASSERT_EQ(slab_stats(&slab, &st), 0);
+	ASSERT_EQ(st.st_buf_cnt, 0);
+}
+
 TEST(slab, slab_set_constructor) {
 }
 
 TEST(slab, slab_set_destructor) {
 }
 
+TEST(slab, slab_set_magazine) {
+	struct slab_cache slab;
+	char *slab_bufer[1024];
+	int i;
+	int rc;
+
+	INIT_SLAB(&slab, 256, 1048576, 0);
+	ASSERT_EQ(slab_set_magazine(&slab, SLAB_MAGAZINE_MAX + 1), -EINVAL);
+	ASSERT_EQ(slab_set_magazine(&slab, SLAB_MAGAZINE_SZ), 0);
+	ASSERT_NE(slab.s_mag_id, 0);
+	ASSERT_EQ(slab.s_mag_size, SLAB_MAGAZINE_SZ);
+
+	for (i = 0; i < 1024; i++) {
+		slab_bufer[i] = (char*)slab_alloc(&slab);
+		ASSERT_NE((int64_t)slab_bufer[i], -ENOMEM);
+		ASSERT_EQ(slab_get_refcnt(slab_bufer[i]), 1);
+	}
+	for (i = 0; i < 1024; i++) {
+		rc = slab_free(slab_bufer[i]);
+		EXPECT_EQ(rc, 0);
+	}
+
+	// マガジンに保持されている分はslabから見て獲得済み。
+	ASSERT_LE(slab.s_buf_cnt, SLAB_MAGAZINE_SZ);
+	slab_magazine_flush();
+	ASSERT_EQ(slab.s_buf_cnt, 0);
+	ASSERT_EQ(slab.s_node_cnt, 0);
+}
+
+TEST(slab, slab_magazine_multithread) {
+	static struct slab_cache slab = SLAB_INIT_DEF(slab, 64);
+	std::vector<std::thread> threads;
+	int t;
+
+	ASSERT_EQ(slab_set_magazine(&slab, SLAB_MAGAZINE_SZ), 0);
+	for (t = 0; t < 8; t++) {
+		threads.push_back(std::thread([t]() {
+			char *bufs[256];
+			int loop;
+			int i;
+
+			for (loop = 0; loop < 1000; loop++) {
+				for (i = 0; i < 256; i++) {
+					bufs[i] = (char*)slab_alloc(&slab);
+					ASSERT_NE((int64_t)bufs[i], -ENOMEM);
+					memset(bufs[i], t, 64);
+				}
+				for (i = 0; i < 256; i++) {
+					ASSERT_EQ(bufs[i][0], t);
+					ASSERT_EQ(bufs[i][63], t);
+					ASSERT_EQ(slab_free(bufs[i]), 0);
+				}
+			}
+		}));
+	}
+	for (auto &th : threads) {
+		th.join();
+	}
+
+	// スレッド終了時にマガジンはslabへ返却される。
+	ASSERT_EQ(slab.s_buf_cnt, 0);
+	ASSERT_EQ(slab.s_node_cnt, 0);
+}
+
+TEST(slab, slab_magazine_cross_thread_free) {
+	static struct slab_cache slab = SLAB_INIT_DEF(slab, 128);
+	std::vector<void*> bufs(10000);
 
+	ASSERT_EQ(slab_set_magazine(&slab, SLAB_MAGAZINE_SZ), 0);
+	std::thread producer([&bufs]() {
+		for (auto &b : bufs) {
+			b = slab_alloc(&slab);
+		}
+	});
+	producer.join();
+
+	std::thread consumer([&bufs]() {
+		for (auto b : bufs) {
+			ASSERT_EQ(slab_free(b), 0);
+		}
+	});
+	consumer.join();
+
+	ASSERT_EQ(slab.s_buf_cnt, 0);
+	ASSERT_EQ(slab.s_node_cnt, 0);
+}
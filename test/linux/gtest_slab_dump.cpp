@@ -0,0 +1,165 @@
+﻿/* --
+ *
+ * MIT License
+ * 
+ * Copyright (c) 2017 Abe Takafumi
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libsharaku/pool/slab_dump.h>
+#include <gtest/gtest.h>
+#include <errno.h>
+#include <string>
+
+static SLAB_DEFINE_DEF(test_dump_cache, 100);
+
+// fpに出力した内容を文字列で取得する。
+static std::string
+test_dump(int (*dump)(FILE *fp), int *cnt)
+{
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *fp;
+	std::string str;
+
+	fp = open_memstream(&buf, &len);
+	*cnt = dump(fp);
+	fclose(fp);
+	str = buf;
+	free(buf);
+	return str;
+}
+
+TEST(slab_dump, SLAB_DEFINE) {
+	ASSERT_EQ(slab_find("test_dump_cache"), &test_dump_cache);
+	ASSERT_EQ(slab_find("no_such_cache"), (struct slab_cache *)NULL);
+	ASSERT_EQ(slab_register(&test_dump_cache), -EBUSY);
+}
+
+TEST(slab_dump, slab_dump) {
+	std::string str;
+	void *bufs[10];
+	char line[256];
+	int cnt;
+
+	for (auto &b : bufs) {
+		b = slab_alloc(&test_dump_cache);
+	}
+	str = test_dump(slab_dump, &cnt);
+	ASSERT_GE(cnt, 1);
+	ASSERT_EQ(str.compare(0, 6, "# name"), 0);
+	ASSERT_EQ(slab_dump(NULL), -EINVAL);
+
+	// objsize、objpernode、active、total、nodes、bytes
+	// 要素の間隔はバッファをポインタ境界へ切り上げた104にヘッダ、フッタを足す。
+	snprintf(line, sizeof(line),
+		 "%-24s %8d %10zu %10d %10zu %8d %12d\n",
+		 "test_dump_cache", 100,
+		 (size_t)(SLAB_DEFAULT_SZ - sizeof(struct slab_node))
+		 / (104 + 8 + 32 + 16),
+		 10,
+		 (size_t)(SLAB_DEFAULT_SZ - sizeof(struct slab_node))
+		 / (104 + 8 + 32 + 16),
+		 1, SLAB_DEFAULT_SZ);
+	ASSERT_NE(str.find(line), std::string::npos) << str << line;
+
+	ASSERT_EQ(slab_free_bulk(bufs, 10), 0);
+}
+
+TEST(slab_dump, slab_dump_json) {
+	struct slab_cache slab;
+	std::string str;
+	int cnt;
+
+	INIT_SLAB_DEF(&slab, 64);
+	slab_set_name(&slab, "quote\"back\\slash");
+	ASSERT_EQ(slab_register(&slab), 0);
+	str = test_dump(slab_dump_json, &cnt);
+	slab_unregister(&slab);
+
+	ASSERT_GE(cnt, 2);
+	ASSERT_EQ(str.front(), '[');
+	ASSERT_EQ(str.compare(str.size() - 3, 3, "\n]\n"), 0);
+	ASSERT_NE(str.find("\"name\": \"test_dump_cache\", \"objsize\": 100"),
+		  std::string::npos) << str;
+	ASSERT_NE(str.find("\"name\": \"quote\\\"back\\\\slash\""),
+		  std::string::npos) << str;
+	ASSERT_NE(str.find("\"bins\": [0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0]"),
+		  std::string::npos) << str;
+}
+
+TEST(slab_dump, slab_profile_dump) {
+	std::string str;
+	char site[256];
+	void *bufs[3];
+	int line;
+	int cnt;
+
+	for (auto &b : bufs) {
+		line = __LINE__; b = slab_alloc(&test_dump_cache);
+	}
+	str = test_dump(slab_profile_dump, &cnt);
+	ASSERT_GE(cnt, 1);
+	ASSERT_EQ(str.compare(0, 6, "# objs"), 0);
+	snprintf(site, sizeof(site), "%10d %12d %-24s %s:%d\n",
+		 3, 300, "test_dump_cache", __FILE__, line);
+	ASSERT_NE(str.find(site), std::string::npos) << str << site;
+	ASSERT_EQ(slab_profile_dump(NULL), -EINVAL);
+
+	ASSERT_EQ(slab_free_bulk(bufs, 3), 0);
+}
+
+TEST(slab_dump, slab_dump_leaks) {
+	struct slab_cache slab;
+	std::string str;
+	char buf[256];
+	void *bufs[4];
+	size_t len;
+	FILE *fp;
+	int line;
+
+	INIT_SLAB_DEF(&slab, 32);
+	slab_set_name(&slab, "leaks");
+	for (auto &b : bufs) {
+		line = __LINE__; b = slab_alloc(&slab);
+	}
+	ASSERT_EQ(slab_free(bufs[0]), 0);
+
+	memset(buf, 0, sizeof(buf));
+	fp = fmemopen(buf, sizeof(buf) - 1, "w");
+	ASSERT_EQ(slab_dump_leaks(&slab, fp), 3);
+	fclose(fp);
+	str = buf;
+	ASSERT_EQ(str.find("leaks: 3 objects (96 bytes) outstanding\n"), 0)
+		<< str;
+	snprintf(buf, sizeof(buf), "%s:%d", __FILE__, line);
+	ASSERT_NE(str.find(buf), std::string::npos) << str;
+
+	ASSERT_EQ(slab_free_bulk(bufs + 1, 3), 0);
+	fp = open_memstream((char **)&bufs[0], &len);
+	ASSERT_EQ(slab_dump_leaks(&slab, fp), 0);
+	fclose(fp);
+	ASSERT_EQ(len, 0);
+	free(bufs[0]);
+}
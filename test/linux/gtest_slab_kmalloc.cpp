@@ -0,0 +1,107 @@
+﻿/* --
+ *
+ * MIT License
+ * 
+ * Copyright (c) 2017 Abe Takafumi
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <libsharaku/pool/slab_kmalloc.h>
+#include <gtest/gtest.h>
+#include <errno.h>
+#include <thread>
+#include <vector>
+
+TEST(slab_kmalloc, slab_kmalloc) {
+	size_t sizes[] = { 0, 1, 16, 17, 100, 128, 129, 1000, 4096, 5000,
+			   SLAB_KMALLOC_MAX };
+	void *buf;
+
+	for (size_t size : sizes) {
+		buf = slab_kmalloc(size);
+		ASSERT_NE(buf, (void*)NULL);
+		ASSERT_EQ((uintptr_t)buf & 15, 0);
+		ASSERT_GE(slab_ksize(buf), size);
+		ASSERT_LE(slab_ksize(buf), size + size / 2 + 16);
+		memset(buf, 0xA5, size);
+		ASSERT_EQ(slab_kfree(buf), 0);
+	}
+	ASSERT_EQ(slab_kfree(NULL), 0);
+}
+
+TEST(slab_kmalloc, slab_kmalloc_class) {
+	void *buf1;
+	void *buf2;
+
+	// 同じサイズクラスは同じslab_cacheから獲得される。
+	buf1 = slab_kmalloc(33);
+	buf2 = slab_kmalloc(48);
+	ASSERT_EQ(slab_ksize(buf1), 48);
+	ASSERT_EQ(slab_ksize(buf2), 48);
+	ASSERT_EQ(((struct slab_node *)((uintptr_t)buf1
+		   & ~((uintptr_t)SLAB_KMALLOC_NODE_SZ - 1)))->sn_slab,
+		  ((struct slab_node *)((uintptr_t)buf2
+		   & ~((uintptr_t)SLAB_KMALLOC_NODE_SZ - 1)))->sn_slab);
+	ASSERT_EQ(slab_kfree(buf1), 0);
+	ASSERT_EQ(slab_kfree(buf2), 0);
+}
+
+TEST(slab_kmalloc, slab_kmalloc_large) {
+	size_t size = SLAB_KMALLOC_MAX + 1;
+	char *buf;
+
+	buf = (char *)slab_kmalloc(size);
+	ASSERT_NE(buf, (char*)NULL);
+	ASSERT_EQ((uintptr_t)buf & 15, 0);
+	ASSERT_EQ(slab_ksize(buf), size);
+	memset(buf, 0xA5, size);
+	ASSERT_EQ(slab_kfree(buf), 0);
+
+	buf = (char *)slab_kmalloc(3 * SLAB_KMALLOC_NODE_SZ);
+	ASSERT_NE(buf, (char*)NULL);
+	ASSERT_EQ(slab_ksize(buf), 3 * SLAB_KMALLOC_NODE_SZ);
+	buf[3 * SLAB_KMALLOC_NODE_SZ - 1] = 1;
+	// 先頭以外のアドレスは開放できない。
+	ASSERT_EQ(slab_kfree(buf + 16), -EFAULT);
+	ASSERT_EQ(slab_kfree(buf), 0);
+}
+
+TEST(slab_kmalloc, slab_kmalloc_multithread) {
+	std::vector<std::thread> threads;
+
+	for (int i = 0; i < 4; i++) {
+		threads.emplace_back([i]() {
+			std::vector<void*> bufs;
+			for (int j = 0; j < 10000; j++) {
+				bufs.push_back(slab_kmalloc((j * 7 + i) % 10000));
+			}
+			for (void *buf : bufs) {
+				ASSERT_EQ(slab_kfree(buf), 0);
+			}
+		});
+	}
+	for (auto &th : threads) {
+		th.join();
+	}
+}
@@ -0,0 +1,136 @@
+﻿/* --
+ *
+ * MIT License
+ * 
+ * Copyright (c) 2017 Abe Takafumi
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <libsharaku/pool/slab_mmap.h>
+#include <gtest/gtest.h>
+#include <errno.h>
+#include <vector>
+
+#define TEST_RESERVE	(64UL << 20)
+
+TEST(slab_mmap, slab_mmap_init) {
+	int rc;
+
+	rc = slab_mmap_init(TEST_RESERVE, SLAB_MMAP_THP);
+	ASSERT_EQ(rc, 0);
+	rc = slab_mmap_init(TEST_RESERVE, SLAB_MMAP_THP);
+	ASSERT_EQ(rc, -EBUSY);
+}
+
+// ヒュージページを予約できない場合は通常のページで予約する。
+// MAP_NORESERVEでヒュージページを予約した場合は書き込みでSIGBUSとなる。
+static void
+test_hugetlb_fallback(void)
+{
+	char *mem;
+
+	if (slab_mmap_init(TEST_RESERVE, SLAB_MMAP_HUGETLB)) {
+		exit(1);
+	}
+	mem = (char*)slab_mmap_alloc(SLAB_DEFAULT_SZ, SLAB_DEFAULT_SZ);
+	if (!mem) {
+		exit(2);
+	}
+	memset(mem, 0xa5, SLAB_DEFAULT_SZ);
+	slab_mmap_free(mem);
+	exit(0);
+}
+
+TEST(slab_mmap, slab_mmap_init_hugetlb) {
+	FILE *fp;
+	long nr = -1;
+
+	fp = fopen("/proc/sys/vm/nr_hugepages", "r");
+	if (fp) {
+		if (fscanf(fp, "%ld", &nr) != 1) {
+			nr = -1;
+		}
+		fclose(fp);
+	}
+	if (nr != 0) {
+		GTEST_SKIP();
+	}
+	// 予約済みの領域を引き継がないように、新しいプロセスで実行する。
+	::testing::FLAGS_gtest_death_test_style = "threadsafe";
+	EXPECT_EXIT(test_hugetlb_fallback(), ::testing::ExitedWithCode(0), "");
+}
+
+TEST(slab_mmap, slab_mmap_alloc) {
+	char *mem1;
+	char *mem2;
+
+	mem1 = (char*)slab_mmap_alloc(SLAB_DEFAULT_SZ, SLAB_DEFAULT_SZ);
+	ASSERT_NE(mem1, (char*)NULL);
+	ASSERT_EQ((uintptr_t)mem1 & (SLAB_DEFAULT_SZ - 1), 0);
+	memset(mem1, 0xa5, SLAB_DEFAULT_SZ);
+
+	// 開放した領域は物理メモリを返却した上で再利用される。
+	slab_mmap_free(mem1);
+	mem2 = (char*)slab_mmap_alloc(SLAB_DEFAULT_SZ, SLAB_DEFAULT_SZ);
+	ASSERT_EQ(mem1, mem2);
+	ASSERT_EQ(mem2[0], 0);
+	ASSERT_EQ(mem2[SLAB_DEFAULT_SZ - 1], 0);
+	slab_mmap_free(mem2);
+
+	// 異なるサイズはそれぞれのサイズ境界に配置される。
+	mem1 = (char*)slab_mmap_alloc(SLAB_NODE_SZ_MIN, SLAB_NODE_SZ_MIN);
+	ASSERT_EQ((uintptr_t)mem1 & (SLAB_NODE_SZ_MIN - 1), 0);
+	mem2 = (char*)slab_mmap_alloc(65536, 65536);
+	ASSERT_EQ((uintptr_t)mem2 & 65535, 0);
+	slab_mmap_free(mem1);
+	slab_mmap_free(mem2);
+}
+
+TEST(slab_mmap, slab_mmap_alloc_fallback) {
+	std::vector<void*> mems;
+	size_t i;
+
+	// 予約した領域を使い切った場合もnodeを獲得できる。
+	for (i = 0; i < TEST_RESERVE / SLAB_DEFAULT_SZ + 8; i++) {
+		mems.push_back(slab_mmap_alloc(SLAB_DEFAULT_SZ, SLAB_DEFAULT_SZ));
+		ASSERT_NE(mems.back(), (void*)NULL);
+		ASSERT_EQ((uintptr_t)mems.back() & (SLAB_DEFAULT_SZ - 1), 0);
+	}
+	for (auto mem : mems) {
+		slab_mmap_free(mem);
+	}
+}
+
+TEST(slab_mmap, slab_set_mem_mmap) {
+	struct slab_cache slab;
+	std::vector<void*> bufs(100000);
+
+	INIT_SLAB_DEF(&slab, 32);
+	slab_set_flags(&slab, SLAB_F_LEAN);
+	slab_set_mem_mmap(&slab);
+	ASSERT_EQ(slab_alloc_bulk(&slab, bufs.data(), (int)bufs.size()),
+		  (int)bufs.size());
+	ASSERT_GT(slab.s_node_cnt, 1);
+	ASSERT_EQ(slab_cache_free_bulk(&slab, bufs.data(), (int)bufs.size()), 0);
+	ASSERT_EQ(slab.s_node_cnt, 0);
+}
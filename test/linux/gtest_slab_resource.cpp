@@ -0,0 +1,133 @@
+﻿/* --
+ *
+ * MIT License
+ * 
+ * Copyright (c) 2017 Abe Takafumi
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <libsharaku/pool/slab_resource.hpp>
+#include <gtest/gtest.h>
+#include <list>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// 獲得した領域がslab_kmallocのnodeに属するかを判定する。
+static bool
+test_is_slab(const void *buf)
+{
+	struct slab_node *node = (struct slab_node *)((uintptr_t)buf
+				 & ~((uintptr_t)SLAB_KMALLOC_NODE_SZ - 1));
+	return node->sn_slab != NULL;
+}
+
+TEST(slab_resource, slab_allocator) {
+	std::list<int, slab_allocator<int>> list;
+	std::map<int, std::string, std::less<int>,
+		 slab_allocator<std::pair<const int, std::string>>> map;
+	std::unordered_map<int, int, std::hash<int>, std::equal_to<int>,
+		 slab_allocator<std::pair<const int, int>>> umap;
+
+	for (int i = 0; i < 10000; i++) {
+		list.push_back(i);
+		map[i] = std::to_string(i);
+		umap[i] = i * 2;
+	}
+	ASSERT_TRUE(test_is_slab(&list.front()));
+	ASSERT_TRUE(test_is_slab(&map.begin()->second));
+	ASSERT_TRUE(test_is_slab(&umap.begin()->second));
+	for (int i = 0; i < 10000; i++) {
+		ASSERT_EQ(map[i], std::to_string(i));
+		ASSERT_EQ(umap[i], i * 2);
+	}
+	list.clear();
+	map.clear();
+	umap.clear();
+	ASSERT_TRUE(slab_allocator<int>() == slab_allocator<long>());
+}
+
+struct alignas(64) test_align64 {
+	char	c;
+};
+
+struct alignas(32) test_align32 {
+	char	c;
+};
+
+TEST(slab_resource, slab_allocator_large) {
+	std::vector<int, slab_allocator<int>> vec;
+
+	// SLAB_KMALLOC_MAXを超えるとoperator newで獲得する。
+	for (int i = 0; i < 100000; i++) {
+		vec.push_back(i);
+	}
+	ASSERT_EQ(vec[99999], 99999);
+	vec.resize(16);
+	vec.shrink_to_fit();
+	ASSERT_TRUE(test_is_slab(vec.data()));
+	for (int i = 0; i < 16; i++) {
+		ASSERT_EQ(vec[i], i);
+	}
+
+	// SLAB_RESOURCE_ALIGNを超える境界の型は、その境界で獲得する。
+	std::vector<test_align64, slab_allocator<test_align64>> vec64;
+	std::vector<test_align32, slab_allocator<test_align32>> vec32;
+	for (int i = 0; i < 1000; i++) {
+		vec64.emplace_back();
+		vec32.emplace_back();
+		ASSERT_EQ((uintptr_t)vec64.data() % 64, 0);
+		ASSERT_EQ((uintptr_t)vec32.data() % 32, 0);
+	}
+	slab_allocator<test_align64> alloc;
+	for (size_t n = 1; n <= 64; n++) {
+		test_align64 *p = alloc.allocate(n);
+		ASSERT_EQ((uintptr_t)p % 64, 0);
+		alloc.deallocate(p, n);
+	}
+}
+
+#ifdef SLAB_HAVE_PMR
+TEST(slab_resource, slab_memory_resource) {
+	slab_memory_resource resource;
+	std::pmr::list<std::pmr::string> list(&resource);
+	std::pmr::unordered_map<int, int> umap(&resource);
+	void *buf;
+
+	for (int i = 0; i < 1000; i++) {
+		list.emplace_back("a long string that does not fit in SSO");
+		umap[i] = i;
+	}
+	ASSERT_TRUE(test_is_slab(&list.front()));
+	ASSERT_TRUE(test_is_slab(list.front().data()));
+
+	// 境界の大きな要求はupstreamで獲得する。
+	buf = resource.allocate(64, 64);
+	ASSERT_EQ((uintptr_t)buf % 64, 0);
+	resource.deallocate(buf, 64, 64);
+
+	ASSERT_TRUE(resource.is_equal(*slab_default_resource()));
+	ASSERT_FALSE(resource.is_equal(*std::pmr::new_delete_resource()));
+}
+#endif